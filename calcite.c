@@ -0,0 +1,163 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "phymodel.h"
+#include "calcite.h"
+
+#define simulator_calcite_slot(field,brick)	((size_t)((((uint64_t)(brick)) * 0x9E3779B97F4A7C15ULL) >> 32) & \
+						 ((field)->size - 1))
+
+static void
+simulator_calcite_allocate(struct simulatorcalcitefield* field,
+			   size_t size) {
+  size_t i;
+  field->bricks = (struct simulatorcalcitebrick*)malloc(size * sizeof(struct simulatorcalcitebrick));
+  if (field->bricks == 0) {
+    fatalz("cannot allocate calcite hash of entries", size);
+    return;
+  }
+  field->size = size;
+  field->nbricks = 0;
+  for (i = 0; i < size; i++) {
+    field->bricks[i].brick = simulatorcalcitefield_empty;
+    field->bricks[i].amounts = 0;
+  }
+}
+
+static struct simulatorcalcitebrick*
+simulator_calcite_find(const struct simulatorcalcitefield* field,
+		       size_t brick) {
+  size_t slot = simulator_calcite_slot(field,brick);
+  while (field->bricks[slot].brick != brick &&
+	 field->bricks[slot].brick != simulatorcalcitefield_empty) {
+    slot = (slot + 1) & (field->size - 1);
+  }
+  return(&field->bricks[slot]);
+}
+
+static void
+simulator_calcite_grow(struct simulatorcalcitefield* field) {
+  struct simulatorcalcitebrick* old = field->bricks;
+  size_t oldsize = field->size;
+  size_t nbricks = field->nbricks;
+  size_t i;
+  simulator_calcite_allocate(field,2 * oldsize);
+  for (i = 0; i < oldsize; i++) {
+    if (old[i].brick != simulatorcalcitefield_empty) {
+      *simulator_calcite_find(field,old[i].brick) = old[i];
+    }
+  }
+  field->nbricks = nbricks;
+  free(old);
+}
+
+static uint16_t*
+simulator_calcite_getamount(struct simulatorcalcitefield* field,
+			    struct phymodel* model,
+			    const struct atomcoordinates* atom) {
+  
+  size_t brick = phymodel_brickindex(model,atom->x,atom->y,atom->z);
+  struct simulatorcalcitebrick* entry;
+  
+  if (2 * (field->nbricks + 1) > field->size) simulator_calcite_grow(field);
+  entry = simulator_calcite_find(field,brick);
+  if (entry->brick == simulatorcalcitefield_empty) {
+    entry->amounts = (uint16_t*)calloc(phymodel_brickatoms,sizeof(uint16_t));
+    if (entry->amounts == 0) {
+      fatalz("cannot allocate calcite amounts of bytes", phymodel_brickatoms * sizeof(uint16_t));
+      return(0);
+    }
+    entry->brick = brick;
+    field->nbricks++;
+  }
+  return(&entry->amounts[phymodel_inbrickindex(atom->x,atom->y,atom->z)]);
+}
+
+void
+simulator_calcite_initialize(struct simulatorcalcitefield* field) {
+  simulator_calcite_allocate(field,simulatorcalcitefield_initialsize);
+}
+
+void
+simulator_calcite_deinitialize(struct simulatorcalcitefield* field) {
+  size_t i;
+  for (i = 0; i < field->size; i++) {
+    if (field->bricks[i].amounts != 0) free(field->bricks[i].amounts);
+  }
+  free(field->bricks);
+  memset(field,0xFF,sizeof(*field));
+}
+
+int
+simulator_calcite_add(struct simulatorcalcitefield* field,
+		      struct phymodel* model,
+		      const struct atomcoordinates* atom,
+		      double amount) {
+  
+  uint16_t* stored;
+  uint32_t total;
+  
+  /*
+   * Add the amount, in fractions of an atom, and tell if there is
+   * now at least a whole atom's worth
+   */
+  
+  assert(amount >= 0.0);
+  if (amount > 1.0) amount = 1.0;
+  stored = simulator_calcite_getamount(field,model,atom);
+  total = *stored + (uint32_t)(amount * simulatorcalcitefield_one + 0.5);
+  if (total > simulatorcalcitefield_max) total = simulatorcalcitefield_max;
+  *stored = (uint16_t)total;
+  deepdebugf("calcite at (%u,%u,%u) is now %.4f atoms",
+	     atom->x, atom->y, atom->z, (1.0 * total) / simulatorcalcitefield_one);
+  return(total >= simulatorcalcitefield_one);
+}
+
+void
+simulator_calcite_take(struct simulatorcalcitefield* field,
+		       struct phymodel* model,
+		       const struct atomcoordinates* atom) {
+  uint16_t* stored = simulator_calcite_getamount(field,model,atom);
+  assert(*stored >= simulatorcalcitefield_one);
+  *stored -= simulatorcalcitefield_one;
+}
+
+double
+simulator_calcite_amount(const struct simulatorcalcitefield* field,
+			 const struct phymodel* model,
+			 const struct atomcoordinates* atom) {
+  const struct simulatorcalcitebrick* entry =
+    simulator_calcite_find(field,phymodel_brickindex(model,atom->x,atom->y,atom->z));
+  if (entry->brick == simulatorcalcitefield_empty) return(0.0);
+  return((1.0 * entry->amounts[phymodel_inbrickindex(atom->x,atom->y,atom->z)]) /
+	 simulatorcalcitefield_one);
+}
@@ -0,0 +1,79 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef CALCITE_H
+#define CALCITE_H
+
+#include <stdint.h>
+#include "phymodel.h"
+#include "coords.h"
+
+/*
+ * The calcite that falling drops leave behind is accumulated in
+ * fractions of an atom, for each atom that has received any, until
+ * there is a whole atom's worth to turn into rock. The amounts are
+ * kept in 16-bit fixed point, with simulatorcalcitefield_one being
+ * one atom, and saturate at twice that. Only the bricks that have
+ * received calcite have a table of amounts, and these are found by
+ * brick index from a hash table with open addressing and linear
+ * probing; the table doubles when it becomes half full.
+ */
+
+#define simulatorcalcitefield_initialsize	64
+#define simulatorcalcitefield_empty		(~(size_t)0)
+#define simulatorcalcitefield_one		(1 << 15)
+#define simulatorcalcitefield_max		0xFFFF
+
+struct simulatorcalcitebrick {
+  size_t brick;                            /* brick index in the model */
+  uint16_t* amounts;                       /* phymodel_brickatoms amounts */
+};
+
+struct simulatorcalcitefield {
+  size_t nbricks;
+  size_t size;                             /* a power of two */
+  struct simulatorcalcitebrick* bricks;
+};
+
+extern void
+simulator_calcite_initialize(struct simulatorcalcitefield* field);
+extern void
+simulator_calcite_deinitialize(struct simulatorcalcitefield* field);
+extern int
+simulator_calcite_add(struct simulatorcalcitefield* field,
+		      struct phymodel* model,
+		      const struct atomcoordinates* atom,
+		      double amount);
+extern void
+simulator_calcite_take(struct simulatorcalcitefield* field,
+		       struct phymodel* model,
+		       const struct atomcoordinates* atom);
+extern double
+simulator_calcite_amount(const struct simulatorcalcitefield* field,
+			 const struct phymodel* model,
+			 const struct atomcoordinates* atom);
+
+#endif /* CALCITE_H */
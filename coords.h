@@ -27,12 +27,34 @@
 #ifndef COORDS_H
 #define COORDS_H
 
+#include <stdint.h>
+
 struct atomcoordinates {
   unsigned int x;
   unsigned int y;
   unsigned int z;
 };
 
+/*
+ * Coordinates packed into 64 bits, with 21 bits for each axis. Used
+ * where long lists of atoms are kept.
+ */
+
+typedef uint64_t atompackedcoordinates;
+
+#define atomcoordinates_packbits	21
+#define atomcoordinates_packmax		(1U << atomcoordinates_packbits)
+#define atomcoordinates_packmask	((uint64_t)atomcoordinates_packmax - 1)
+#define atomcoordinates_pack(c)		((((uint64_t)(c)->z) << (2 * atomcoordinates_packbits)) | \
+					 (((uint64_t)(c)->y) << atomcoordinates_packbits) |	    \
+					 ((uint64_t)(c)->x))
+#define atomcoordinates_packedx(p)	((unsigned int)((p) & atomcoordinates_packmask))
+#define atomcoordinates_packedy(p)	((unsigned int)(((p) >> atomcoordinates_packbits) & atomcoordinates_packmask))
+#define atomcoordinates_packedz(p)	((unsigned int)((p) >> (2 * atomcoordinates_packbits)))
+#define atomcoordinates_unpack(p,c)	((c)->x = atomcoordinates_packedx(p),	\
+					 (c)->y = atomcoordinates_packedy(p),	\
+					 (c)->z = atomcoordinates_packedz(p))
+
 struct atomboundingbox {
   struct atomcoordinates lowercorner;
   struct atomcoordinates uppercorner;
@@ -30,11 +30,41 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "util.h"
 #include "phymodel.h"
 #include "drop.h"
 #include "droptable.h"
 #include "simul.h"
+#include "phases.h"
+
+/*
+ * When planning a move, the drop's atoms are looked at in batches of
+ * simulator_drop_batchatoms, with their coordinates unpacked into
+ * separate arrays so that the loops over them vectorise. When the
+ * atoms of the model are in one array (the linear and bricked
+ * layouts), the atoms under a batch are gathered eight at a time with
+ * AVX2 if the processor has it; otherwise they are read one by one.
+ */
+
+#define simulator_drop_batchatoms	64
+#if defined(__x86_64__) || defined(__i386__)
+#define simulator_drop_haveavx2		__builtin_cpu_supports("avx2")
+#else
+#define simulator_drop_haveavx2		0
+#endif
+
+struct simulatordropbatch {
+  unsigned int natoms;
+  uint32_t x[simulator_drop_batchatoms];
+  uint32_t y[simulator_drop_batchatoms];
+  uint32_t z[simulator_drop_batchatoms];
+  uint8_t onlimit[simulator_drop_batchatoms];
+  uint8_t spaceunder[simulator_drop_batchatoms];
+};
 
 static void
 simulator_drop_seekfreey(struct phymodel* model,
@@ -68,10 +98,10 @@ simulator_drop_seekfreey(struct phymodel* model,
   }
 }
 
-int
-simulator_drop_enoughspaceforwater(struct phymodel* model,
-				   struct atomcoordinates* place,
-				   unsigned int dropSize) {
+static int
+simulator_drop_enoughspaceforwateraux(struct phymodel* model,
+				      struct atomcoordinates* place,
+				      unsigned int dropSize) {
 
   assert(phymodel_isvalid(model));
   
@@ -106,6 +136,7 @@ simulator_drop_enoughspaceforwater(struct phymodel* model,
        */
 
       unsigned int x = place->x;
+      unsigned int nfree;
 
       /*
        * Figure out if there's space at this height (z) for enough
@@ -175,11 +206,16 @@ simulator_drop_enoughspaceforwater(struct phymodel* model,
 	
 	simulator_drop_seekfreey(model,x,y,z,&dropSize);
 	
-	while (dropSize > 0 &&
-	       x > 0 &&
-	       phymodel_atomisfree(model,x-1,y,z)) {
+	/*
+	 * The model does not change here, so the free atoms in x
+	 * direction can be counted up front.
+	 */
+	
+	nfree = phymodel_freerun_backward(model,x,y,z,dropSize);
+	while (dropSize > 0 && nfree > 0) {
 	  
 	  dropSize--;
+	  nfree--;
 	  x--;
 	  simulator_drop_seekfreey(model,x,y,z,&dropSize);
 	  
@@ -187,11 +223,11 @@ simulator_drop_enoughspaceforwater(struct phymodel* model,
 	
 	x = place->x;
 	
-	while (dropSize > 0 &&
-	       x < model->xSize -1 &&
-	       phymodel_atomisfree(model,x+1,y,z)) {
+	nfree = phymodel_freerun_forward(model,x,y,z,dropSize);
+	while (dropSize > 0 && nfree > 0) {
 	  
 	  dropSize--;
+	  nfree--;
 	  x++;
 	  simulator_drop_seekfreey(model,x,y,z,&dropSize);
 	  
@@ -220,37 +256,59 @@ simulator_drop_enoughspaceforwater(struct phymodel* model,
   return(1);
 }
 
-static int
-simulator_drop_nextatomsareinthisdrop(struct phymodel* model,
-				      struct simulatordrop* drop,
-				      struct atomcoordinates* place) {
-  unsigned int i;
+int
+simulator_drop_enoughspaceforwater(struct phymodel* model,
+				   struct atomcoordinates* place,
+				   unsigned int dropSize) {
+  uint64_t start = simulator_phase_now();
+  int ans = simulator_drop_enoughspaceforwateraux(model,place,dropSize);
+  simulator_phase_add(simulatorphase_enoughspace,start);
+  return(ans);
+}
 
-  assert(phymodel_isvalid(model));
-  
-  for (i = 0; i < drop->natoms; i++) {
-    struct atomcoordinates* coords = &drop->atoms[i];
-    if (simulator_coords_equal(coords,place)) return(1);
-    else if (simulator_coords_adjacent(coords,place)) return(1);
-  }
-  
-  return(0);
+static void
+simulator_drop_reserveatoms(struct simulatordrop* drop,
+			    unsigned int natoms) {
+  unsigned int maxatoms;
+  atompackedcoordinates* atoms;
+  if (natoms <= drop->maxatoms) return;
+  if (natoms < 2 * drop->maxatoms) natoms = 2 * drop->maxatoms;
+  atoms = simulator_dropatoms_allocate(&drop->table->atoms,natoms,&maxatoms);
+  if (drop->natoms > 0) memcpy(atoms,drop->atoms,drop->natoms * sizeof(atompackedcoordinates));
+  simulator_dropatoms_free(&drop->table->atoms,drop->atoms,drop->maxatoms);
+  drop->atoms = atoms;
+  drop->maxatoms = maxatoms;
 }
 
 static int
 simulator_drop_addatom(struct phymodel* model,
 		       struct simulatordrop* drop,
 		       struct atomcoordinates* place) {
-  struct atomcoordinates* coords;
   assert(phymodel_isvalid(model));
-  assert(drop->natoms < simulatorstate_maxatomsperdrop);
-  coords = &drop->atoms[drop->natoms++];
-  coords->x = place->x;
-  coords->y = place->y;
-  coords->z = place->z;
+  assert(drop->table != 0);
+  simulator_drop_reserveatoms(drop,drop->natoms < drop->size ? drop->size : drop->natoms + 1);
+  drop->atoms[drop->natoms] = atomcoordinates_pack(place);
+  simulator_drophash_set(&drop->table->owners,drop->atoms[drop->natoms],drop);
+  drop->natoms++;
   return(1);
 }
 
+static void
+simulator_drop_removeatom(struct simulatordrop* drop,
+			  const struct atomcoordinates* place) {
+  atompackedcoordinates coords = atomcoordinates_pack(place);
+  unsigned int i;
+  for (i = 0; i < drop->natoms; i++) {
+    if (drop->atoms[i] == coords) {
+      simulator_drophash_remove(&drop->table->owners,coords);
+      drop->atoms[i] = drop->atoms[drop->natoms - 1];
+      drop->natoms--;
+      return;
+    }
+  }
+  assert(0);
+}
+
 static void
 simulator_drop_remove_dropatoms(struct phymodel* model,
 				struct simulatordrop* drop) {
@@ -258,146 +316,203 @@ simulator_drop_remove_dropatoms(struct phymodel* model,
   assert(phymodel_isvalid(model));
   
   while (drop->natoms > 0) {
-    struct atomcoordinates* coords = &drop->atoms[drop->natoms - 1];
-    phyatom* atom = phymodel_getatom(model,coords->x,coords->y,coords->z);
-    phyatom_set_mat(atom,material_air);
+    atompackedcoordinates coords = drop->atoms[drop->natoms - 1];
+    simulator_drophash_remove(&drop->table->owners,coords);
+    phymodel_setatommat(model,
+			atomcoordinates_packedx(coords),
+			atomcoordinates_packedy(coords),
+			atomcoordinates_packedz(coords),
+			material_air);
     drop->natoms--;
   }
 }
 
 static void
 simulator_drop_donewithdrop(struct phymodel* model,
+			    struct simulatorstate* simulator,
 			    struct simulatordrop* drop) {
   simulator_drop_remove_dropatoms(model,drop);
-  drop->active = 0;
+  simulator_droptable_deletedrop(&simulator->drops,drop);
 }
 
-struct circledrawingcontext {
-  struct simulatordrop* drop;
-};
-
-static void
-simulator_putdrop_circledistance_onecircle(unsigned int x,
-					   unsigned int y,
-					   unsigned int z,
-					   struct phymodel* model,
-					   phyatom* atom,
-					   void* data) {
-  struct circledrawingcontext* context = (struct circledrawingcontext*)data;
-
-  /*
-   * Some sanity checks
-   */
-
-  assert(model != 0);
-  assert(phymodel_isvalid(model));
-  assert(atom != 0);
-  assert(context != 0);
-  struct simulatordrop* drop = context->drop;
-  assert(drop != 0);
-  assert(drop->size > 0);
-  
-  /*
-   * Check if we still need to add water atoms
-   */
+static int
+simulator_putdrop_shell(struct phymodel* model,
+			struct atomcoordinates* place,
+			struct simulatordrop* drop,
+			unsigned int distance) {
+
+  const struct phymodelshell* shell = phymodel_shell(distance);
+  int inside = 0;
+  size_t i;
   
-  if (drop->natoms >= drop->size) return;
-
-  /*
-   * We do. Check if there's just air there, or something else.
-   */
+  assert(phymodel_isvalid(model));
 
-  if (phyatom_mat(atom) != material_air) return;
+  deepdeepdebugf("simulator_putdrop_shell (%u,%u,%u) distance %u",
+                 place->x, place->y, place->z,
+                 distance);
   
   /*
-   * Nothing there. Add a water atom to the indicated (x,y,z) location.
+   * Put a water atom in every free atom slot in the model that is
+   * distance away from the drop place (in 3D; if in free space, the
+   * water drop will form a sphere), until the drop is full. Return
+   * whether any part of the shell was inside the model.
    */
   
-  deepdeepdebugf("adding water atom at (%u,%u,%u) to drop (%u/%u)",
-                 x, y, z,
-                 drop->natoms,
-                 drop->size);
+  for (i = 0; i < shell->noffsets && drop->natoms < drop->size; i++) {
+    
+    const struct phymodeloffset* offset = &shell->offsets[i];
+    long x = (long)place->x + offset->x;
+    long y = (long)place->y + offset->y;
+    long z = (long)place->z + offset->z;
+    struct atomcoordinates coords;
+    
+    if (x < 0 || x >= model->xSize ||
+	y < 0 || y >= model->ySize ||
+	z < 0 || z >= model->zSize) continue;
+    inside = 1;
+    coords.x = (unsigned int)x;
+    coords.y = (unsigned int)y;
+    coords.z = (unsigned int)z;
+    if (!phymodel_atomisfree(model,coords.x,coords.y,coords.z)) continue;
+    
+    deepdeepdebugf("adding water atom at (%u,%u,%u) to drop (%u/%u)",
+		   coords.x, coords.y, coords.z,
+		   drop->natoms,
+		   drop->size);
+    phymodel_setatommat(model,coords.x,coords.y,coords.z,material_water);
+    simulator_drop_addatom(model,drop,&coords);
+    
+  }
   
-  phyatom_set_mat(atom,material_water);
-  struct atomcoordinates coords;
-  coords.x = x;
-  coords.y = y;
-  coords.z = z;
-  simulator_drop_addatom(model,drop,&coords);
+  return(inside);
 }
 
 static int
-simulator_putdrop_circledistance(struct phymodel* model,
-				 struct atomcoordinates* place,
-				 struct simulatordrop* drop,
-				 unsigned int distance) {
-
+simulator_drop_putdropaux(struct phymodel* model,
+			  struct atomcoordinates* place,
+			  struct simulatordrop* drop) {
+  unsigned int distance;
   assert(phymodel_isvalid(model));
+  
+  deepdeepdebugf("putting a drop of size %u at (%u,%u,%u)", drop->size, place->x, place->y, place->z);
+  /* debugf("initial natoms = %u", drop->natoms); */
 
-  deepdeepdebugf("simulator_putdrop_circledistance (%u,%u,%u) distance %u",
-                 place->x, place->y, place->z,
-                 distance);
+  /*
+   * The drop starts from its place, which must be free
+   */
   
-  if (distance == 0) {
-    
+  if (drop->natoms < drop->size) {
     if (!phymodel_atomisfree(model,place->x,place->y,place->z)) return(0);
-    phyatom* atom = phymodel_getatom(model,place->x,place->y,place->z);
-    phyatom_set_mat(atom,material_water);
+    phymodel_setatommat(model,place->x,place->y,place->z,material_water);
     simulator_drop_addatom(model,drop,place);
-    return(1);
-    
-  } else {
-    
-    /*
-     * Recurse for a smaller circle
-     */
-    
-    simulator_putdrop_circledistance(model,place,drop,distance-1);
-    
-    /*
-     * And then draw a circle with distance, putting a water atom in every
-     * atom slot in the model that is that distance away from the drop place
-     * (in 3D; if in free space, the water drop will form a sphere).
-     */
-
-    struct circledrawingcontext context;
-    context.drop = drop;
-    phymodel_mapatoms_atdistance3d(model,
-				   place->x,place->y,place->z,
-				   distance,
-				   simulator_putdrop_circledistance_onecircle,
-				   &context);
-    
-    /*
-     * Done
-     */
-    
-    return(1);
-    
   }
   
+  /*
+   * Then fill the free space around the place, one shell at a time
+   * and closest first, until the drop is full. Shells closer than
+   * the current one have already been filled, so each is visited
+   * once. Once a shell is entirely outside the model, all further
+   * shells are too, and the drop does not fit.
+   */
+  
+  for (distance = 1; drop->natoms < drop->size; distance++) {
+    deepdeepdebugf("drop circle round %u", distance);
+    if (!simulator_putdrop_shell(model,place,drop,distance)) return(0);
+  }
+  
+  return(1);
 }
 
 int
 simulator_drop_putdrop(struct phymodel* model,
 		       struct atomcoordinates* place,
 		       struct simulatordrop* drop) {
-  unsigned int distance = 0;
-  assert(phymodel_isvalid(model));
-  assert(drop->size <= simulatorstate_maxatomsperdrop);
+  uint64_t start = simulator_phase_now();
+  int ans = simulator_drop_putdropaux(model,place,drop);
+  simulator_phase_add(simulatorphase_putdrop,start);
+  return(ans);
+}
+
+static struct simulatordrop*
+simulator_drop_merge(struct simulatorstate* simulator,
+		     struct simulatordrop* drop1,
+		     struct simulatordrop* drop2) {
   
-  deepdeepdebugf("putting a drop of size %u at (%u,%u,%u)", drop->size, place->x, place->y, place->z);
-  /* debugf("initial natoms = %u", drop->natoms); */
+  struct simulatordrop* into = (drop1->natoms >= drop2->natoms) ? drop1 : drop2;
+  struct simulatordrop* from = (into == drop1) ? drop2 : drop1;
+  unsigned int natoms = into->natoms + from->natoms;
+  unsigned int i;
+
+  /*
+   * The smaller drop joins the larger one, and the calcite they carry
+   * is mixed
+   */
   
-  while (drop->natoms < drop->size) {
-    deepdeepdebugf("drop circle round %u", distance);
-    if (!simulator_putdrop_circledistance(model,place,drop,distance)) {
-      if (drop->natoms < drop->size) return(0);
+  debugf("drop %u of %u atoms merges into drop %u of %u atoms",
+	 from->index, from->natoms, into->index, into->natoms);
+  if (natoms > 0) {
+    into->calcite = (into->calcite * into->natoms + from->calcite * from->natoms) / natoms;
+  }
+  simulator_drop_reserveatoms(into,natoms);
+  for (i = 0; i < from->natoms; i++) {
+    into->atoms[into->natoms++] = from->atoms[i];
+    simulator_drophash_set(&into->table->owners,from->atoms[i],into);
+  }
+  into->size += from->size;
+  if (into->sleeping) simulator_droptable_wake(&simulator->drops,into);
+  from->natoms = 0;
+  simulator_droptable_deletedrop(&simulator->drops,from);
+  simulator->mergedDrops++;
+  return(into);
+}
+
+struct simulatordrop*
+simulator_drop_mergetouching(struct phymodel* model,
+			     struct simulatorstate* simulator,
+			     struct simulatordrop* drop) {
+  
+  static const int neighbours[6][3] = {
+    { -1, 0, 0 }, { 1, 0, 0 },
+    { 0, -1, 0 }, { 0, 1, 0 },
+    { 0, 0, -1 }, { 0, 0, 1 }
+  };
+  unsigned int first = 0;
+  unsigned int n = drop->natoms;
+  unsigned int i;
+  unsigned int j;
+  
+  /*
+   * Merge the drop with every other drop that one of its atoms
+   * touches. Drops that were already in the model do not touch each
+   * other, so only the atoms of this drop need to be looked at. They
+   * stay in the same order when merged, starting at index first of
+   * the resulting drop.
+   */
+  
+  assert(phymodel_isvalid(model));
+  for (i = 0; i < n; i++) {
+    struct atomcoordinates atom;
+    atomcoordinates_unpack(drop->atoms[first + i],&atom);
+    for (j = 0; j < 6; j++) {
+      struct atomcoordinates neighbour;
+      struct simulatordrop* other;
+      if ((neighbours[j][0] < 0 && atom.x == 0) || (neighbours[j][0] > 0 && atom.x == model->xSize - 1) ||
+	  (neighbours[j][1] < 0 && atom.y == 0) || (neighbours[j][1] > 0 && atom.y == model->ySize - 1) ||
+	  (neighbours[j][2] < 0 && atom.z == 0) || (neighbours[j][2] > 0 && atom.z == model->zSize - 1)) continue;
+      neighbour.x = atom.x + neighbours[j][0];
+      neighbour.y = atom.y + neighbours[j][1];
+      neighbour.z = atom.z + neighbours[j][2];
+      other = simulator_droptable_atomowner(&simulator->drops,&neighbour);
+      if (other != 0 && other != drop) {
+	unsigned int base = other->natoms;
+	struct simulatordrop* into = simulator_drop_merge(simulator,other,drop);
+	if (into == other) first += base;
+	drop = into;
+      }
     }
-    distance++;
   }
   
-  return(1);
+  return(drop);
 }
 
 static int
@@ -421,45 +536,13 @@ simulator_drop_atomisonmodellimit(struct phymodel* model,
   return(ans);
 }
 
-static int
-simulator_drop_atomhasspaceunderneath(struct phymodel* model,
-				      struct atomcoordinates* atomcoordinates) {
-  if (simulator_drop_atomisonmodellimit(model,atomcoordinates)) return(1);
-  unsigned int nextZ = atomcoordinates->z + 1;
-  assert(nextZ < model->zSize);
-  phyatom* atom = phymodel_getatom(model,atomcoordinates->x,atomcoordinates->y,nextZ);
-  if (phyatom_mat(atom) == material_air) return(1);
-  else return(0);
-}
-
-static int
-simulator_drop_atomhasrockonthesideauxaux(struct phymodel* model,
-                                          unsigned int x,
-                                          unsigned int y,
-                                          unsigned int z) {
-  assert(model != 0);
-  assert(x < model->xSize);
-  assert(y < model->ySize);
-  assert(z < model->zSize);
-  deepdeepdebugf("    atom has rock auxaux at (%u,%u,%u): %u", x, y, z, phymodel_atommat(model,x,y,z));
-  return(phymodel_atommat(model,x,y,z) == material_rock);
-}
-
 static int
 simulator_drop_atomhasrockonthesideaux(struct phymodel* model,
                                        struct atomcoordinates* atomcoordinates) {
-  unsigned int x = atomcoordinates->x;
-  unsigned int y = atomcoordinates->y;
-  unsigned int z = atomcoordinates->z;
-  if (x > 0 && simulator_drop_atomhasrockonthesideauxaux(model,x-1,y,z)) return(1);
-  if (x < model->xSize-1 && simulator_drop_atomhasrockonthesideauxaux(model,x+1,y,z)) return(1);
-  if (y > 0 && simulator_drop_atomhasrockonthesideauxaux(model,x,y-1,z)) return(1);
-  if (y < model->ySize-1 && simulator_drop_atomhasrockonthesideauxaux(model,x,y+1,z)) return(1);
-  if (x > 0 && y > 0 && simulator_drop_atomhasrockonthesideauxaux(model,x-1,y-1,z)) return(1);
-  if (x > 0 && y < model->ySize-1 && simulator_drop_atomhasrockonthesideauxaux(model,x-1,y+1,z)) return(1);
-  if (x < model->xSize-1 && y > 0 && simulator_drop_atomhasrockonthesideauxaux(model,x+1,y-1,z)) return(1);
-  if (x < model->xSize-1 && y < model->ySize-1 && simulator_drop_atomhasrockonthesideauxaux(model,x+1,y+1,z)) return(1);
-  return(0);
+  int ans = phymodel_hasrockbeside(model,atomcoordinates->x,atomcoordinates->y,atomcoordinates->z);
+  deepdeepdebugf("    atom has rock beside at (%u,%u,%u): %d",
+                 atomcoordinates->x, atomcoordinates->y, atomcoordinates->z, ans);
+  return(ans);
 }
 
 static int
@@ -470,12 +553,13 @@ simulator_drop_atomhasrockontheside(struct phymodel* model,
                  drop->index, atomcoordinates->x, atomcoordinates->y, atomcoordinates->z);
   if (simulator_drop_atomisonmodellimit(model,atomcoordinates)) return(0);
   for (unsigned int i = 0; i < drop->natoms; i++) {
-    struct atomcoordinates* otheratom = &drop->atoms[i];
-    if (otheratom->z == atomcoordinates->z) { // !simulator_coords_equal(otheratom,atomcoordinates)
+    struct atomcoordinates otheratom;
+    if (atomcoordinates_packedz(drop->atoms[i]) == atomcoordinates->z) { // !simulator_coords_equal(otheratom,atomcoordinates)
+      atomcoordinates_unpack(drop->atoms[i],&otheratom);
       deepdeepdebugf("  inspecting if rock on drop %u's other atom in coordinates (%u,%u,%u)",
-                     drop->index, otheratom->x, otheratom->y, otheratom->z);
+                     drop->index, otheratom.x, otheratom.y, otheratom.z);
       if (simulator_drop_atomhasrockonthesideaux(model,
-                                                 otheratom)) {
+                                                 &otheratom)) {
         return(1);
       }
     }
@@ -483,68 +567,178 @@ simulator_drop_atomhasrockontheside(struct phymodel* model,
   return(0);
 }
 
-static int
-simulator_drop_canmovedrop(struct phymodel* model,
-			   struct simulatordrop* drop) {
+static void
+simulator_drop_batch_load(struct phymodel* model,
+			  struct simulatordrop* drop,
+			  unsigned int first,
+			  struct simulatordropbatch* batch) {
   
-  /*
-   * A drop can be moved if there's free space under any of its water
-   * atoms.
-   */
+  unsigned int xLimit = model->xSize - 1;
+  unsigned int yLimit = model->ySize - 1;
+  unsigned int zLimit = model->zSize - 1;
+  unsigned int i;
   
+  batch->natoms = drop->natoms - first;
+  if (batch->natoms > simulator_drop_batchatoms) batch->natoms = simulator_drop_batchatoms;
+  for (i = 0; i < batch->natoms; i++) {
+    atompackedcoordinates packed = drop->atoms[first + i];
+    batch->x[i] = atomcoordinates_packedx(packed);
+    batch->y[i] = atomcoordinates_packedy(packed);
+    batch->z[i] = atomcoordinates_packedz(packed);
+  }
+  for (i = 0; i < batch->natoms; i++) {
+    batch->onlimit[i] = ((batch->z[i] == 0) | (batch->z[i] >= zLimit) |
+			 (batch->x[i] == 0) | (batch->x[i] >= xLimit) |
+			 (batch->y[i] == 0) | (batch->y[i] >= yLimit));
+  }
+}
+
+static void
+simulator_drop_batch_spaceunder_scalar(struct phymodel* model,
+				       struct simulatordropbatch* batch,
+				       unsigned int first) {
   unsigned int i;
-  for (i = 0; i < drop->natoms; i++) {
-    if (simulator_drop_atomhasspaceunderneath(model,&drop->atoms[i])) {
-      deepdebugf("drop %u can move", drop->index);
-      return(1);
-    }
+  for (i = first; i < batch->natoms; i++) {
+    batch->spaceunder[i] = (batch->onlimit[i] ||
+			    phymodel_atommat(model,batch->x[i],batch->y[i],batch->z[i] + 1) == material_air);
   }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void
+simulator_drop_batch_spaceunder_avx2(struct phymodel* model,
+				     struct simulatordropbatch* batch) {
+  
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i materialmask = _mm256_set1_epi32(0x03);
+  const __m256i brickmask = _mm256_set1_epi32(phymodel_brickmask);
+  const __m256i zLast = _mm256_set1_epi32(model->zSize - 1);
+  const __m256i xSize = _mm256_set1_epi32(model->xSize);
+  const __m256i xySize = _mm256_set1_epi32(model->xSize * model->ySize);
+  const __m256i xBricks = _mm256_set1_epi32(model->xBricks);
+  const __m256i yBricks = _mm256_set1_epi32(model->yBricks);
+  const __m256i safeLimit = _mm256_set1_epi32((int)(model->natoms - 3));
+  unsigned int i;
   
   /*
-   * Did not find anything underneath that would allow the water to
-   * fall or flow.
+   * Each lane reads four bytes at the index of the atom under it, so
+   * lanes that would read past the end of the atoms are left for the
+   * scalar path. Atoms on the model limit have space underneath in
+   * any case; they read their own atom instead, which is always in
+   * the model.
    */
   
-  debugf("cannot move drop %u", drop->index);
-  return(0);
+  for (i = 0; i + 8 <= batch->natoms; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&batch->x[i]);
+    __m256i y = _mm256_loadu_si256((const __m256i*)&batch->y[i]);
+    __m256i z = _mm256_min_epu32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&batch->z[i]),one),zLast);
+    __m256i index;
+    __m256i safe;
+    __m256i atoms;
+    __m256i isair;
+    uint32_t air[8];
+    unsigned int j;
+    if (model->layout == phymodellayout_linear) {
+      index = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(z,xySize),
+						_mm256_mullo_epi32(y,xSize)),
+			       x);
+    } else {
+      __m256i brick = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(z,phymodel_brickshift),
+												 yBricks),
+									   _mm256_srli_epi32(y,phymodel_brickshift)),
+							  xBricks),
+				       _mm256_srli_epi32(x,phymodel_brickshift));
+      index = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(brick,phymodel_brickatomshift),
+					      _mm256_slli_epi32(_mm256_and_si256(z,brickmask),2 * phymodel_brickshift)),
+			      _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(y,brickmask),phymodel_brickshift),
+					      _mm256_and_si256(x,brickmask)));
+    }
+    safe = _mm256_cmpgt_epi32(safeLimit,index);
+    atoms = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),(const int*)model->atoms,index,safe,1);
+    isair = _mm256_cmpeq_epi32(_mm256_and_si256(atoms,materialmask),_mm256_setzero_si256());
+    _mm256_storeu_si256((__m256i*)air,_mm256_and_si256(isair,safe));
+    for (j = 0; j < 8; j++) {
+      batch->spaceunder[i + j] = (batch->onlimit[i + j] || air[j] != 0);
+    }
+    if (_mm256_movemask_ps(_mm256_castsi256_ps(safe)) != 0xFF) {
+      for (j = 0; j < 8; j++) {
+	if (!batch->onlimit[i + j]) {
+	  batch->spaceunder[i + j] = (phymodel_atommat(model,batch->x[i + j],batch->y[i + j],batch->z[i + j] + 1) ==
+				      material_air);
+	}
+      }
+    }
+  }
+  simulator_drop_batch_spaceunder_scalar(model,batch,i);
 }
+#endif
 
-static unsigned int
-simulator_drop_lowestpoint(struct phymodel* model,
-			   struct simulatordrop* drop,
-			   struct atomcoordinates* lowestatom) {
-  unsigned int i;
-  unsigned int lowestpoint = 0;
+static void
+simulator_drop_batch_spaceunder(struct phymodel* model,
+				struct simulatordropbatch* batch) {
   
-  assert(drop->natoms > 0);
-  for (i = 0; i < drop->natoms; i++) {
-    struct atomcoordinates* coords = &drop->atoms[i];
-    if (coords->z > lowestpoint) {
-      lowestpoint = coords->z;
-      *lowestatom = *coords;
-    }
-  }
+  /*
+   * Gather the atoms under the batch when they are all in one array
+   * that 32-bit indexes reach
+   */
   
-  return(lowestpoint);
+#if defined(__x86_64__) || defined(__i386__)
+  if (simulator_drop_haveavx2 &&
+      model->layout != phymodellayout_sparse &&
+      model->natoms >= 4 &&
+      model->natoms <= (size_t)INT32_MAX) {
+    simulator_drop_batch_spaceunder_avx2(model,batch);
+    return;
+  }
+#endif
+  simulator_drop_batch_spaceunder_scalar(model,batch,0);
 }
 
 static int
 simulator_drop_shouldfall(struct phymodel* model,
 			  struct simulatordrop* drop) {
+  
+  struct simulatordropbatch batch;
+  unsigned int checkedz = model->zSize;
+  int rockatz = 0;
+  unsigned int first;
+  unsigned int i;
+  
+  /*
+   * The drop falls if there's space under one of its atoms, and no
+   * rock on the side of the drop's atoms at that z. No atom is on the
+   * model limit here, as such drops fall off the model.
+   */
+  
   assert(drop->natoms > 0);
-  for (unsigned int i = 0; i < drop->natoms; i++) {
-    struct atomcoordinates* coords = &drop->atoms[i];
-    if (simulator_drop_atomhasspaceunderneath(model,coords)) {
-      if (simulator_drop_atomisonmodellimit(model,coords)) {
-        deepdebugf("drop %u can fall because we are on the model limit next to coordinates (%u,%u,%u)",
-                   coords->x, coords->y, coords->z);
-        return(1);
-      } else if (simulator_drop_atomhasrockontheside(model,coords,drop)) {
+  for (first = 0; first < drop->natoms; first += simulator_drop_batchatoms) {
+    simulator_drop_batch_load(model,drop,first,&batch);
+    simulator_drop_batch_spaceunder(model,&batch);
+    for (i = 0; i < batch.natoms; i++) {
+      struct atomcoordinates coords;
+      if (!batch.spaceunder[i]) continue;
+      assert(!batch.onlimit[i]);
+      coords.x = batch.x[i];
+      coords.y = batch.y[i];
+      coords.z = batch.z[i];
+      
+      /*
+       * Whether there's rock on the side depends only on the drop's
+       * atoms at the same z, so it need not be looked at again for
+       * the next atom at that z
+       */
+      
+      if (coords.z != checkedz) {
+        checkedz = coords.z;
+        rockatz = simulator_drop_atomhasrockontheside(model,&coords,drop);
+      }
+      if (rockatz) {
         deepdebugf("drop %u can't fall because there's space under coordinates (%u,%u,%u) but rock by it",
-                   coords->x, coords->y, coords->z);
+                   drop->index, coords.x, coords.y, coords.z);
       } else {
         deepdebugf("drop %u can fall because there's space under coordinates (%u,%u,%u) and no rock around",
-                   coords->x, coords->y, coords->z);
+                   drop->index, coords.x, coords.y, coords.z);
         return(1);
       }
     }
@@ -569,41 +763,35 @@ simulator_drop_determinedropend(struct phymodel* model,
 				struct atomcoordinates* lowestatom,
 				unsigned int dropwidth) {
 
-  unsigned int prevlevel = lowestpoint;
-  unsigned int level = prevlevel + 1;
+  unsigned int landing = model->zSize;
   unsigned int firsthalfwidth = dropwidth / 2;
   unsigned int secondhalfwidth = dropwidth - firsthalfwidth;
   
-  for (;;) {
-    int x,y;
-    if (level == model->zSize) {
-      deepdeepdebugf("reached the bottom of the z-direction, returning %u", level);
-      return(level);
-    }
-    for (x = firsthalfwidth > lowestatom->x ? 0 : lowestatom->x - firsthalfwidth;
-	 x < lowestatom->x + secondhalfwidth && x < model->xSize;
-	 x++) {
-      for (y = firsthalfwidth > lowestatom->y ? 0 : lowestatom->y - firsthalfwidth;
-	   y < lowestatom->y + secondhalfwidth && x < model->ySize;
-	   y++) {
-        if (!phymodel_atomisfree(model,x,y,level)) {
-          deepdeepdebugf("found a non-free atom at level %u", level);
-          return(prevlevel);
-        }
-      } 
+  unsigned int startx = firsthalfwidth > lowestatom->x ? 0 : lowestatom->x - firsthalfwidth;
+  unsigned int endx = lowestatom->x + secondhalfwidth < model->xSize ? lowestatom->x + secondhalfwidth : model->xSize;
+  unsigned int starty = firsthalfwidth > lowestatom->y ? 0 : lowestatom->y - firsthalfwidth;
+  unsigned int endy = lowestatom->y + secondhalfwidth < model->ySize ? lowestatom->y + secondhalfwidth : model->ySize;
+  unsigned int x;
+  unsigned int y;
+  
+  /*
+   * The drop lands on the highest non-air atom below it, within
+   * the width of the drop. Each column is only searched down to the
+   * highest such atom found so far.
+   */
+  
+  for (y = starty; y < endy; y++) {
+    for (x = startx; x < endx; x++) {
+      landing = phymodel_nextsolid(model,x,y,lowestpoint + 1,landing);
     }
-    
-    /*
-     * No stable ground (non-air atoms) found at this level in
-     * z-direction. Continue further down.
-     */
-    
-    prevlevel = level;
-    level++;
   }
   
-  // NOT REACHED
-  assert(0);
+  if (landing == model->zSize) {
+    deepdeepdebugf("reached the bottom of the z-direction, returning %u", landing);
+    return(landing);
+  }
+  deepdeepdebugf("found a non-free atom at level %u", landing);
+  return(landing - 1);
 }
 
 static double
@@ -649,16 +837,197 @@ simulator_drop_determinedropsplit(struct phymodel* model,
       speed >= splitmaxlimit ?
       splitmaxn :
       (2 + floor((splitmaxn - 2) * ((speed - splitminlimit) / range)));
-    return(rand() % maxsplit);
+    return(rng_below(&drop->rng,maxsplit));
     
   }
   
 }
 
 static void
+simulator_drop_planmoveaux(struct phymodel* model,
+			   struct simulatordrop* drop) {
+  
+  struct simulatordropplan* plan = &drop->plan;
+  struct atomboundingbox* region = &plan->region;
+  unsigned int reach = simulator_drop_reach(drop);
+  unsigned int lowestpoint = 0;
+  unsigned int lowestindex = 0;
+  unsigned int anyspace = 0;
+  unsigned int anylimit = 0;
+  unsigned int first;
+  unsigned int i;
+  
+  /*
+   * Only read the model here, as the plans of many drops may be made
+   * at the same time
+   */
+  
+  memset(plan,0,sizeof(*plan));
+  plan->epoch = model->epoch;
+  plan->natoms = drop->natoms;
+  
+  /*
+   * Go through the atoms once in batches, for the region, the lowest
+   * point, and whether there's space under any atom or any atom is on
+   * the model limit
+   */
+  
+  assert(drop->natoms > 0);
+  for (first = 0; first < drop->natoms; first += simulator_drop_batchatoms) {
+    struct simulatordropbatch batch;
+    unsigned int lowerX = model->xSize, lowerY = model->ySize, lowerZ = model->zSize;
+    unsigned int upperX = 0, upperY = 0, upperZ = 0;
+    unsigned int space = 0;
+    unsigned int limit = 0;
+    simulator_drop_batch_load(model,drop,first,&batch);
+    simulator_drop_batch_spaceunder(model,&batch);
+    for (i = 0; i < batch.natoms; i++) {
+      lowerX = batch.x[i] < lowerX ? batch.x[i] : lowerX;
+      lowerY = batch.y[i] < lowerY ? batch.y[i] : lowerY;
+      lowerZ = batch.z[i] < lowerZ ? batch.z[i] : lowerZ;
+      upperX = batch.x[i] > upperX ? batch.x[i] : upperX;
+      upperY = batch.y[i] > upperY ? batch.y[i] : upperY;
+      upperZ = batch.z[i] > upperZ ? batch.z[i] : upperZ;
+      space |= batch.spaceunder[i];
+      limit |= batch.onlimit[i];
+    }
+    if (first == 0 || upperZ > lowestpoint) {
+      for (i = 0; batch.z[i] != upperZ; i++);
+      lowestpoint = upperZ;
+      lowestindex = first + i;
+    }
+    if (first == 0) {
+      region->lowercorner.x = lowerX;
+      region->lowercorner.y = lowerY;
+      region->lowercorner.z = lowerZ;
+      region->uppercorner.x = upperX;
+      region->uppercorner.y = upperY;
+      region->uppercorner.z = upperZ;
+    } else {
+      if (lowerX < region->lowercorner.x) region->lowercorner.x = lowerX;
+      if (lowerY < region->lowercorner.y) region->lowercorner.y = lowerY;
+      if (lowerZ < region->lowercorner.z) region->lowercorner.z = lowerZ;
+      if (upperX > region->uppercorner.x) region->uppercorner.x = upperX;
+      if (upperY > region->uppercorner.y) region->uppercorner.y = upperY;
+      if (upperZ > region->uppercorner.z) region->uppercorner.z = upperZ;
+    }
+    anyspace |= space;
+    anylimit |= limit;
+  }
+  
+  /*
+   * A drop can be moved if there's free space under any of its water
+   * atoms. The plan depends on the atoms next to the drop, and on
+   * those under a falling drop.
+   */
+  
+  plan->canmove = (anyspace != 0);
+  if (plan->canmove) {
+    deepdebugf("drop %u can move", drop->index);
+  } else {
+    debugf("cannot move drop %u", drop->index);
+  }
+  region->lowercorner.x = (region->lowercorner.x > reach) ? region->lowercorner.x - reach : 0;
+  region->lowercorner.y = (region->lowercorner.y > reach) ? region->lowercorner.y - reach : 0;
+  region->lowercorner.z = (region->lowercorner.z > reach) ? region->lowercorner.z - reach : 0;
+  region->uppercorner.x += reach;
+  region->uppercorner.y += reach;
+  region->uppercorner.z += reach;
+  if (!plan->canmove) return;
+  
+  /*
+   * Check first if the drop is about to exit from any limit of the
+   * model.
+   */
+  
+  if (anylimit) {
+    plan->offmodel = 1;
+    return;
+  }
+  
+  /*
+   * Figure out if the drop should fall, ie detach from the surface it
+   * is on, and if so, how far it falls.
+   */
+  
+  uint64_t start = simulator_phase_now();
+  plan->shouldfall = simulator_drop_shouldfall(model,drop);
+  simulator_phase_add(simulatorphase_shouldfall,start);
+  if (plan->shouldfall) {
+    plan->width = simulator_drop_determinedropwidth(model,drop);
+    deepdeepdebugf("drop width = %u", plan->width);
+    plan->lowestpoint = lowestpoint;
+    atomcoordinates_unpack(drop->atoms[lowestindex],&plan->lowestatom);
+    deepdeepdebugf("lowest point = %u", plan->lowestpoint);
+    start = simulator_phase_now();
+    plan->end = simulator_drop_determinedropend(model,drop,plan->lowestpoint,&plan->lowestatom,plan->width);
+    simulator_phase_add(simulatorphase_dropend,start);
+    deepdeepdebugf("drop end = %u", plan->end);
+    if (plan->end + 1 > region->uppercorner.z) region->uppercorner.z = plan->end + 1;
+  }
+}
+
+void
+simulator_drop_planmove(struct phymodel* model,
+			struct simulatordrop* drop) {
+  uint64_t start = simulator_phase_now();
+  simulator_drop_planmoveaux(model,drop);
+  simulator_phase_add(simulatorphase_planmove,start);
+}
+
+static int
+simulator_drop_planisvalid(struct phymodel* model,
+			   struct simulatordrop* drop) {
+  const struct atomboundingbox* region = &drop->plan.region;
+  if (drop->plan.epoch == 0 || drop->plan.epoch != model->epoch) return(0);
+  if (drop->plan.natoms != drop->natoms) return(0);
+  return(!phymodel_boxchanged(model,
+			      region->lowercorner.x,region->uppercorner.x + 1,
+			      region->lowercorner.y,region->uppercorner.y + 1,
+			      region->lowercorner.z,region->uppercorner.z + 1));
+}
+
+static void
+simulator_drop_leavecalcite(struct phymodel* model,
+			    struct simulatorstate* simulator,
+			    struct simulatordrop* drop,
+			    const struct atomcoordinates* atom,
+			    double residue,
+			    const struct rgb* color) {
+  
+  struct simulatordrop* owner;
+  phyatom calcite = 0;
+  
+  /*
+   * The residue is accumulated where the drop fell from. Once there
+   * is a whole atom's worth, the atom turns into rock of the calcite's
+   * colour. If the atom is still water of the drop that left the
+   * residue, the drop gives up that atom; if it belongs to another
+   * drop, or is the drop's last atom, it waits for the next residue.
+   */
+  
+  if (residue <= 0.0) return;
+  if (!simulator_calcite_add(&simulator->calcite,model,atom,residue)) return;
+  if (phymodel_atommat(model,atom->x,atom->y,atom->z) == material_rock) return;
+  owner = simulator_droptable_atomowner(&simulator->drops,atom);
+  if (owner != 0) {
+    if (owner != drop || drop->natoms <= 1) return;
+    simulator_drop_removeatom(drop,atom);
+  }
+  
+  phyatom_set_mat(&calcite,material_rock);
+  phyatom_set_color(&calcite,color);
+  phymodel_setatom(model,atom->x,atom->y,atom->z,calcite);
+  simulator_calcite_take(&simulator->calcite,model,atom);
+  simulator->calciteAtoms++;
+  debugf("calcite deposited at (%u,%u,%u)", atom->x, atom->y, atom->z);
+}
+
+static int
 simulator_drop_domovedrop(struct phymodel* model,
                           struct simulatorstate* simulator,
-			  struct simulatordrop* drop) {
+			  struct simulatordrop* drop,
+			  const struct simulatordropplan* plan) {
   
   /*
    * Check first if the drop is about to exit from any limit of the
@@ -666,35 +1035,29 @@ simulator_drop_domovedrop(struct phymodel* model,
    */
 
   deepdebugf("moving drop %u", drop->index);
-  unsigned int i;
-  for (i = 0; i < drop->natoms; i++) {
-    if (simulator_drop_atomisonmodellimit(model,&drop->atoms[i])) {
-      debugf("drop %u: falls out of model", drop->index);
-      simulator_drop_donewithdrop(model,drop);
-      return;
-    }
+  if (plan->offmodel) {
+    debugf("drop %u: falls out of model", drop->index);
+    simulator_drop_donewithdrop(model,simulator,drop);
+    return(1);
   }
   
   /*
    * Figure out if the drop should fall, ie detach from the surface it is on.
    */
 
-  int shouldfall = simulator_drop_shouldfall(model,drop);
-  
-  if (shouldfall) {
+  if (plan->shouldfall) {
 
     /*
      * Then determine how far the drop will fall, and calculate speed.
      */
     
-    struct atomcoordinates lowestatomcoords;
-    unsigned int w = simulator_drop_determinedropwidth(model,drop);
-    deepdeepdebugf("drop width = %u", w);
-    unsigned int l = simulator_drop_lowestpoint(model,drop,&lowestatomcoords);
-    deepdeepdebugf("lowest point = %u", l);
-    unsigned int z = simulator_drop_determinedropend(model,drop,l,&lowestatomcoords,w);
-    deepdeepdebugf("drop end = %u", z);
-    assert(l < z);
+    struct atomcoordinates lowestatomcoords = plan->lowestatom;
+    unsigned int l = plan->lowestpoint;
+    unsigned int z = plan->end;
+    if (z <= l) {
+      debugf("drop %u has no room to fall under it", drop->index);
+      return(0);
+    }
     unsigned int h = z - l;
     double hm = (h * 1.0) / (model->unit * 1.0);
     deepdeepdebugf("drop height = %.2f", hm);
@@ -710,13 +1073,12 @@ simulator_drop_domovedrop(struct phymodel* model,
 
     double calciteconsumptionlength = 0.5; /* meters, for which half of calcite is removed */
     double limit = (drop->calcite * drop->natoms) * (hm / calciteconsumptionlength);
-    double randomValue = (1.0 * rand()) / (1.0 * RAND_MAX);
-    unsigned int nCalciteResidueAtoms = (randomValue < limit);
-    deepdebugf("leaving %u calcite residue atoms due to limit %.4f and random %.4f",
-               nCalciteResidueAtoms,
-               limit,
-               randomValue);
-    drop->calcite -= ((1.0 * nCalciteResidueAtoms) / (1.0 * drop->natoms));
+    double calciteResidue = (limit < 1.0 ? limit : 1.0);
+    struct rgb calciteColor = drop->calcitecolor;
+    deepdebugf("leaving %.4f calcite residue atoms due to limit %.4f",
+               calciteResidue,
+               limit);
+    drop->calcite -= (calciteResidue / (1.0 * drop->natoms));
     if (drop->calcite < 0.0) drop->calcite = 0.0;
     
     /*
@@ -728,11 +1090,13 @@ simulator_drop_domovedrop(struct phymodel* model,
 	     drop->index,
 	     h,
 	     speed);
-      simulator_drop_donewithdrop(model,drop);
+      simulator_drop_donewithdrop(model,simulator,drop);
       debugf("drop %u has dropped out of the model", drop->index);
-      return;
+      simulator_drop_leavecalcite(model,simulator,0,&lowestatomcoords,calciteResidue,&calciteColor);
+      return(1);
     }
     
+    struct rngstream rngbefore = drop->rng;
     unsigned int s = simulator_drop_determinedropsplit(model,drop,speed);
     deepdebugf("drop %u: drops %u units to level %u at speed %.2f m/s, splitting to %u drops",
                drop->index,
@@ -750,11 +1114,28 @@ simulator_drop_domovedrop(struct phymodel* model,
       
       /* ... */
       
+      /*
+       * The drop stays where it is. If it left no calcite residue and
+       * drew no random numbers, neither it nor the model changed, and
+       * it can sleep until something changes around it; falling again
+       * would do the same. Otherwise it stays awake, so that calcite
+       * grows the same way whether drops sleep or not.
+       */
+      
       debugf("drop %u has dropped", drop->index);
+      simulator_drop_leavecalcite(model,simulator,drop,&lowestatomcoords,calciteResidue,&calciteColor);
+      return(calciteResidue > 0.0 || memcmp(&rngbefore,&drop->rng,sizeof(rngbefore)) != 0);
       
     } else {
 
       unsigned int origSize = drop->size;
+      
+      /*
+       * The water of the drop stays where it was, but no longer
+       * belongs to the drop, so the new drops do not merge with it.
+       */
+      
+      simulator_droptable_disownatoms(&simulator->drops,drop);
       for (unsigned int j = 0; j < s; j++) {
         
         struct simulatordrop* newdrop = simulator_droptable_getdrop(&simulator->drops);
@@ -771,15 +1152,16 @@ simulator_drop_domovedrop(struct phymodel* model,
           unsigned int dropFlyDistance  = model->unit * dropFlyDistanceM;
           if (z - l < dropBounceHeight) dropBounceHeight = (z-l)/2;
           struct atomcoordinates newplace;
-          newplace.x = randompickwithinrange(lowestatomcoords.x,dropFlyDistance,dropFlyDistance,model->xSize);
-          newplace.y = randompickwithinrange(lowestatomcoords.y,dropFlyDistance,dropFlyDistance,model->ySize);
+          newplace.x = randompickwithinrange(&newdrop->rng,lowestatomcoords.x,dropFlyDistance,dropFlyDistance,model->xSize);
+          newplace.y = randompickwithinrange(&newdrop->rng,lowestatomcoords.y,dropFlyDistance,dropFlyDistance,model->ySize);
           newplace.z = z - dropBounceHeight;
           if (simulator_drop_enoughspaceforwater(model,&newplace,newdrop->size) &&
-              simulator_drop_putdrop(model,&newplace,drop)) {
+              simulator_drop_putdrop(model,&newplace,newdrop)) {
             simulator->atomCreations += newdrop->natoms;
             simulator->spinOffDrops++;
             debugf("drop %u of size %u split off into new drop %u of size %u",
                    drop->index, drop->size, newdrop->index, newdrop->size);
+            simulator_drop_mergetouching(model,simulator,newdrop);
           } else {
             simulator->failedSpinoffDropSpaceFinding++;
             debugf("unable to find space for a new drop of size %u", newdrop->size);
@@ -791,9 +1173,12 @@ simulator_drop_domovedrop(struct phymodel* model,
       
       debugf("drop %u has dropped and split into %u new drops", drop->index, s);
       simulator_droptable_deletedrop(&simulator->drops,drop);
+      simulator_drop_leavecalcite(model,simulator,0,&lowestatomcoords,calciteResidue,&calciteColor);
       
     }
     
+    return(1);
+    
   } else {
     
     debugf("drop %u cannot fall but can move", drop->index);
@@ -813,16 +1198,43 @@ simulator_drop_domovedrop(struct phymodel* model,
     /* ... */
     
     debugf("drop %u has moved", drop->index);
+    return(0);
     
   }
 }
 
-void
+int
 simulator_drop_movedrop(struct phymodel* model,
                         struct simulatorstate* simulator,
 			struct simulatordrop* drop) {
+  
+  struct simulatordropplan plan;
+  
+  /*
+   * Use the plan made for the drop earlier in the round, unless the
+   * model has changed around the drop since
+   */
+  
   debugf("trying to move drop %u", drop->index);
-  if (simulator_drop_canmovedrop(model,drop)) {
-    simulator_drop_domovedrop(model,simulator,drop);
+  if (!simulator_drop_planisvalid(model,drop)) {
+    simulator_drop_planmove(model,drop);
   }
+  plan = drop->plan;
+  drop->plan.epoch = 0;
+  if (plan.canmove) {
+    return(simulator_drop_domovedrop(model,simulator,drop,&plan));
+  } else {
+    return(0);
+  }
+}
+
+unsigned int
+simulator_drop_reach(struct simulatordrop* drop) {
+  
+  /*
+   * Moving a drop looks at the atoms next to its own atoms, and at a
+   * box the width of the drop under its lowest atom
+   */
+  
+  return(simulator_drop_determinedropwidth(0,drop) / 2 + 1);
 }
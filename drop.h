@@ -27,8 +27,8 @@
 #define DROP_H
 
 #include "coords.h"
-
-#define simulatorstate_maxatomsperdrop	 128
+#include "dropatoms.h"
+#include "rng.h"
 
 enum direction {
   direction_x_towards0 = 0,
@@ -40,19 +40,48 @@ enum direction {
   direction_howmany    = 6
 };
 
+/*
+ * What moving a drop would do, as read from the model. The plan can
+ * be made for many drops in parallel, and stays valid until the model
+ * changes within its region (see phymodel_boxchanged()) or the drop
+ * changes.
+ */
+
+struct simulatordropplan {
+  uint32_t epoch;                          /* model epoch the plan was made in, or 0 */
+  unsigned int natoms;                     /* atoms of the drop when the plan was made */
+  int canmove;                             /* there is free space under the drop */
+  int offmodel;                            /* the drop is on a limit of the model */
+  int shouldfall;                          /* the drop detaches from its surface */
+  unsigned int width;                      /* width of a falling drop */
+  unsigned int lowestpoint;                /* z of the lowest atom of a falling drop */
+  struct atomcoordinates lowestatom;
+  unsigned int end;                        /* z where a falling drop stops */
+  struct atomboundingbox region;           /* atoms of the model read for the plan */
+};
+
 struct simulatordrop {
   int active;                              /* 1 when used */
-  unsigned int index;                      /* index in the drops table of struct simulatorstate */
+  unsigned int index;                      /* number of the drop in the drops table of struct simulatorstate */
+  unsigned int activeindex;                /* index in the awake or sleeping drops of the drops table */
+  int sleeping;                            /* 1 when waiting for a change around it */
+  uint32_t movedepoch;                     /* model epoch of the round the drop last moved in */
+  unsigned int watches;                    /* first watch entry in the drops table, when sleeping */
+  struct simulatordrop* nextfree;          /* next in the free list of the drops table, when not used */
   unsigned int size;                       /* number of water atoms */
   double calcite;                          /* 0 .. 1.0 */
   struct rgb calcitecolor;                 /* color of calcite contained in the water */
   struct atomboundingbox bounds;           /* bounding box for the atoms in the drop */
   unsigned int natoms;                     /* in how many phyatoms there are water */
-  struct atomcoordinates                   
-    atoms[simulatorstate_maxatomsperdrop]; /* which atoms are included in the drop */
+  unsigned int maxatoms;                   /* room in atoms before it has to grow */
+  atompackedcoordinates* atoms;            /* which atoms are included in the drop */
+  struct simulatordroptable* table;        /* the drops table the drop is in */
+  struct simulatordropplan plan;           /* how the drop moves in this round */
+  struct rngstream rng;                    /* random numbers of the drop */
 };
 
 struct simulatorstate;
+struct simulatordroptable;
 
 int
 simulator_drop_enoughspaceforwater(struct phymodel* model,
@@ -62,9 +91,18 @@ int
 simulator_drop_putdrop(struct phymodel* model,
 		       struct atomcoordinates* place,
 		       struct simulatordrop* drop);
+struct simulatordrop*
+simulator_drop_mergetouching(struct phymodel* model,
+			     struct simulatorstate* simulator,
+			     struct simulatordrop* drop);
 void
+simulator_drop_planmove(struct phymodel* model,
+			struct simulatordrop* drop);
+int
 simulator_drop_movedrop(struct phymodel* model,
                         struct simulatorstate* simulator,
 			struct simulatordrop* drop);
+unsigned int
+simulator_drop_reach(struct simulatordrop* drop);
 
 #endif /* DROP_H */
@@ -0,0 +1,137 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "dropatoms.h"
+
+static unsigned int
+simulator_dropatoms_class(unsigned int natoms) {
+  unsigned int class = 0;
+  while ((simulatordropatoms_minatoms << class) < natoms) class++;
+  return(class);
+}
+
+static void*
+simulator_dropatoms_newslab(struct simulatordropatoms* pool,
+			    size_t bytes) {
+  
+  void* slab;
+  
+  if (pool->nslabs == pool->maxslabs) {
+    unsigned int maxslabs = (pool->maxslabs == 0) ? 16 : 2 * pool->maxslabs;
+    void** slabs = (void**)realloc(pool->slabs,maxslabs * sizeof(void*));
+    if (slabs == 0) {
+      fatalu("cannot allocate space for atom slabs", maxslabs);
+      return(0);
+    }
+    pool->slabs = slabs;
+    pool->maxslabs = maxslabs;
+  }
+  slab = malloc(bytes);
+  if (slab == 0) {
+    fatalz("cannot allocate atom slab of bytes", bytes);
+    return(0);
+  }
+  pool->slabs[pool->nslabs++] = slab;
+  return(slab);
+}
+
+void
+simulator_dropatoms_initialize(struct simulatordropatoms* pool) {
+  memset(pool,0,sizeof(*pool));
+}
+
+void
+simulator_dropatoms_deinitialize(struct simulatordropatoms* pool) {
+  unsigned int i;
+  for (i = 0; i < pool->nslabs; i++) {
+    free(pool->slabs[i]);
+  }
+  free(pool->slabs);
+  memset(pool,0xFF,sizeof(*pool));
+}
+
+atompackedcoordinates*
+simulator_dropatoms_allocate(struct simulatordropatoms* pool,
+			     unsigned int natoms,
+			     unsigned int* capacity) {
+  
+  unsigned int class = simulator_dropatoms_class(natoms);
+  size_t bytes;
+  atompackedcoordinates* atoms;
+
+  if (class >= simulatordropatoms_nclasses) {
+    fatalu("too many atoms in a drop", natoms);
+    return(0);
+  }
+  *capacity = simulatordropatoms_minatoms << class;
+  bytes = *capacity * sizeof(atompackedcoordinates);
+  
+  /*
+   * A free list holds lists of one size class, linked through their
+   * first entry
+   */
+  
+  atoms = pool->freelists[class];
+  if (atoms != 0) {
+    pool->freelists[class] = *(atompackedcoordinates**)atoms;
+    return(atoms);
+  }
+  
+  /*
+   * Large lists get a slab of their own, others come from the current
+   * slab
+   */
+  
+  if (bytes >= simulatordropatoms_slabbytes) {
+    return((atompackedcoordinates*)simulator_dropatoms_newslab(pool,bytes));
+  }
+  if (pool->slabfree < bytes) {
+    pool->slab = (unsigned char*)simulator_dropatoms_newslab(pool,simulatordropatoms_slabbytes);
+    pool->slabfree = simulatordropatoms_slabbytes;
+  }
+  atoms = (atompackedcoordinates*)pool->slab;
+  pool->slab += bytes;
+  pool->slabfree -= bytes;
+  return(atoms);
+}
+
+void
+simulator_dropatoms_free(struct simulatordropatoms* pool,
+			 atompackedcoordinates* atoms,
+			 unsigned int capacity) {
+  unsigned int class;
+  if (atoms == 0) return;
+  class = simulator_dropatoms_class(capacity);
+  assert((simulatordropatoms_minatoms << class) == capacity);
+  *(atompackedcoordinates**)atoms = pool->freelists[class];
+  pool->freelists[class] = atoms;
+}
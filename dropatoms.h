@@ -0,0 +1,67 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef DROPATOMS_H
+#define DROPATOMS_H
+
+#include "coords.h"
+
+/*
+ * The atom lists of drops are allocated from a pool. Lists come in
+ * size classes of simulatordropatoms_minatoms times a power of two
+ * atoms. Small lists are carved out of larger slabs of memory, and
+ * freed lists are kept for reuse in a free list per size class; the
+ * memory is only returned to the system when the pool is
+ * deinitialized.
+ */
+
+#define simulatordropatoms_minatoms		8
+#define simulatordropatoms_nclasses		24
+#define simulatordropatoms_slabbytes		(64 * 1024)
+
+struct simulatordropatoms {
+  atompackedcoordinates* freelists[simulatordropatoms_nclasses];
+  unsigned int nslabs;
+  unsigned int maxslabs;
+  void** slabs;
+  unsigned char* slab;                     /* unused part of the current slab */
+  size_t slabfree;                         /* bytes left in the current slab */
+};
+
+extern void
+simulator_dropatoms_initialize(struct simulatordropatoms* pool);
+extern void
+simulator_dropatoms_deinitialize(struct simulatordropatoms* pool);
+extern atompackedcoordinates*
+simulator_dropatoms_allocate(struct simulatordropatoms* pool,
+			     unsigned int natoms,
+			     unsigned int* capacity);
+extern void
+simulator_dropatoms_free(struct simulatordropatoms* pool,
+			 atompackedcoordinates* atoms,
+			 unsigned int capacity);
+
+#endif /* DROPATOMS_H */
@@ -0,0 +1,143 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "drophash.h"
+
+#define simulator_drophash_slot(hash,atom)	((size_t)(((atom) * 0x9E3779B97F4A7C15ULL) >> 32) & ((hash)->size - 1))
+
+static void
+simulator_drophash_allocate(struct simulatordrophash* hash,
+			    size_t size) {
+  size_t i;
+  hash->entries = (struct simulatordrophashentry*)malloc(size * sizeof(struct simulatordrophashentry));
+  if (hash->entries == 0) {
+    fatalz("cannot allocate drop hash of entries", size);
+    return;
+  }
+  hash->size = size;
+  hash->nentries = 0;
+  for (i = 0; i < size; i++) {
+    hash->entries[i].atom = simulatordrophash_empty;
+    hash->entries[i].drop = 0;
+  }
+}
+
+static void
+simulator_drophash_grow(struct simulatordrophash* hash) {
+  struct simulatordrophashentry* old = hash->entries;
+  size_t oldsize = hash->size;
+  size_t i;
+  simulator_drophash_allocate(hash,2 * oldsize);
+  for (i = 0; i < oldsize; i++) {
+    if (old[i].atom != simulatordrophash_empty) {
+      simulator_drophash_set(hash,old[i].atom,old[i].drop);
+    }
+  }
+  free(old);
+}
+
+void
+simulator_drophash_initialize(struct simulatordrophash* hash) {
+  simulator_drophash_allocate(hash,simulatordrophash_initialsize);
+}
+
+void
+simulator_drophash_deinitialize(struct simulatordrophash* hash) {
+  free(hash->entries);
+  memset(hash,0xFF,sizeof(*hash));
+}
+
+void
+simulator_drophash_set(struct simulatordrophash* hash,
+		       atompackedcoordinates atom,
+		       struct simulatordrop* drop) {
+  
+  size_t slot;
+
+  assert(atom != simulatordrophash_empty);
+  if (2 * (hash->nentries + 1) > hash->size) simulator_drophash_grow(hash);
+  slot = simulator_drophash_slot(hash,atom);
+  while (hash->entries[slot].atom != simulatordrophash_empty &&
+	 hash->entries[slot].atom != atom) {
+    slot = (slot + 1) & (hash->size - 1);
+  }
+  if (hash->entries[slot].atom == simulatordrophash_empty) {
+    hash->entries[slot].atom = atom;
+    hash->nentries++;
+  }
+  hash->entries[slot].drop = drop;
+}
+
+void
+simulator_drophash_remove(struct simulatordrophash* hash,
+			  atompackedcoordinates atom) {
+  
+  size_t slot = simulator_drophash_slot(hash,atom);
+  size_t next;
+  
+  while (hash->entries[slot].atom != atom) {
+    if (hash->entries[slot].atom == simulatordrophash_empty) return;
+    slot = (slot + 1) & (hash->size - 1);
+  }
+  
+  /*
+   * Move back the entries after the removed one that would otherwise
+   * no longer be found, so that there are never deleted markers in
+   * the table
+   */
+  
+  next = slot;
+  while (1) {
+    size_t home;
+    next = (next + 1) & (hash->size - 1);
+    if (hash->entries[next].atom == simulatordrophash_empty) break;
+    home = simulator_drophash_slot(hash,hash->entries[next].atom);
+    if (((next - home) & (hash->size - 1)) >= ((next - slot) & (hash->size - 1))) {
+      hash->entries[slot] = hash->entries[next];
+      slot = next;
+    }
+  }
+  hash->entries[slot].atom = simulatordrophash_empty;
+  hash->entries[slot].drop = 0;
+  hash->nentries--;
+}
+
+struct simulatordrop*
+simulator_drophash_get(const struct simulatordrophash* hash,
+		       atompackedcoordinates atom) {
+  size_t slot = simulator_drophash_slot(hash,atom);
+  while (hash->entries[slot].atom != atom) {
+    if (hash->entries[slot].atom == simulatordrophash_empty) return(0);
+    slot = (slot + 1) & (hash->size - 1);
+  }
+  return(hash->entries[slot].drop);
+}
@@ -0,0 +1,69 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef DROPHASH_H
+#define DROPHASH_H
+
+#include "coords.h"
+
+/*
+ * A hash table from the coordinates of a water atom to the drop that
+ * owns it. Open addressing with linear probing; the table doubles
+ * when it becomes half full.
+ */
+
+#define simulatordrophash_initialsize		1024
+#define simulatordrophash_empty			(~(atompackedcoordinates)0)
+
+struct simulatordrop;
+
+struct simulatordrophashentry {
+  atompackedcoordinates atom;
+  struct simulatordrop* drop;
+};
+
+struct simulatordrophash {
+  size_t nentries;
+  size_t size;                             /* a power of two */
+  struct simulatordrophashentry* entries;
+};
+
+extern void
+simulator_drophash_initialize(struct simulatordrophash* hash);
+extern void
+simulator_drophash_deinitialize(struct simulatordrophash* hash);
+extern void
+simulator_drophash_set(struct simulatordrophash* hash,
+		       atompackedcoordinates atom,
+		       struct simulatordrop* drop);
+extern void
+simulator_drophash_remove(struct simulatordrophash* hash,
+			  atompackedcoordinates atom);
+extern struct simulatordrop*
+simulator_drophash_get(const struct simulatordrophash* hash,
+		       atompackedcoordinates atom);
+
+#endif /* DROPHASH_H */
@@ -35,58 +35,306 @@
 #include "droptable.h"
 #include "simul.h"
 
-static struct simulatordrop*
-simulator_droptable_findunuseddrop(struct simulatordroptable* state) {
-
+static void
+simulator_droptable_grow(struct simulatordroptable* state) {
+  
+  struct simulatordrop** blocks;
+  struct simulatordrop** active;
+  struct simulatordrop** sleeping;
+  struct simulatordrop* block;
+  unsigned int ndrops = state->ndrops + simulatordroptable_blockdrops;
   unsigned int i;
+  
+  /*
+   * Add a block of drops, and put them to the free list so that the
+   * one with the lowest index is used first.
+   */
+  
+  blocks = (struct simulatordrop**)realloc(state->blocks,(state->nblocks + 1) * sizeof(struct simulatordrop*));
+  active = (struct simulatordrop**)realloc(state->active,ndrops * sizeof(struct simulatordrop*));
+  sleeping = (struct simulatordrop**)realloc(state->sleeping,ndrops * sizeof(struct simulatordrop*));
+  block = (struct simulatordrop*)malloc(simulatordroptable_blockdrops * sizeof(struct simulatordrop));
+  if (blocks == 0 || active == 0 || sleeping == 0 || block == 0) {
+    fatalu("cannot allocate space for drops", ndrops);
+    return;
+  }
+  state->blocks = blocks;
+  state->active = active;
+  state->sleeping = sleeping;
+  state->blocks[state->nblocks++] = block;
+  for (i = simulatordroptable_blockdrops; i > 0; i--) {
+    struct simulatordrop* drop = &block[i - 1];
+    drop->active = 0;
+    drop->index = state->ndrops + i - 1;
+    drop->nextfree = state->freelist;
+    state->freelist = drop;
+  }
+  state->ndrops = ndrops;
+  debugf("drop table grown to %u drops", state->ndrops);
+}
+
+static void
+simulator_droptable_list(struct simulatordroptable* state,
+			 struct simulatordrop* drop) {
+  if (drop->sleeping) {
+    drop->activeindex = state->nsleeping;
+    state->sleeping[state->nsleeping++] = drop;
+  } else {
+    drop->activeindex = state->nactive;
+    state->active[state->nactive++] = drop;
+  }
+}
+
+static void
+simulator_droptable_unlist(struct simulatordroptable* state,
+			   struct simulatordrop* drop) {
+  
+  struct simulatordrop** drops = drop->sleeping ? state->sleeping : state->active;
+  unsigned int* ndrops = drop->sleeping ? &state->nsleeping : &state->nactive;
+  struct simulatordrop* last;
+  
+  /*
+   * Move the last drop of the array to the place of the removed one
+   */
+  
+  assert(drop->activeindex < *ndrops);
+  assert(drops[drop->activeindex] == drop);
+  if (!drop->sleeping && drop->activeindex < state->firstunlisted) {
+    state->firstunlisted = drop->activeindex;
+  }
+  last = drops[--(*ndrops)];
+  last->activeindex = drop->activeindex;
+  drops[last->activeindex] = last;
+}
 
-  assert(state->ndrops <= simulatordroptable_maxdrops);
-  for (i = 0; i < state->ndrops; i++) {
-    struct simulatordrop* drop = &state->drops[i];
-    if (!drop->active) {
-      drop->active = 1;
-      drop->index = i;
-      return(drop);
+static void
+simulator_droptable_watch(struct simulatordroptable* state,
+			  struct simulatordrop* drop,
+			  size_t brick) {
+  
+  struct simulatordropwatch* watch;
+  unsigned int index;
+  
+  if (state->freewatches != 0) {
+    index = state->freewatches;
+    state->freewatches = state->watches[index].next;
+  } else {
+    if (state->nwatches == state->maxwatches) {
+      unsigned int maxwatches = (state->maxwatches == 0) ? 1024 : 2 * state->maxwatches;
+      struct simulatordropwatch* watches =
+	(struct simulatordropwatch*)realloc(state->watches,maxwatches * sizeof(struct simulatordropwatch));
+      if (watches == 0) {
+	fatalu("cannot allocate space for drop watches", maxwatches);
+	return;
+      }
+      state->watches = watches;
+      state->maxwatches = maxwatches;
+      if (state->nwatches == 0) state->nwatches = 1;
     }
+    index = state->nwatches++;
   }
+  watch = &state->watches[index];
+  watch->drop = drop;
+  watch->brick = brick;
+  watch->prev = 0;
+  watch->next = state->brickwatches[brick];
+  if (watch->next != 0) state->watches[watch->next].prev = index;
+  state->brickwatches[brick] = index;
+  watch->dropnext = drop->watches;
+  drop->watches = index;
+}
 
-  return(0);
+static void
+simulator_droptable_unwatch(struct simulatordroptable* state,
+			    struct simulatordrop* drop) {
+  while (drop->watches != 0) {
+    unsigned int index = drop->watches;
+    struct simulatordropwatch* watch = &state->watches[index];
+    if (watch->prev != 0) state->watches[watch->prev].next = watch->next;
+    else state->brickwatches[watch->brick] = watch->next;
+    if (watch->next != 0) state->watches[watch->next].prev = watch->prev;
+    drop->watches = watch->dropnext;
+    watch->drop = 0;
+    watch->next = state->freewatches;
+    state->freewatches = index;
+  }
 }
 
 struct simulatordrop*
 simulator_droptable_getdrop(struct simulatordroptable* state) {
-  struct simulatordrop* drop = simulator_droptable_findunuseddrop(state);
-  if (drop != 0) {
-    return(drop);
-  } else if (state->ndrops < simulatordroptable_maxdrops) {
-    drop = &state->drops[state->ndrops++];
-    memset(drop,0,sizeof(*drop));
-    drop->active = 1;
-    drop->index = state->ndrops - 1;
-    drop->natoms = 0;
-    assert(state->ndrops <= simulatordroptable_maxdrops);
-    return(drop);
-  } else {
-    return(0);
+
+  struct simulatordrop* drop;
+  unsigned int index;
+  
+  if (state->freelist == 0) simulator_droptable_grow(state);
+  drop = state->freelist;
+  assert(drop != 0);
+  assert(!drop->active);
+  assert(state->nactive < state->ndrops);
+  state->freelist = drop->nextfree;
+  index = drop->index;
+  memset(drop,0,sizeof(*drop));
+  drop->active = 1;
+  drop->index = index;
+  drop->table = state;
+  rng_seedstream(&drop->rng,state->seed,rngpurpose_drop,state->ncreated++);
+  simulator_droptable_list(state,drop);
+  return(drop);
+}
+
+void
+simulator_droptable_disownatoms(struct simulatordroptable* state,
+				struct simulatordrop* drop) {
+  unsigned int i;
+  for (i = 0; i < drop->natoms; i++) {
+    if (simulator_drophash_get(&state->owners,drop->atoms[i]) == drop) {
+      simulator_drophash_remove(&state->owners,drop->atoms[i]);
+    }
   }
 }
 
 void
 simulator_droptable_deletedrop(struct simulatordroptable* state,
 			       struct simulatordrop* drop) {
+
+  /*
+   * Any water atoms the drop leaves behind no longer belong to a drop
+   */
+  
+  assert(drop->active);
+  if (drop->sleeping) simulator_droptable_unwatch(state,drop);
+  simulator_droptable_unlist(state,drop);
+  simulator_droptable_disownatoms(state,drop);
+  simulator_dropatoms_free(&state->atoms,drop->atoms,drop->maxatoms);
+  drop->atoms = 0;
+  drop->maxatoms = 0;
+  drop->natoms = 0;
   drop->active = 0;
-  while (!drop->active && drop->index == state->ndrops - 1) {
-    state->ndrops--;
-    drop--;
+  drop->sleeping = 0;
+  drop->nextfree = state->freelist;
+  state->freelist = drop;
+}
+
+void
+simulator_droptable_sleep(struct simulatordroptable* state,
+			  struct phymodel* model,
+			  struct simulatordrop* drop,
+			  unsigned int reach) {
+  
+  struct atomcoordinates low;
+  struct atomcoordinates high;
+  unsigned int bx;
+  unsigned int by;
+  unsigned int bz;
+  unsigned int i;
+
+  assert(drop->active && !drop->sleeping);
+  assert(model->brickepochs != 0);
+  if (state->brickwatches == 0) {
+    state->brickwatches = (unsigned int*)calloc(model->nbricks,sizeof(unsigned int));
+    if (state->brickwatches == 0) {
+      fatalz("cannot allocate brick watches of bytes", model->nbricks * sizeof(unsigned int));
+      return;
+    }
   }
+  
+  /*
+   * Watch the bricks that overlap the atoms of the drop and the atoms
+   * within reach from them
+   */
+  
+  assert(drop->natoms > 0);
+  atomcoordinates_unpack(drop->atoms[0],&low);
+  high = low;
+  for (i = 1; i < drop->natoms; i++) {
+    struct atomcoordinates atom;
+    atomcoordinates_unpack(drop->atoms[i],&atom);
+    if (atom.x < low.x) low.x = atom.x;
+    if (atom.y < low.y) low.y = atom.y;
+    if (atom.z < low.z) low.z = atom.z;
+    if (atom.x > high.x) high.x = atom.x;
+    if (atom.y > high.y) high.y = atom.y;
+    if (atom.z > high.z) high.z = atom.z;
+  }
+  low.x = (low.x > reach) ? low.x - reach : 0;
+  low.y = (low.y > reach) ? low.y - reach : 0;
+  low.z = (low.z > reach) ? low.z - reach : 0;
+  high.x = (high.x + reach < model->xSize) ? high.x + reach : model->xSize - 1;
+  high.y = (high.y + reach < model->ySize) ? high.y + reach : model->ySize - 1;
+  high.z = (high.z + reach < model->zSize) ? high.z + reach : model->zSize - 1;
+  for (bz = low.z >> phymodel_brickshift; bz <= high.z >> phymodel_brickshift; bz++) {
+    for (by = low.y >> phymodel_brickshift; by <= high.y >> phymodel_brickshift; by++) {
+      for (bx = low.x >> phymodel_brickshift; bx <= high.x >> phymodel_brickshift; bx++) {
+	simulator_droptable_watch(state,drop,(((size_t)bz) * model->yBricks + by) * model->xBricks + bx);
+      }
+    }
+  }
+  
+  simulator_droptable_unlist(state,drop);
+  drop->sleeping = 1;
+  simulator_droptable_list(state,drop);
+}
+
+void
+simulator_droptable_wake(struct simulatordroptable* state,
+			 struct simulatordrop* drop) {
+  assert(drop->active && drop->sleeping);
+  simulator_droptable_unwatch(state,drop);
+  simulator_droptable_unlist(state,drop);
+  drop->sleeping = 0;
+  simulator_droptable_list(state,drop);
+}
+
+unsigned int
+simulator_droptable_wakechanged(struct simulatordroptable* state,
+				struct phymodel* model) {
+  
+  unsigned int nwoken = 0;
+  size_t i;
+  
+  /*
+   * Wake the drops that watch a brick that has changed in the current
+   * epoch of the model
+   */
+  
+  if (state->brickwatches == 0) return(0);
+  for (i = 0; i < model->ndirtybricks; i++) {
+    size_t brick = model->dirtybricks[i];
+    while (state->brickwatches[brick] != 0) {
+      simulator_droptable_wake(state,state->watches[state->brickwatches[brick]].drop);
+      nwoken++;
+    }
+  }
+  
+  return(nwoken);
+}
+
+struct simulatordrop*
+simulator_droptable_atomowner(const struct simulatordroptable* state,
+			      const struct atomcoordinates* atom) {
+  return(simulator_drophash_get(&state->owners,atomcoordinates_pack(atom)));
 }
 
 void
 simulator_droptable_initialize(struct simulatordroptable* state){
-  state->ndrops = 0;
+  memset(state,0,sizeof(*state));
+  state->seed = rng_getseed();
+  simulator_dropatoms_initialize(&state->atoms);
+  simulator_drophash_initialize(&state->owners);
 }
 
 void
 simulator_droptable_deinitialize(struct simulatordroptable* state){
+  unsigned int i;
+  for (i = 0; i < state->nblocks; i++) {
+    free(state->blocks[i]);
+  }
+  free(state->blocks);
+  free(state->active);
+  free(state->sleeping);
+  free(state->watches);
+  free(state->brickwatches);
+  simulator_dropatoms_deinitialize(&state->atoms);
+  simulator_drophash_deinitialize(&state->owners);
   memset(state,0xFF,sizeof(*state));
 }
@@ -26,13 +26,54 @@
 #ifndef DROPTABLE_H
 #define DROPTABLE_H
 
+#include "phymodel.h"
 #include "drop.h"
+#include "dropatoms.h"
+#include "drophash.h"
 
-#define simulatordroptable_maxdrops		1024
+/*
+ * Drops are allocated from blocks of simulatordroptable_blockdrops
+ * drops. Blocks are never moved or freed while the table is in use,
+ * so pointers to drops stay valid, and the table grows as needed.
+ * Unused drops are kept in a free list, and the active drops are
+ * listed in dense arrays in no particular order: one for the drops
+ * that are awake, and one for those that sleep.
+ *
+ * A drop that cannot move sleeps until something changes next to
+ * it. It watches the bricks of the model around its atoms, and is
+ * woken when the model's change epochs show that one of them has
+ * changed.
+ */
+
+#define simulatordroptable_blockdrops		256
+
+struct simulatordropwatch {
+  struct simulatordrop* drop;
+  size_t brick;
+  unsigned int prev;                       /* in the watches of the brick */
+  unsigned int next;                       /* in the watches of the brick, or the free list */
+  unsigned int dropnext;                   /* in the watches of the drop */
+};
 
 struct simulatordroptable {
-  unsigned int ndrops;
-  struct simulatordrop drops[simulatordroptable_maxdrops];
+  unsigned int nactive;                    /* number of active drops */
+  unsigned long long ncreated;             /* number of drops ever taken into use */
+  unsigned long long seed;                 /* random seed for the streams of the drops */
+  unsigned int ndrops;                     /* number of drops in all blocks */
+  unsigned int nblocks;
+  struct simulatordrop** blocks;           /* nblocks blocks of drops */
+  struct simulatordrop* freelist;          /* unused drops */
+  struct simulatordrop** active;           /* nactive awake drops, room for ndrops */
+  unsigned int firstunlisted;              /* lowest index an awake drop was removed from */
+  unsigned int nsleeping;                  /* number of sleeping drops */
+  struct simulatordrop** sleeping;         /* nsleeping sleeping drops, room for ndrops */
+  unsigned int nwatches;                   /* number of watch entries in use or free */
+  unsigned int maxwatches;
+  struct simulatordropwatch* watches;      /* entry 0 is not used */
+  unsigned int freewatches;                /* unused watch entries */
+  unsigned int* brickwatches;              /* first watch entry of each brick, or 0 */
+  struct simulatordropatoms atoms;         /* atom lists of the drops */
+  struct simulatordrophash owners;         /* which drop each water atom belongs to */
 };
 
 void
@@ -44,5 +85,22 @@ simulator_droptable_getdrop(struct simulatordroptable* state);
 void
 simulator_droptable_deletedrop(struct simulatordroptable* state,
 			       struct simulatordrop* drop);
+void
+simulator_droptable_disownatoms(struct simulatordroptable* state,
+				struct simulatordrop* drop);
+void
+simulator_droptable_sleep(struct simulatordroptable* state,
+			  struct phymodel* model,
+			  struct simulatordrop* drop,
+			  unsigned int reach);
+void
+simulator_droptable_wake(struct simulatordroptable* state,
+			 struct simulatordrop* drop);
+unsigned int
+simulator_droptable_wakechanged(struct simulatordroptable* state,
+				struct phymodel* model);
+struct simulatordrop*
+simulator_droptable_atomowner(const struct simulatordroptable* state,
+			      const struct atomcoordinates* atom);
 
 #endif /* DROPTABLE_H */
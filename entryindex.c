@@ -0,0 +1,399 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "phymodel.h"
+#include "entryindex.h"
+
+#define simulator_entryindex_isfree(i,m,isrow,fixed,pos)	((isrow) ?					\
+								 phymodel_atomisfree((m),(pos),(fixed),(i)->level) : \
+								 phymodel_atomisfree((m),(fixed),(pos),(i)->level))
+
+
+static void
+simulator_entryindex_initializelines(struct simulatorentrylines* lines,
+				     unsigned int nlines,
+				     unsigned int size);
+static void
+simulator_entryindex_deinitializelines(struct simulatorentrylines* lines);
+static void
+simulator_entryindex_staleall(struct simulatorentrylines* lines,
+			      unsigned int nlines);
+static void
+simulator_entryindex_stalebrick(struct simulatorentryindex* index,
+				struct phymodel* model,
+				unsigned int bx,
+				unsigned int by);
+static void
+simulator_entryindex_update(struct simulatorentryindex* index,
+			    struct phymodel* model);
+static void
+simulator_entryindex_indexsegment(struct simulatorentryindex* index,
+				  struct phymodel* model,
+				  int isrow,
+				  unsigned int fixed,
+				  unsigned int segment);
+static int
+simulator_entryindex_findinline(struct simulatorentryindex* index,
+				struct phymodel* model,
+				int isrow,
+				unsigned int fixed,
+				unsigned int* pos,
+				int towardsn);
+static int
+simulator_entryindex_findupwards(struct simulatorentryindex* index,
+				 struct phymodel* model,
+				 struct atomcoordinates* place);
+
+void
+simulator_entryindex_initialize(struct simulatorentryindex* index,
+				struct phymodel* model,
+				unsigned int level) {
+  
+  size_t natoms = ((size_t)model->xSize) * model->ySize;
+  
+  assert(level < model->zSize);
+  memset(index,0,sizeof(*index));
+  index->level = level;
+  index->zSize = model->zSize;
+  simulator_entryindex_initializelines(&index->rows,model->ySize,model->xSize);
+  simulator_entryindex_initializelines(&index->columns,model->xSize,model->ySize);
+  index->verticalepochs = (uint32_t*)calloc(natoms,sizeof(uint32_t));
+  index->verticalfree = (uint32_t*)calloc(natoms,sizeof(uint32_t));
+  if (index->verticalepochs == 0 || index->verticalfree == 0) {
+    fatalz("cannot allocate entry index for atoms", natoms);
+    return;
+  }
+}
+
+void
+simulator_entryindex_deinitialize(struct simulatorentryindex* index) {
+  simulator_entryindex_deinitializelines(&index->rows);
+  simulator_entryindex_deinitializelines(&index->columns);
+  free(index->verticalepochs);
+  free(index->verticalfree);
+  memset(index,0xFF,sizeof(*index));
+}
+
+static void
+simulator_entryindex_initializelines(struct simulatorentrylines* lines,
+				     unsigned int nlines,
+				     unsigned int size) {
+  
+  lines->size = size;
+  lines->nsegments = phymodel_nbricks(size);
+  lines->nwords = (lines->nsegments + 63) / 64;
+  lines->segments = (struct simulatorentrysegment*)malloc(((size_t)nlines) * lines->nsegments *
+							  sizeof(struct simulatorentrysegment));
+  lines->free = (uint64_t*)calloc(((size_t)nlines) * lines->nwords,sizeof(uint64_t));
+  lines->stale = (uint64_t*)calloc(((size_t)nlines) * lines->nwords,sizeof(uint64_t));
+  if (lines->segments == 0 || lines->free == 0 || lines->stale == 0) {
+    fatalu("cannot allocate entry index for lines", nlines);
+    return;
+  }
+  simulator_entryindex_staleall(lines,nlines);
+}
+
+static void
+simulator_entryindex_deinitializelines(struct simulatorentrylines* lines) {
+  free(lines->segments);
+  free(lines->free);
+  free(lines->stale);
+}
+
+static void
+simulator_entryindex_staleall(struct simulatorentrylines* lines,
+			      unsigned int nlines) {
+  
+  unsigned int line;
+  unsigned int w;
+  
+  for (line = 0; line < nlines; line++) {
+    uint64_t* stale = &lines->stale[((size_t)line) * lines->nwords];
+    for (w = 0; w < lines->nwords; w++) {
+      unsigned int n = lines->nsegments - 64 * w;
+      stale[w] = (n >= 64) ? ~0ULL : ((1ULL << n) - 1);
+    }
+  }
+}
+
+static void
+simulator_entryindex_stalebrick(struct simulatorentryindex* index,
+				struct phymodel* model,
+				unsigned int bx,
+				unsigned int by) {
+  
+  unsigned int start;
+  unsigned int end;
+  unsigned int i;
+  
+  start = by << phymodel_brickshift;
+  end = start + phymodel_brickedge;
+  if (end > model->ySize) end = model->ySize;
+  for (i = start; i < end; i++) {
+    index->rows.stale[((size_t)i) * index->rows.nwords + (bx >> 6)] |= 1ULL << (bx & 63);
+  }
+  start = bx << phymodel_brickshift;
+  end = start + phymodel_brickedge;
+  if (end > model->xSize) end = model->xSize;
+  for (i = start; i < end; i++) {
+    index->columns.stale[((size_t)i) * index->columns.nwords + (by >> 6)] |= 1ULL << (by & 63);
+  }
+}
+
+static void
+simulator_entryindex_update(struct simulatorentryindex* index,
+			    struct phymodel* model) {
+  
+  const size_t nplanebricks = ((size_t)model->xBricks) * model->yBricks;
+  const size_t bz = index->level >> phymodel_brickshift;
+  unsigned int bx;
+  unsigned int by;
+  
+  /*
+   * The changed bricks of the current epoch are listed in the model,
+   * but those of earlier epochs are only seen from the epochs of the
+   * bricks. Epochs from before the epoch counter wrapped cannot be
+   * compared to the current ones, so then everything is indexed
+   * again.
+   */
+  
+  if (model->epoch < index->epoch) {
+    simulator_entryindex_staleall(&index->rows,model->ySize);
+    simulator_entryindex_staleall(&index->columns,model->xSize);
+    memset(index->verticalepochs,0,((size_t)model->xSize) * model->ySize * sizeof(uint32_t));
+    index->epoch = model->epoch;
+    index->nseenbricks = model->ndirtybricks;
+  } else if (model->epoch != index->epoch) {
+    const uint32_t* epochs = &model->brickepochs[bz * nplanebricks];
+    for (by = 0; by < model->yBricks; by++) {
+      for (bx = 0; bx < model->xBricks; bx++) {
+	if (epochs[((size_t)by) * model->xBricks + bx] >= index->epoch) {
+	  simulator_entryindex_stalebrick(index,model,bx,by);
+	}
+      }
+    }
+    index->epoch = model->epoch;
+    index->nseenbricks = model->ndirtybricks;
+  }
+  
+  for (; index->nseenbricks < model->ndirtybricks; index->nseenbricks++) {
+    size_t brick = model->dirtybricks[index->nseenbricks];
+    if (brick / nplanebricks == bz) {
+      brick %= nplanebricks;
+      simulator_entryindex_stalebrick(index,model,brick % model->xBricks,brick / model->xBricks);
+    }
+  }
+}
+
+int
+simulator_entryindex_findhole(struct simulatorentryindex* index,
+			      struct phymodel* model,
+			      struct atomcoordinates* place,
+			      enum direction direction) {
+
+  assert(model->brickepochs != 0);
+  assert(place->z == index->level);
+  assert(place->x < index->rows.size && place->y < index->columns.size);
+  simulator_entryindex_update(index,model);
+  
+  /*
+   * Find the nearest free atom in the direction, including the
+   * starting atom itself. When there is none, the place ends at the
+   * edge of the model, as it would after scanning there. Like the
+   * scan in simulator_move_dropuntilhole(), direction_z_towardsn
+   * looks for the hole towards larger y.
+   */
+  
+  switch (direction) {
+  case direction_x_towards0:
+    return(simulator_entryindex_findinline(index,model,1,place->y,&place->x,0));
+  case direction_x_towardsn:
+    return(simulator_entryindex_findinline(index,model,1,place->y,&place->x,1));
+  case direction_y_towards0:
+    return(simulator_entryindex_findinline(index,model,0,place->x,&place->y,0));
+  case direction_y_towardsn:
+  case direction_z_towardsn:
+    return(simulator_entryindex_findinline(index,model,0,place->x,&place->y,1));
+  case direction_z_towards0:
+    return(simulator_entryindex_findupwards(index,model,place));
+  default:
+    fatalu("invalid direction", direction);
+    return(0);
+  }
+}
+
+static void
+simulator_entryindex_indexsegment(struct simulatorentryindex* index,
+				  struct phymodel* model,
+				  int isrow,
+				  unsigned int fixed,
+				  unsigned int segment) {
+  
+  struct simulatorentrylines* lines = isrow ? &index->rows : &index->columns;
+  struct simulatorentrysegment* entry = &lines->segments[((size_t)fixed) * lines->nsegments + segment];
+  const size_t word = ((size_t)fixed) * lines->nwords + (segment >> 6);
+  const uint64_t bit = 1ULL << (segment & 63);
+  unsigned int start = segment << phymodel_brickshift;
+  unsigned int end = start + phymodel_brickedge;
+  unsigned int pos;
+  
+  if (end > lines->size) end = lines->size;
+  entry->first = simulatorentryindex_nooffset;
+  entry->last = simulatorentryindex_nooffset;
+  for (pos = start; pos < end; pos++) {
+    if (simulator_entryindex_isfree(index,model,isrow,fixed,pos)) {
+      if (entry->first == simulatorentryindex_nooffset) entry->first = pos - start;
+      entry->last = pos - start;
+    }
+  }
+  if (entry->first == simulatorentryindex_nooffset) lines->free[word] &= ~bit;
+  else lines->free[word] |= bit;
+  lines->stale[word] &= ~bit;
+  index->rebuilds++;
+}
+
+static int
+simulator_entryindex_findinline(struct simulatorentryindex* index,
+				struct phymodel* model,
+				int isrow,
+				unsigned int fixed,
+				unsigned int* pos,
+				int towardsn) {
+  
+  struct simulatorentrylines* lines = isrow ? &index->rows : &index->columns;
+  const uint64_t* freemask = &lines->free[((size_t)fixed) * lines->nwords];
+  const uint64_t* stalemask = &lines->stale[((size_t)fixed) * lines->nwords];
+  const struct simulatorentrysegment* segments = &lines->segments[((size_t)fixed) * lines->nsegments];
+  unsigned int segment = *pos >> phymodel_brickshift;
+  unsigned int p;
+  
+  /*
+   * Atoms in the segment of the starting point are checked one by
+   * one. Further segments are found from the bit masks, and those
+   * that may have changed are indexed on the way.
+   */
+  
+  if (towardsn) {
+    unsigned int end = (segment + 1) << phymodel_brickshift;
+    if (end > lines->size) end = lines->size;
+    for (p = *pos; p < end; p++) {
+      if (simulator_entryindex_isfree(index,model,isrow,fixed,p)) {
+	*pos = p;
+	return(1);
+      }
+    }
+    for (segment++; segment < lines->nsegments; segment++) {
+      unsigned int w = segment >> 6;
+      uint64_t word = (freemask[w] | stalemask[w]) & (~0ULL << (segment & 63));
+      if (word == 0) {
+	segment = 64 * w + 63;
+	continue;
+      }
+      segment = 64 * w + __builtin_ctzll(word);
+      if (segment >= lines->nsegments) break;
+      if ((stalemask[w] >> (segment & 63)) & 1) {
+	simulator_entryindex_indexsegment(index,model,isrow,fixed,segment);
+	if (((freemask[w] >> (segment & 63)) & 1) == 0) continue;
+      }
+      *pos = (segment << phymodel_brickshift) + segments[segment].first;
+      return(1);
+    }
+    *pos = lines->size - 1;
+    return(0);
+  } else {
+    unsigned int start = segment << phymodel_brickshift;
+    for (p = *pos + 1; p > start; p--) {
+      if (simulator_entryindex_isfree(index,model,isrow,fixed,p - 1)) {
+	*pos = p - 1;
+	return(1);
+      }
+    }
+    while (segment > 0) {
+      unsigned int w;
+      uint64_t word;
+      segment--;
+      w = segment >> 6;
+      word = (freemask[w] | stalemask[w]) & (~0ULL >> (63 - (segment & 63)));
+      if (word == 0) {
+	segment = 64 * w;
+	continue;
+      }
+      segment = 64 * w + 63 - __builtin_clzll(word);
+      if ((stalemask[w] >> (segment & 63)) & 1) {
+	simulator_entryindex_indexsegment(index,model,isrow,fixed,segment);
+	if (((freemask[w] >> (segment & 63)) & 1) == 0) continue;
+      }
+      *pos = (segment << phymodel_brickshift) + segments[segment].last;
+      return(1);
+    }
+    *pos = 0;
+    return(0);
+  }
+}
+
+static int
+simulator_entryindex_findupwards(struct simulatorentryindex* index,
+				 struct phymodel* model,
+				 struct atomcoordinates* place) {
+  
+  const size_t i = ((size_t)place->y) * index->rows.size + place->x;
+  unsigned int z;
+  
+  /*
+   * The search is remembered until the model changes between the
+   * starting level and the free atom that was found
+   */
+  
+  if (index->verticalepochs[i] == 0 ||
+      phymodel_boxchangedsince(model,
+			       index->verticalepochs[i],
+			       place->x,place->x + 1,
+			       place->y,place->y + 1,
+			       index->verticalfree[i] == simulatorentryindex_noz ? 0 : index->verticalfree[i],
+			       index->level + 1)) {
+    index->verticalfree[i] = simulatorentryindex_noz;
+    for (z = index->level + 1; z > 0; z--) {
+      if (phymodel_atomisfree(model,place->x,place->y,z - 1)) {
+	index->verticalfree[i] = z - 1;
+	break;
+      }
+    }
+    index->verticalepochs[i] = model->epoch;
+    index->rebuilds++;
+  }
+  
+  if (index->verticalfree[i] == simulatorentryindex_noz) {
+    place->z = 0;
+    return(0);
+  }
+  place->z = index->verticalfree[i];
+  return(1);
+}
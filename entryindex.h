@@ -0,0 +1,89 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef ENTRYINDEX_H
+#define ENTRYINDEX_H
+
+#include <stdint.h>
+#include "phymodel.h"
+#include "coords.h"
+#include "drop.h"
+
+/*
+ * New drops enter the model at the starting level, and look for a
+ * hole by moving in one direction until they find a free atom. The
+ * entry index splits the rows and columns of the starting level into
+ * segments of one brick, and remembers the first and last free atom
+ * of each segment. Bit masks of the segments that have free atoms
+ * let the search step over up to 64 bricks of rock at a time. The
+ * segments of bricks that change are indexed again when next needed
+ * (see phymodel_markchanged()). The upward search from the starting
+ * level is remembered for each (x,y) until the model changes along
+ * it.
+ */
+
+#define simulatorentryindex_nooffset	0xFF
+#define simulatorentryindex_noz		0xFFFFFFFFU
+
+struct simulatorentrysegment {
+  uint8_t first;                /* offset of the first free atom, or none */
+  uint8_t last;                 /* offset of the last free atom, or none */
+};
+
+struct simulatorentrylines {
+  unsigned int size;            /* atoms in a line */
+  unsigned int nsegments;       /* segments in a line */
+  unsigned int nwords;          /* mask words in a line */
+  struct simulatorentrysegment* segments;
+  uint64_t* free;               /* bit per segment: has free atoms */
+  uint64_t* stale;              /* bit per segment: to be indexed again */
+};
+
+struct simulatorentryindex {
+  unsigned int level;           /* z of the starting level */
+  unsigned int zSize;
+  uint32_t epoch;               /* model epoch the index has seen changes of */
+  size_t nseenbricks;           /* changed bricks of the epoch seen */
+  struct simulatorentrylines rows;       /* per y, along x */
+  struct simulatorentrylines columns;    /* per x, along y */
+  uint32_t* verticalepochs;     /* per (x,y): epoch of the upward search, or 0 */
+  uint32_t* verticalfree;       /* per (x,y): nearest free z upwards, or none */
+  unsigned long long rebuilds;  /* segments and vertical lines indexed */
+};
+
+extern void
+simulator_entryindex_initialize(struct simulatorentryindex* index,
+				struct phymodel* model,
+				unsigned int level);
+extern void
+simulator_entryindex_deinitialize(struct simulatorentryindex* index);
+extern int
+simulator_entryindex_findhole(struct simulatorentryindex* index,
+			      struct phymodel* model,
+			      struct atomcoordinates* place,
+			      enum direction direction);
+
+#endif /* ENTRYINDEX_H */
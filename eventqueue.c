@@ -0,0 +1,118 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "eventqueue.h"
+
+#define simulator_eventqueue_before(a,b)	((a)->round < (b)->round ||				\
+						 ((a)->round == (b)->round && (a)->type < (b)->type))
+
+void
+simulator_eventqueue_initialize(struct simulatoreventqueue* queue) {
+  queue->nevents = 0;
+  queue->maxevents = simulatoreventqueue_initialsize;
+  queue->events = (struct simulatorevent*)malloc(queue->maxevents * sizeof(struct simulatorevent));
+  if (queue->events == 0) {
+    fatalu("cannot allocate event queue of events", queue->maxevents);
+    return;
+  }
+}
+
+void
+simulator_eventqueue_deinitialize(struct simulatoreventqueue* queue) {
+  free(queue->events);
+  memset(queue,0xFF,sizeof(*queue));
+}
+
+void
+simulator_eventqueue_schedule(struct simulatoreventqueue* queue,
+			      unsigned long long round,
+			      enum simulatoreventtype type) {
+  
+  struct simulatorevent event;
+  unsigned int i;
+  
+  if (queue->nevents == queue->maxevents) {
+    unsigned int maxevents = 2 * queue->maxevents;
+    struct simulatorevent* events =
+      (struct simulatorevent*)realloc(queue->events,maxevents * sizeof(struct simulatorevent));
+    if (events == 0) {
+      fatalu("cannot allocate event queue of events", maxevents);
+      return;
+    }
+    queue->events = events;
+    queue->maxevents = maxevents;
+  }
+  
+  /*
+   * Sift the new event up from the end of the heap
+   */
+  
+  event.round = round;
+  event.type = type;
+  i = queue->nevents++;
+  while (i > 0 && simulator_eventqueue_before(&event,&queue->events[(i - 1) / 2])) {
+    queue->events[i] = queue->events[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  queue->events[i] = event;
+}
+
+int
+simulator_eventqueue_next(struct simulatoreventqueue* queue,
+			  struct simulatorevent* event) {
+  
+  struct simulatorevent last;
+  unsigned int i;
+  
+  if (queue->nevents == 0) return(0);
+  *event = queue->events[0];
+  
+  /*
+   * Sift the last event down from the top of the heap
+   */
+  
+  last = queue->events[--queue->nevents];
+  i = 0;
+  for (;;) {
+    unsigned int child = 2 * i + 1;
+    if (child >= queue->nevents) break;
+    if (child + 1 < queue->nevents &&
+	simulator_eventqueue_before(&queue->events[child + 1],&queue->events[child])) {
+      child++;
+    }
+    if (!simulator_eventqueue_before(&queue->events[child],&last)) break;
+    queue->events[i] = queue->events[child];
+    i = child;
+  }
+  queue->events[i] = last;
+  
+  return(1);
+}
@@ -0,0 +1,68 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef EVENTQUEUE_H
+#define EVENTQUEUE_H
+
+/*
+ * The scheduled events of a simulation, as a binary heap ordered by
+ * the round of the event. Events of the same round are ordered by
+ * their type, in the order the simulator processes them within a
+ * round.
+ */
+
+#define simulatoreventqueue_initialsize		16
+
+enum simulatoreventtype {
+  simulatorevent_movedrops = 0,            /* move awake drops, wake sleeping ones */
+  simulatorevent_createdrop = 1,           /* drop a new drop of water */
+  simulatorevent_snapshot = 2              /* write a progress image */
+};
+
+struct simulatorevent {
+  unsigned long long round;
+  enum simulatoreventtype type;
+};
+
+struct simulatoreventqueue {
+  unsigned int nevents;
+  unsigned int maxevents;
+  struct simulatorevent* events;           /* events[0] is the next event */
+};
+
+extern void
+simulator_eventqueue_initialize(struct simulatoreventqueue* queue);
+extern void
+simulator_eventqueue_deinitialize(struct simulatoreventqueue* queue);
+extern void
+simulator_eventqueue_schedule(struct simulatoreventqueue* queue,
+			      unsigned long long round,
+			      enum simulatoreventtype type);
+extern int
+simulator_eventqueue_next(struct simulatoreventqueue* queue,
+			  struct simulatorevent* event);
+
+#endif /* EVENTQUEUE_H */
@@ -30,48 +30,37 @@
 #include "phymodel.h"
 #include "image.h"
 
+struct image_slicecontext {
+  void* pixels;
+  size_t xstep;       /* pixel index step for one unit of x */
+  size_t ystep;       /* pixel index step for one unit of y */
+  size_t zstep;       /* pixel index step for one unit of z */
+  size_t rowstep;     /* pixel index step along a segment */
+};
+
 static void
-image_model2image_zpixel(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data);
-static void
-image_model2image_xpixel(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data);
-static void
-image_model2image_ypixel(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data);
-static void
-image_model2txtimage_zpixel(unsigned int x,
-			    unsigned int y,
-			    unsigned int z,
-			    struct phymodel* model,
-			    phyatom* atom,
-			    void* data);
+image_slicecontext_initialize(struct image_slicecontext* context,
+			      struct phymodel* model,
+			      enum coordinatetype coord,
+			      void* pixels,
+			      enum phymodelaxis* fixedaxis,
+			      enum phymodelaxis* rowaxis);
 static void
-image_model2txtimage_xpixel(unsigned int x,
-			    unsigned int y,
-			    unsigned int z,
-			    struct phymodel* model,
-			    phyatom* atom,
-			    void* data);
+image_model2image_segment(unsigned int x,
+			  unsigned int y,
+			  unsigned int z,
+			  unsigned int length,
+			  const phyatom* atoms,
+			  ptrdiff_t stride,
+			  void* data);
 static void
-image_model2txtimage_ypixel(unsigned int x,
-			    unsigned int y,
-			    unsigned int z,
-			    struct phymodel* model,
-			    phyatom* atom,
-			    void* data);
+image_model2txtimage_segment(unsigned int x,
+			     unsigned int y,
+			     unsigned int z,
+			     unsigned int length,
+			     const phyatom* atoms,
+			     ptrdiff_t stride,
+			     void* data);
 static void
 image_modelgen2image(struct phymodel* model,
 		     enum coordinatetype coord,
@@ -84,6 +73,13 @@ image_modelgen2imagetxt(struct phymodel* model,
 			const char* filename,
 			unsigned int coord1size,
 			unsigned int coord2size);
+static void
+image_model2image3d_atom(unsigned int x,
+			 unsigned int y,
+			 unsigned int z,
+			 struct phymodel* model,
+			 const phyatom* atom,
+			 void* data);
   
 void
 image_modelz2image(struct phymodel* model,
@@ -158,12 +154,15 @@ image_modelgen2image(struct phymodel* model,
     
     ExceptionInfo* exception;
     Image* image = 0;
+    struct image_slicecontext context;
+    enum phymodelaxis fixedaxis;
+    enum phymodelaxis rowaxis;
     ImageInfo* image_info;
-    unsigned int nPixels = coord1size * coord2size;
+    size_t nPixels = ((size_t)coord1size) * coord2size;
     unsigned char* pixels = (unsigned char*)malloc(3 * nPixels);
     
     if (pixels == 0) {
-      fatalsu("cannot allocate pixels for file",filename,nPixels);
+      fatalsz("cannot allocate pixels for file",filename,nPixels);
     }
     
     /*
@@ -188,29 +187,13 @@ image_modelgen2image(struct phymodel* model,
      * Put the table of pixels in an array
      */
     
-    switch (coord) {
-    case coordinatetype_z:
-      phymodel_mapatoms_atz(model,
-			    coordval,
-			    image_model2image_zpixel,
-			    (void*)pixels);
-      break;
-    case coordinatetype_x:
-      phymodel_mapatoms_atx(model,
-			    coordval,
-			    image_model2image_xpixel,
-			    (void*)pixels);
-      break;
-    case coordinatetype_y:
-      phymodel_mapatoms_aty(model,
-			    coordval,
-			    image_model2image_ypixel,
-			    (void*)pixels);
-      break;
-    default:
-      fatal("unrecognised coordinate type");
-      return;
-    }
+    image_slicecontext_initialize(&context,model,coord,pixels,&fixedaxis,&rowaxis);
+    phymodel_mapsegments(model,
+			 fixedaxis,
+			 coordval,
+			 rowaxis,
+			 image_model2image_segment,
+			 &context);
     
     /*
      * Create the ImageMagick image object
@@ -264,40 +247,27 @@ image_modelgen2imagetxt(struct phymodel* model,
    * Allocations
    */
 
-  unsigned int nPixels = coord1size * coord2size;
+  size_t nPixels = ((size_t)coord1size) * coord2size;
   char* pixels = (char*)malloc(nPixels);
+  struct image_slicecontext context;
+  enum phymodelaxis fixedaxis;
+  enum phymodelaxis rowaxis;
     
   if (pixels == 0) {
-    fatalsu("cannot allocate pixels for file",filename,nPixels);
+    fatalsz("cannot allocate pixels for file",filename,nPixels);
   }
   
   /*
    * Put the table of pixels in an array
    */
   
-  switch (coord) {
-  case coordinatetype_z:
-    phymodel_mapatoms_atz(model,
-			  coordval,
-			  image_model2txtimage_zpixel,
-			  (void*)pixels);
-    break;
-  case coordinatetype_x:
-    phymodel_mapatoms_atx(model,
-			  coordval,
-			  image_model2txtimage_xpixel,
-			  (void*)pixels);
-    break;
-  case coordinatetype_y:
-    phymodel_mapatoms_aty(model,
-			  coordval,
-			  image_model2txtimage_ypixel,
-			  (void*)pixels);
-    break;
-  default:
-    fatal("unrecognised coordinate type");
-    return;
-  }
+  image_slicecontext_initialize(&context,model,coord,pixels,&fixedaxis,&rowaxis);
+  phymodel_mapsegments(model,
+		       fixedaxis,
+		       coordval,
+		       rowaxis,
+		       image_model2txtimage_segment,
+		       &context);
   
   /*
    * Write the image to file
@@ -313,7 +283,7 @@ image_modelgen2imagetxt(struct phymodel* model,
   unsigned int i;
   
   for (i = 0; i < coord2size; i++) {
-    fwrite(pixels + i*coord1size,1,coord1size,f);
+    fwrite(pixels + ((size_t)i)*coord1size,1,coord1size,f);
     fprintf(f,"\n");
   }
   
@@ -325,182 +295,173 @@ image_modelgen2imagetxt(struct phymodel* model,
 }
 
 static void
-image_model2image_zpixel(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data) {
-  unsigned char* pixels = (unsigned char*)data;
-  enum material mat = phyatom_mat(atom);
-  struct rgb rgb;
-  
-  switch (mat) {
-  case material_air:
-    pixels[3*(y * (model->xSize) + x)+0] = 0;
-    pixels[3*(y * (model->xSize) + x)+1] = 0;
-    pixels[3*(y * (model->xSize) + x)+2] = 0;
-    break;
-  case material_rock:
-    phyatom_color(&rgb,atom);
-    pixels[3*(y * (model->xSize) + x)+0] = rgb.r;
-    pixels[3*(y * (model->xSize) + x)+1] = rgb.g;
-    pixels[3*(y * (model->xSize) + x)+2] = rgb.b;
-    break;
-  case material_water:
-    pixels[3*(y * (model->xSize) + x)+0] = 0;
-    pixels[3*(y * (model->xSize) + x)+1] = 0;
-    pixels[3*(y * (model->xSize) + x)+2] = 255;
-    break;
-  default:
-    fatalu("unrecognised atom material type",(int)mat);
-  }
-}
+image_slicecontext_initialize(struct image_slicecontext* context,
+			      struct phymodel* model,
+			      enum coordinatetype coord,
+			      void* pixels,
+			      enum phymodelaxis* fixedaxis,
+			      enum phymodelaxis* rowaxis) {
 
-static void
-image_model2image_xpixel(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data) {
-  unsigned char* pixels = (unsigned char*)data;
-  enum material mat = phyatom_mat(atom);
-  struct rgb rgb;
+  /*
+   * Pixels are walked in the order they are in the image, so that
+   * each segment of atoms fills consecutive pixels.
+   */
   
-  switch (mat) {
-  case material_air:
-    pixels[3*(z * (model->zSize) + y)+0] = 0;
-    pixels[3*(z * (model->zSize) + y)+1] = 0;
-    pixels[3*(z * (model->zSize) + y)+2] = 0;
+  memset(context,0,sizeof(*context));
+  context->pixels = pixels;
+  context->rowstep = 1;
+  switch (coord) {
+  case coordinatetype_z:
+    context->xstep = 1;
+    context->ystep = model->xSize;
+    *fixedaxis = phymodelaxis_z;
+    *rowaxis = phymodelaxis_x;
     break;
-  case material_rock:
-    phyatom_color(&rgb,atom);
-    pixels[3*(z * (model->zSize) + y)+0] = rgb.r;
-    pixels[3*(z * (model->zSize) + y)+1] = rgb.g;
-    pixels[3*(z * (model->zSize) + y)+2] = rgb.b;
+  case coordinatetype_x:
+    context->ystep = 1;
+    context->zstep = model->zSize;
+    *fixedaxis = phymodelaxis_x;
+    *rowaxis = phymodelaxis_y;
     break;
-  case material_water:
-    pixels[3*(z * (model->zSize) + y)+0] = 0;
-    pixels[3*(z * (model->zSize) + y)+1] = 0;
-    pixels[3*(z * (model->zSize) + y)+2] = 255;
+  case coordinatetype_y:
+    context->xstep = 1;
+    context->zstep = model->xSize;
+    *fixedaxis = phymodelaxis_y;
+    *rowaxis = phymodelaxis_x;
     break;
   default:
-    fatalu("unrecognised atom material type",(int)mat);
+    fatal("unrecognised coordinate type");
   }
 }
 
 static void
-image_model2image_ypixel(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data) {
-  unsigned char* pixels = (unsigned char*)data;
-  enum material mat = phyatom_mat(atom);
-  struct rgb rgb;
+image_model2image_segment(unsigned int x,
+			  unsigned int y,
+			  unsigned int z,
+			  unsigned int length,
+			  const phyatom* atoms,
+			  ptrdiff_t stride,
+			  void* data) {
+  struct image_slicecontext* context = (struct image_slicecontext*)data;
+  unsigned char* pixel = ((unsigned char*)context->pixels) +
+    3 * (x * context->xstep + y * context->ystep + z * context->zstep);
+  unsigned int i;
   
-  switch (mat) {
-  case material_air:
-    pixels[3*(z * (model->xSize) + x)+0] = 0;
-    pixels[3*(z * (model->xSize) + x)+1] = 0;
-    pixels[3*(z * (model->xSize) + x)+2] = 0;
-    break;
-  case material_rock:
-    phyatom_color(&rgb,atom);
-    pixels[3*(z * (model->xSize) + x)+0] = rgb.r;
-    pixels[3*(z * (model->xSize) + x)+1] = rgb.g;
-    pixels[3*(z * (model->xSize) + x)+2] = rgb.b;
-    break;
-  case material_water:
-    pixels[3*(z * (model->xSize) + x)+0] = 0;
-    pixels[3*(z * (model->xSize) + x)+1] = 0;
-    pixels[3*(z * (model->xSize) + x)+2] = 255;
-    break;
-  default:
-    fatalu("unrecognised atom material type",(int)mat);
+  for (i = 0; i < length; i++, atoms += stride, pixel += 3 * context->rowstep) {
+    enum material mat = phyatom_mat(atoms);
+    struct rgb rgb;
+    switch (mat) {
+    case material_air:
+      pixel[0] = 0;
+      pixel[1] = 0;
+      pixel[2] = 0;
+      break;
+    case material_rock:
+      phyatom_color(&rgb,atoms);
+      pixel[0] = rgb.r;
+      pixel[1] = rgb.g;
+      pixel[2] = rgb.b;
+      break;
+    case material_water:
+      pixel[0] = 0;
+      pixel[1] = 0;
+      pixel[2] = 255;
+      break;
+    default:
+      fatalu("unrecognised atom material type",(int)mat);
+    }
   }
 }
 
 static void
-image_model2txtimage_zpixel(unsigned int x,
-			    unsigned int y,
-			    unsigned int z,
-			    struct phymodel* model,
-			    phyatom* atom,
-			    void* data) {
-  char* pixels = (char*)data;
-  enum material mat = phyatom_mat(atom);
+image_model2txtimage_segment(unsigned int x,
+			     unsigned int y,
+			     unsigned int z,
+			     unsigned int length,
+			     const phyatom* atoms,
+			     ptrdiff_t stride,
+			     void* data) {
+  struct image_slicecontext* context = (struct image_slicecontext*)data;
+  char* pixel = ((char*)context->pixels) +
+    (x * context->xstep + y * context->ystep + z * context->zstep);
+  unsigned int i;
   
-  switch (mat) {
-  case material_air:
-    pixels[y * model->xSize + x] = ' ';
-    break;
-  case material_rock:
-    pixels[y * model->xSize + x] = 'R';
-    break;
-  case material_water:
-    pixels[y * model->xSize + x] = 'W';
-    break;
-  default:
-    fatalu("unrecognised atom material type",(int)mat);
+  for (i = 0; i < length; i++, atoms += stride, pixel += context->rowstep) {
+    enum material mat = phyatom_mat(atoms);
+    switch (mat) {
+    case material_air:
+      *pixel = ' ';
+      break;
+    case material_rock:
+      *pixel = 'R';
+      break;
+    case material_water:
+      *pixel = 'W';
+      break;
+    default:
+      fatalu("unrecognised atom material type",(int)mat);
+    }
   }
 }
 
 static void
-image_model2txtimage_xpixel(unsigned int x,
-			    unsigned int y,
-			    unsigned int z,
-			    struct phymodel* model,
-			    phyatom* atom,
-			    void* data) {
-  char* pixels = (char*)data;
-  enum material mat = phyatom_mat(atom);
+image_model2image3d_atom(unsigned int x,
+			 unsigned int y,
+			 unsigned int z,
+			 struct phymodel* model,
+			 const phyatom* atom,
+			 void* data) {
   
-  switch (mat) {
-  case material_air:
-    pixels[z * model->zSize + y] = ' ';
-    break;
-  case material_rock:
-    pixels[z * model->zSize + y] = 'R';
-    break;
-  case material_water:
-    pixels[z * model->zSize + y] = 'W';
-    break;
-  default:
-    fatalu("unrecognised atom material type",(int)mat);
-  }
-}
-
-static void
-image_model2txtimage_ypixel(unsigned int x,
-			    unsigned int y,
-			    unsigned int z,
-			    struct phymodel* model,
-			    phyatom* atom,
-			    void* data) {
-  char* pixels = (char*)data;
-  enum material mat = phyatom_mat(atom);
+  FILE* f = (FILE*)data;
+  const phyatom* rock = 0;
+  struct rgb rgb;
   
-  switch (mat) {
-  case material_air:
-    pixels[z * model->xSize + x] = ' ';
-    break;
-  case material_rock:
-    pixels[z * model->xSize + x] = 'R';
-    break;
-  case material_water:
-    pixels[z * model->xSize + x] = 'W';
-    break;
-  default:
-    fatalu("unrecognised atom material type",(int)mat);
-  }
+  /*
+   * A surface atom gets the colour of the rock next to it. The height
+   * is written upwards, while z grows downwards in the model.
+   */
+  
+  if (x > 0 && phymodel_atommat(model,x-1,y,z) == material_rock) rock = phymodel_getatom_readonly(model,x-1,y,z);
+  else if (x + 1 < model->xSize && phymodel_atommat(model,x+1,y,z) == material_rock) rock = phymodel_getatom_readonly(model,x+1,y,z);
+  else if (y > 0 && phymodel_atommat(model,x,y-1,z) == material_rock) rock = phymodel_getatom_readonly(model,x,y-1,z);
+  else if (y + 1 < model->ySize && phymodel_atommat(model,x,y+1,z) == material_rock) rock = phymodel_getatom_readonly(model,x,y+1,z);
+  else if (z > 0 && phymodel_atommat(model,x,y,z-1) == material_rock) rock = phymodel_getatom_readonly(model,x,y,z-1);
+  else rock = phymodel_getatom_readonly(model,x,y,z+1);
+  phyatom_color(&rgb,rock);
+  fprintf(f,"%u %u %u %u %u %u\n",
+	  x, y, model->zSize - 1 - z,
+	  (unsigned int)rgb.r, (unsigned int)rgb.g, (unsigned int)rgb.b);
 }
 
 void
 image_model2image3d(struct phymodel* model,
 		    const char* filename) {
-  /* ... */
-  fatal("3D model conversion not implemented");
+  
+  /*
+   * Write the surface of the rock, the free atoms with rock on one of
+   * their sides, as a point cloud in the ASCII PLY format
+   */
+  
+  phymodel_enablesurface(model);
+  debugf("writing surface of %zu atoms to file %s", model->surface->natoms, filename);
+  FILE* f = fopen(filename,"w");
+  if (f == 0) {
+    fatals("cannot open file for writing",filename);
+    return;
+  }
+  fprintf(f,"ply\n");
+  fprintf(f,"format ascii 1.0\n");
+  fprintf(f,"comment drop-tracer rock surface, in units of 1/%u m\n", model->unit);
+  fprintf(f,"element vertex %zu\n", model->surface->natoms);
+  fprintf(f,"property uint x\n");
+  fprintf(f,"property uint y\n");
+  fprintf(f,"property uint z\n");
+  fprintf(f,"property uchar red\n");
+  fprintf(f,"property uchar green\n");
+  fprintf(f,"property uchar blue\n");
+  fprintf(f,"end_header\n");
+  phymodel_mapsurface(model,image_model2image3d_atom,f);
+  if (fclose(f) != 0) {
+    fatals("cannot write surface file",filename);
+  }
 }
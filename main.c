@@ -30,6 +30,8 @@
 #include <string.h>
 #include <ctype.h>
 #include "util.h"
+#include "rng.h"
+#include "parallel.h"
 #include "phymodel.h"
 #include "rock.h"
 #include "simul.h"
@@ -59,15 +61,21 @@ static unsigned int creationStyleFractalLevels = 2;
 static unsigned int creationStyleFractalCardinality = 3;
 static enum crackdirection creationStyleDirection = crackdirection_y;
 static int creationStyleCave = 0;
+static int modelLayout = -1; /* not set, keep the layout of the input model */
+static int modelFormat = -1; /* not set, keep the format of the input model */
 static unsigned int imageZ = 10;
 static unsigned int imageX = 0;
 static unsigned int imageY = 0;
-static unsigned int simulRounds = 1000;
+static unsigned long long simulRounds = 1000;
 static unsigned int simulDropFrequency = 100;
 static unsigned int simulDropSize = 30; /* in atoms */
 static int simulTextualSnapshot = 0;
+static int simulBitplanes = 0;
+static int simulSleep = 1;
 static const unsigned int maxTextualSnapshotDimension = 150;
 static const char* progressImages = 0;
+static unsigned int ensembleMembers = 0; /* 0 = a single simulation */
+static const char* statsFile = 0;
 
 static struct option long_options[] = {
   
@@ -89,6 +97,11 @@ static struct option long_options[] = {
   {"vertical-crack", no_argument,      (int*)&creationStyleDirection, (int)crackdirection_y},
   {"cave", no_argument,                (int*)&creationStyleCave, 1},
   {"no-cave", no_argument,             (int*)&creationStyleCave, 0},
+  {"linear", no_argument,              &modelLayout, (int)phymodellayout_linear},
+  {"bricked", no_argument,             &modelLayout, (int)phymodellayout_bricked},
+  {"sparse", no_argument,              &modelLayout, (int)phymodellayout_sparse},
+  {"compress", no_argument,            &modelFormat, (int)phymodelformat_compressed},
+  {"no-compress", no_argument,         &modelFormat, (int)phymodelformat_raw},
   {"horizontal-crack", no_argument,    (int*)&creationStyleDirection, (int)crackdirection_x},
   {"simulate", no_argument,            (int*)&operation, drop_tracer_operation_simulate},
   {"copy", no_argument,                (int*)&operation, drop_tracer_operation_copy},
@@ -96,6 +109,10 @@ static struct option long_options[] = {
   {"model", no_argument,               (int*)&operation, drop_tracer_operation_model},
   {"textual-snapshot", no_argument,    (int*)&simulTextualSnapshot, 1},
   {"no-textual-snapshot", no_argument, (int*)&simulTextualSnapshot, 0},
+  {"bitplanes", no_argument,           &simulBitplanes, 1},
+  {"no-bitplanes", no_argument,        &simulBitplanes, 0},
+  {"sleep", no_argument,               &simulSleep, 1},
+  {"no-sleep", no_argument,            &simulSleep, 0},
   
   /*
    * These options need an argument
@@ -120,6 +137,9 @@ static struct option long_options[] = {
   {"output",                       required_argument, 0, 'o'},
   {"seed",                         required_argument, 0, 'S'},
   {"progress-images",              required_argument, 0, 'M'},
+  {"threads",                      required_argument, 0, 'T'},
+  {"ensemble",                     required_argument, 0, 'E'},
+  {"stats-json",                   required_argument, 0, 'J'},
   
   /*
    * End of the options table
@@ -270,6 +290,26 @@ main(int argc,
 	imageX = 0;
 	break;
 	
+      case 'T':
+	ival = atoi(optarg);
+	if (ival <= 0) {
+	  fatals("number of threads must be a positive integer, got",optarg);
+	}
+	parallel_setnthreads((unsigned int)ival);
+	break;
+	
+      case 'E':
+	ival = atoi(optarg);
+	if (ival <= 0) {
+	  fatals("number of ensemble members must be a positive integer, got",optarg);
+	}
+	ensembleMembers = (unsigned int)ival;
+	break;
+	
+      case 'J':
+	statsFile = optarg;
+	break;
+	
       case 'i':
 	inputfile = optarg;
 	break;
@@ -286,7 +326,7 @@ main(int argc,
         break;
         
       case 'R':
-	simulRounds = atoi(optarg);
+	simulRounds = strtoull(optarg,0,10);
 	if (simulRounds > 0 && strlen(optarg) > 0 && isalpha(optarg[strlen(optarg)-1])) {
 	  switch (toupper(optarg[strlen(optarg)-1])) {
 	  case 'K':
@@ -296,7 +336,7 @@ main(int argc,
 	    simulRounds *= 1000 * 1000;
 	    break;
 	  case 'B':
-	    simulRounds *= 1000 * 1000 * 1000;
+	    simulRounds *= 1000ULL * 1000 * 1000;
 	    break;
 	  default:
 	    fatals("unrecognised unit in --rounds arguments, expected K, M or B, got", optarg);
@@ -333,7 +373,7 @@ main(int argc,
    * Initialize system
    */
   
-  srand(seed);
+  rng_setseed(seed);
   if (deepdeepdebug) deepdebug = 1;
   if (deepdebug) debug = 1;
   
@@ -369,11 +409,13 @@ main(int argc,
 				     creationStyleFractalCardinality,
 				     creationStyleDirection,
 				     creationStyleCave,
+				     modelLayout < 0 ? phymodellayout_linear : (enum phymodellayout)modelLayout,
 				     unit,
 				     xSize,
 				     ySize,
 				     zSize);
     debugf("now doing the main mod write!");
+    if (modelFormat >= 0) model->format = (enum phymodelformat)modelFormat;
     phymodel_write(model,outputfile);
     phymodel_destroy(model);
     break;
@@ -390,21 +432,57 @@ main(int argc,
     if (outputfile == 0) {
       fatal("output file should be specified for --simulate");
     }
-    model = phymodel_read(inputfile);
+    simulator_setsleep(simulSleep);
+    if (ensembleMembers > 0) {
+      if (index(outputfile,'%') == 0) {
+	fatals("output file must have percent sign with --ensemble, got only",outputfile);
+      }
+      if (progressImages != 0) {
+	fatal("cannot use --progress-images with --ensemble");
+      }
+      model = phymodel_read_sparse(inputfile);
+      if (model == 0) {
+	fatals("failed to read input model",inputfile);
+      }
+      if (modelFormat >= 0) model->format = (enum phymodelformat)modelFormat;
+      simulator_ensemble(model,
+			 ensembleMembers,
+			 seed,
+			 simulRounds,
+			 simulDropFrequency,
+			 simulDropSize,
+			 outputfile,
+			 statsFile);
+      phymodel_destroy(model);
+      break;
+    }
+    if (modelLayout == (int)phymodellayout_sparse) {
+      model = phymodel_read_sparse(inputfile);
+    } else if (samefile(inputfile,outputfile)) {
+      model = phymodel_read(inputfile,phymodelaccess_shared);
+    } else {
+      model = phymodel_read(inputfile,phymodelaccess_private);
+    }
     if (model == 0) {
       fatals("failed to read input model",inputfile);
     }
-    if (model->xSize > maxTextualSnapshotDimension ||
-	model->ySize > maxTextualSnapshotDimension ||
-	model->zSize > maxTextualSnapshotDimension) {
+    if (modelFormat >= 0) model->format = (enum phymodelformat)modelFormat;
+    if (simulTextualSnapshot &&
+	(model->xSize > maxTextualSnapshotDimension ||
+	 model->ySize > maxTextualSnapshotDimension ||
+	 model->zSize > maxTextualSnapshotDimension)) {
       fatalu("cannot use --textual-snapshot for models larger than a limit in any dimension",
 	     maxTextualSnapshotDimension);
     }
+    if (simulBitplanes && model->layout != phymodellayout_sparse) {
+      phymodel_enablebitplanes(model);
+    }
     simulator_simulate(model,
 		       simulRounds,
 		       simulDropFrequency,
 		       simulDropSize,
-		       progressImages);
+		       progressImages,
+		       statsFile);
     phymodel_write(model,outputfile);
     phymodel_destroy(model);
     break;
@@ -421,10 +499,20 @@ main(int argc,
     if (outputfile == 0) {
       fatal("output file should be specified for --copy");
     }
-    model = phymodel_read(inputfile);
+    if (modelLayout == (int)phymodellayout_sparse) {
+      model = phymodel_read_sparse(inputfile);
+    } else {
+      model = phymodel_read(inputfile,phymodelaccess_readonly);
+    }
     if (model == 0) {
       fatals("failed to read input model",inputfile);
     }
+    if (modelLayout >= 0 && (enum phymodellayout)modelLayout != model->layout) {
+      struct phymodel* newmodel = phymodel_relayout(model,(enum phymodellayout)modelLayout);
+      phymodel_destroy(model);
+      model = newmodel;
+    }
+    if (modelFormat >= 0) model->format = (enum phymodelformat)modelFormat;
     phymodel_write(model,outputfile);
     phymodel_destroy(model);
     break;
@@ -441,7 +529,17 @@ main(int argc,
     if (outputfile == 0) {
       fatal("output file should be specified for --image");
     }
-    model = phymodel_read(inputfile);
+    if (imageX > 0 || imageY > 0) {
+      model = phymodel_read(inputfile,phymodelaccess_readonly);
+    } else {
+      
+      /*
+       * Of a compressed model, only the chunks with the plane in them
+       * need to be decoded
+       */
+      
+      model = phymodel_read_region(inputfile,phymodelaccess_readonly,imageZ,imageZ + 1);
+    }
     if (model == 0) {
       fatals("failed to read input model",inputfile);
     }
@@ -474,7 +572,7 @@ main(int argc,
     if (outputfile == 0) {
       fatal("output file should be specified for --model");
     }
-    model = phymodel_read(inputfile);
+    model = phymodel_read(inputfile,phymodelaccess_readonly);
     if (model == 0) {
       fatals("failed to read input model",inputfile);
     }
@@ -0,0 +1,186 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "parallel.h"
+
+#define parallel_maxthreads	256
+
+/*
+ * The helper threads are started when first needed and then kept,
+ * waiting for the next job. One job runs at a time; the helpers that
+ * a job uses take its pieces one by one, as does the calling thread,
+ * which returns when all pieces are taken and none is still running.
+ */
+
+struct parallel_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;                  /* a new job, for the helpers */
+  pthread_cond_t done;                  /* the last running piece ended, for the caller */
+  pthread_mutex_t callers;              /* held by the thread running a job */
+  unsigned int nhelpers;                /* helper threads started */
+  unsigned long long generation;        /* number of jobs started */
+  unsigned int jobhelpers;              /* helpers that take part in the job */
+  unsigned int next;                    /* next piece to take */
+  unsigned int n;                       /* number of pieces */
+  unsigned int running;                 /* pieces taken and not yet done */
+  parallel_fn fn;
+  void* data;
+};
+
+static unsigned int parallel_threads = 0; /* 0 = one per online processor */
+static __thread int parallel_inworker = 0;  /* 1 while running a piece */
+static struct parallel_pool parallel_pool = {
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_MUTEX_INITIALIZER,
+  0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void*
+parallel_helper(void* arg);
+static void
+parallel_work(struct parallel_pool* pool);
+
+unsigned int
+parallel_nthreads(void) {
+  if (parallel_threads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > parallel_maxthreads) n = parallel_maxthreads;
+    parallel_threads = (unsigned int)n;
+    debugf("using %u threads", parallel_threads);
+  }
+  return(parallel_threads);
+}
+
+void
+parallel_setnthreads(unsigned int nthreads) {
+  if (nthreads > parallel_maxthreads) nthreads = parallel_maxthreads;
+  parallel_threads = nthreads;
+}
+
+static void
+parallel_work(struct parallel_pool* pool) {
+  
+  /*
+   * Take pieces of the current job until there are none left. Called
+   * and returns with the pool locked.
+   */
+  
+  parallel_inworker = 1;
+  while (pool->next < pool->n) {
+    unsigned int index = pool->next++;
+    pool->running++;
+    pthread_mutex_unlock(&pool->lock);
+    (*(pool->fn))(index,pool->data);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0 && pool->next >= pool->n) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  parallel_inworker = 0;
+}
+
+static void*
+parallel_helper(void* arg) {
+  
+  struct parallel_pool* pool = &parallel_pool;
+  unsigned int id = (unsigned int)(size_t)arg;
+  unsigned long long seen = 0;
+  
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == seen) {
+      pthread_cond_wait(&pool->work,&pool->lock);
+    }
+    seen = pool->generation;
+    if (id < pool->jobhelpers) parallel_work(pool);
+  }
+  
+  return(0);
+}
+
+void
+parallel_for(unsigned int n,
+	     parallel_fn fn,
+	     void* data) {
+  
+  struct parallel_pool* pool = &parallel_pool;
+  unsigned int nthreads = parallel_nthreads();
+  unsigned int i;
+  
+  assert(fn != 0);
+  if (nthreads > n) nthreads = n;
+  
+  /*
+   * Run small jobs, and jobs within a piece of another job, in the
+   * calling thread
+   */
+  
+  if (nthreads <= 1 || parallel_inworker) {
+    for (i = 0; i < n; i++) (*fn)(i,data);
+    return;
+  }
+  
+  /*
+   * Start more helper threads if needed, hand the job to the helpers,
+   * and work in this thread as well
+   */
+  
+  pthread_mutex_lock(&pool->callers);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->nhelpers < nthreads - 1) {
+    pthread_t thread;
+    if (pthread_create(&thread,0,parallel_helper,(void*)(size_t)pool->nhelpers) != 0) {
+      debugf("cannot create more than %u helper threads", pool->nhelpers);
+      break;
+    }
+    pthread_detach(thread);
+    pool->nhelpers++;
+  }
+  pool->fn = fn;
+  pool->data = data;
+  pool->n = n;
+  pool->next = 0;
+  pool->running = 0;
+  pool->jobhelpers = nthreads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  parallel_work(pool);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done,&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->callers);
+}
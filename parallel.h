@@ -0,0 +1,51 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+ * Running independent pieces of work in parallel. The pieces are
+ * numbered from 0 to n-1, and each thread repeatedly takes the next
+ * piece that has not yet been taken. The caller returns when all
+ * pieces are done. A parallel_for() called from within a piece runs
+ * its pieces one by one in the calling thread. The helper threads
+ * are kept from one call to the next.
+ */
+
+typedef void (*parallel_fn)(unsigned int index,
+			    void* data);
+
+extern unsigned int
+parallel_nthreads(void);
+extern void
+parallel_setnthreads(unsigned int nthreads);
+extern void
+parallel_for(unsigned int n,
+	     parallel_fn fn,
+	     void* data);
+
+#endif /* PARALLEL_H */
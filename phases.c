@@ -0,0 +1,138 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "util.h"
+#include "phases.h"
+
+static const char* simulator_phase_names[simulatorphase_howmany] = {
+  "create drop",
+  "enough space for water",
+  "put drop",
+  "move drops",
+  "plan move",
+  "should fall",
+  "determine drop end",
+  "snapshot"
+};
+
+struct simulatorphasethread {
+  struct simulatorphasetimes times;
+  struct simulatorphasethread* next;
+};
+
+static pthread_mutex_t simulator_phase_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct simulatorphasethread* simulator_phase_threads = 0;
+static __thread struct simulatorphasetimes* simulator_phase_local = 0;
+
+static struct simulatorphasetimes*
+simulator_phase_thread(void);
+
+const char*
+simulator_phase_name(enum simulatorphase phase) {
+  assert(phase < simulatorphase_howmany);
+  return(simulator_phase_names[phase]);
+}
+
+uint64_t
+simulator_phase_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return(((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+void
+simulator_phase_add(enum simulatorphase phase,
+		    uint64_t start) {
+  struct simulatorphasetimes* times = simulator_phase_local;
+  assert(phase < simulatorphase_howmany);
+  if (times == 0) times = simulator_phase_thread();
+  times->calls[phase]++;
+  times->nanoseconds[phase] += simulator_phase_now() - start;
+}
+
+void
+simulator_phase_collect(struct simulatorphasetimes* times) {
+  
+  /*
+   * The counters of the other threads are read without them knowing;
+   * collect when they are not running phases, as between parallel
+   * jobs
+   */
+  
+  struct simulatorphasethread* thread;
+  unsigned int i;
+  memset(times,0,sizeof(*times));
+  pthread_mutex_lock(&simulator_phase_lock);
+  for (thread = simulator_phase_threads; thread != 0; thread = thread->next) {
+    for (i = 0; i < simulatorphase_howmany; i++) {
+      times->calls[i] += thread->times.calls[i];
+      times->nanoseconds[i] += thread->times.nanoseconds[i];
+    }
+  }
+  pthread_mutex_unlock(&simulator_phase_lock);
+}
+
+void
+simulator_phase_since(struct simulatorphasetimes* times,
+		      const struct simulatorphasetimes* before) {
+  unsigned int i;
+  simulator_phase_collect(times);
+  for (i = 0; i < simulatorphase_howmany; i++) {
+    times->calls[i] -= before->calls[i];
+    times->nanoseconds[i] -= before->nanoseconds[i];
+  }
+}
+
+static struct simulatorphasetimes*
+simulator_phase_thread(void) {
+  
+  /*
+   * The first time a thread times a phase, give it counters of its
+   * own. They are kept for as long as the program runs, as the
+   * threads of the pool are.
+   */
+  
+  struct simulatorphasethread* thread;
+  thread = (struct simulatorphasethread*)malloc(sizeof(*thread));
+  if (thread == 0) {
+    fatal("cannot allocate phase times");
+    return(0);
+  }
+  memset(thread,0,sizeof(*thread));
+  pthread_mutex_lock(&simulator_phase_lock);
+  thread->next = simulator_phase_threads;
+  simulator_phase_threads = thread;
+  pthread_mutex_unlock(&simulator_phase_lock);
+  simulator_phase_local = &thread->times;
+  return(simulator_phase_local);
+}
@@ -0,0 +1,70 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef PHASES_H
+#define PHASES_H
+
+#include <stdint.h>
+
+/*
+ * Time spent in the phases of a simulation. Each thread adds to its
+ * own counters, without locks, and the totals are collected over the
+ * counters of all threads. The phases nest: planning a move includes
+ * deciding whether the drop falls and where it lands, and creating a
+ * drop includes checking for space and putting it in place.
+ */
+
+enum simulatorphase {
+  simulatorphase_createdrop = 0,           /* create a new drop */
+  simulatorphase_enoughspace = 1,          /* check for space for water */
+  simulatorphase_putdrop = 2,              /* put the atoms of a drop in place */
+  simulatorphase_movedrops = 3,            /* plan and move the drops of a round */
+  simulatorphase_planmove = 4,             /* plan the move of one drop */
+  simulatorphase_shouldfall = 5,           /* decide whether a drop falls */
+  simulatorphase_dropend = 6,              /* find where a falling drop lands */
+  simulatorphase_snapshot = 7,             /* write a progress image */
+  simulatorphase_howmany = 8
+};
+
+struct simulatorphasetimes {
+  uint64_t calls[simulatorphase_howmany];
+  uint64_t nanoseconds[simulatorphase_howmany];
+};
+
+extern const char*
+simulator_phase_name(enum simulatorphase phase);
+extern uint64_t
+simulator_phase_now(void);
+extern void
+simulator_phase_add(enum simulatorphase phase,
+		    uint64_t start);
+extern void
+simulator_phase_collect(struct simulatorphasetimes* times);
+extern void
+simulator_phase_since(struct simulatorphasetimes* times,
+		      const struct simulatorphasetimes* before);
+
+#endif /* PHASES_H */
@@ -28,33 +28,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "util.h"
+#include "parallel.h"
 #include "phymodel.h"
 #include "rock.h"
 
-static void
-phymodel_create_initatom(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data);
+static unsigned int
+phymodel_layoutmagic(enum phymodellayout layout) {
+  switch (layout) {
+  case phymodellayout_linear:
+    return(PHYMODEL_MAGIC);
+  case phymodellayout_bricked:
+  case phymodellayout_sparse:
+    return(PHYMODEL_MAGIC_BRICKED);
+  default:
+    fatal("unrecognised model layout");
+    return(0);
+  }
+}
 
-struct phymodel*
-phymodel_create(unsigned int unit,
-		unsigned int xSize,
-		unsigned int ySize,
-		unsigned int zSize) {
+static void
+phymodel_create_describe(unsigned int unit,
+			 unsigned int xSize,
+			 unsigned int ySize,
+			 unsigned int zSize) {
   
-  unsigned int size = phymodel_sizeinbytes(xSize,ySize,zSize);
-  struct phymodel* model = (struct phymodel*)malloc(size);
-  unsigned int convenientsize = size;
+  size_t size = phymodel_natoms(xSize,ySize,zSize) * sizeof(phyatom);
+  size_t convenientsize = size;
   const char* convenientunit = "B";
   
-  if (model == 0) {
-    fatalu("cannot allocate model for bytes",size);
-  }
-
   if (convenientsize >= 1024 * 1024 * 1024) {
     convenientsize /= 1024 * 1024 * 1024;
     convenientunit = "G";
@@ -66,44 +75,192 @@ phymodel_create(unsigned int unit,
     convenientunit = "K";
   }
   
-  debugf("created an image object of %u%s bytes (%ux%ux%u), atom memory size = %u",
+  debugf("created an image object of %zu%s bytes (%ux%ux%u), atom memory size = %zu",
 	 convenientsize, convenientunit,
 	 xSize, ySize, zSize,
-	 sizeof(model->atoms[0]));
+	 sizeof(phyatom));
   debugf("unit is %f mm, model size %fm x %fm x %fm (%f m3)",
 	 (1.0 * 1000.0) / unit,
 	 (xSize * 1.0) / (unit * 1.0),
 	 (ySize * 1.0) / (unit * 1.0),
 	 (zSize * 1.0) / (unit * 1.0),
 	 (xSize * 1.0) / (unit * 1.0) * (ySize * 1.0) / (unit * 1.0) * (zSize * 1.0) / (unit * 1.0));
-  
-  model->magic = PHYMODEL_MAGIC;
+}
+
+static void
+phymodel_setdimensions(struct phymodel* model,
+		       enum phymodellayout layout,
+		       unsigned int unit,
+		       unsigned int xSize,
+		       unsigned int ySize,
+		       unsigned int zSize) {
   model->unit = unit;
   model->xSize = xSize;
   model->ySize = ySize;
   model->zSize = zSize;
+  model->layout = layout;
+  model->xBricks = phymodel_nbricks(xSize);
+  model->yBricks = phymodel_nbricks(ySize);
+  model->zBricks = phymodel_nbricks(zSize);
+  model->natoms = phymodel_layoutnatoms(layout,xSize,ySize,zSize);
+  model->nbricks = phymodel_natoms(model->xBricks,model->yBricks,model->zBricks);
+}
+
+static void
+phymodel_sparse_allocate(struct phymodel* model) {
+
+  /*
+   * All bricks start as uniform, with the all-zero atom, i.e., black
+   * air.
+   */
+  
+  assert(model->layout == phymodellayout_sparse);
+  model->bricks = (phyatom**)calloc(model->nbricks,sizeof(phyatom*));
+  model->brickvalues = (phyatom*)calloc(model->nbricks,sizeof(phyatom));
+  if (model->bricks == 0 || model->brickvalues == 0) {
+    fatalz("cannot allocate brick directory for bricks",model->nbricks);
+  }
+  model->nallocatedbricks = 0;
+}
+
+static void
+phymodel_sparse_describe(struct phymodel* model) {
+  assert(model->layout == phymodellayout_sparse);
+  debugf("sparse model has %zu of %zu bricks allocated (%zu MB, directory %zu MB)",
+	 model->nallocatedbricks,
+	 model->nbricks,
+	 (model->nallocatedbricks * phymodel_brickatoms * sizeof(phyatom)) / (1024 * 1024),
+	 (model->nbricks * (sizeof(phyatom*) + sizeof(phyatom))) / (1024 * 1024));
+}
+
+struct phymodel*
+phymodel_create(enum phymodellayout layout,
+		unsigned int unit,
+		unsigned int xSize,
+		unsigned int ySize,
+		unsigned int zSize) {
+  
+  size_t size = phymodel_layoutnatoms(layout,xSize,ySize,zSize) * sizeof(phyatom);
+  struct phymodel* model = (struct phymodel*)malloc(sizeof(struct phymodel));
+  
+  if (model == 0) {
+    fatalz("cannot allocate model for bytes",sizeof(struct phymodel));
+    return(0);
+  }
+  memset(model,0,sizeof(*model));
+  model->storage = phymodelstorage_allocated;
+  model->magic = PHYMODEL_MAGIC;
+  phymodel_setdimensions(model,layout,unit,xSize,ySize,zSize);
+  phymodel_create_describe(unit,xSize,ySize,zSize);
   
-  phymodel_mapatoms(model,phymodel_create_initatom,0);
+  if (layout == phymodellayout_sparse) {
+
+    /*
+     * Sparse models start with all bricks uniform, no need to
+     * initialize atoms one by one.
+     */
+    
+    phymodel_sparse_allocate(model);
+    
+  } else {
+    
+    /*
+     * An atom that is all zero bits is black air, so cleared memory
+     * is an empty model. For large models, calloc gets the memory
+     * directly from the system, and pages are only populated when
+     * they are first touched.
+     */
+    
+    model->atoms = (phyatom*)calloc(size,1);
+    if (model->atoms == 0) {
+      fatalz("cannot allocate model for bytes",size);
+    }
+    
+  }
   
   assert(phymodel_isvalid(model));
   
   return(model);
 }
 
-static void
-phymodel_create_initatom(unsigned int x,
-			 unsigned int y,
-			 unsigned int z,
-			 struct phymodel* model,
-			 phyatom* atom,
-			 void* data) {
-  struct rgb black;
-  assert(phymodel_isvalid(model));
-  rgb_set_black(&black);
+struct phymodel*
+phymodel_create_file(const char* filename,
+		     enum phymodellayout layout,
+		     unsigned int unit,
+		     unsigned int xSize,
+		     unsigned int ySize,
+		     unsigned int zSize) {
+  
+  struct phymodelheader header;
+  size_t size = phymodel_sizeinbytes(layout,xSize,ySize,zSize);
+  int fd;
+  
+  /*
+   * Write the header and extend the file to its full size. An atom
+   * that is all zero bits is black air, so the rest of the file does
+   * not need to be written at all, and remains sparse on the disk.
+   */
+  
+  fd = open(filename,O_RDWR | O_CREAT | O_TRUNC,0644);
+  if (fd < 0) {
+    fatals("failed to create file", filename);
+    return(0);
+  }
+  
+  memset(&header,0,sizeof(header));
+  header.magic = phymodel_layoutmagic(layout);
+  header.unit = unit;
+  header.xSize = xSize;
+  header.ySize = ySize;
+  header.zSize = zSize;
+  if (write(fd,&header,sizeof(header)) != sizeof(header)) {
+    close(fd);
+    fatals("failed to write model header to file", filename);
+    return(0);
+  }
+  if (ftruncate(fd,size) != 0) {
+    close(fd);
+    fatalsz("failed to extend model file to bytes", filename, size);
+    return(0);
+  }
+  close(fd);
+  
+  phymodel_create_describe(unit,xSize,ySize,zSize);
+  
+  /*
+   * Map the new file for writing
+   */
+  
+  return(phymodel_read(filename,phymodelaccess_shared));
+}
+
+static phyatom*
+phymodel_sparse_allocatebrick(struct phymodel* model,
+			      size_t brick) {
+  phyatom* atoms = (phyatom*)malloc(phymodel_brickatoms * sizeof(phyatom));
+  assert(model->bricks[brick] == 0);
+  if (atoms == 0) {
+    fatalz("cannot allocate model brick of bytes",phymodel_brickatoms * sizeof(phyatom));
+  }
+  memset(atoms,model->brickvalues[brick],phymodel_brickatoms * sizeof(phyatom));
+  model->bricks[brick] = atoms;
+  __atomic_add_fetch(&model->nallocatedbricks,1,__ATOMIC_RELAXED);
+  return(atoms);
+}
 
-  phyatom_reset(atom);
-  phyatom_set_mat(atom,material_air);
-  phyatom_set_color(atom,&black);
+static phyatom*
+phymodel_sparse_copybrick(struct phymodel* model,
+			  size_t brick) {
+  phyatom* atoms = (phyatom*)malloc(phymodel_brickatoms * sizeof(phyatom));
+  assert(model->sharedbricks != 0 && model->sharedbricks[brick]);
+  if (atoms == 0) {
+    fatalz("cannot allocate model brick of bytes",phymodel_brickatoms * sizeof(phyatom));
+  }
+  memcpy(atoms,model->bricks[brick],phymodel_brickatoms * sizeof(phyatom));
+  model->bricks[brick] = atoms;
+  model->sharedbricks[brick] = 0;
+  __atomic_add_fetch(&model->nallocatedbricks,1,__ATOMIC_RELAXED);
+  return(atoms);
 }
 
 phyatom*
@@ -113,15 +270,966 @@ phymodel_getatom(struct phymodel* model,
 		 unsigned int z) {
   
   assert(phymodel_isvalid(model));
-  unsigned int atomIndex = phymodel_atomindex(model,x,y,z);
   assert(x < model->xSize);
   assert(y < model->ySize);
   assert(z < model->zSize);
+  if (model->layout == phymodellayout_sparse) {
+    size_t brick = phymodel_brickindex(model,x,y,z);
+    phyatom* atoms = model->bricks[brick];
+    if (atoms == 0) atoms = phymodel_sparse_allocatebrick(model,brick);
+    else if (model->sharedbricks != 0 && model->sharedbricks[brick]) atoms = phymodel_sparse_copybrick(model,brick);
+    return(&atoms[phymodel_inbrickindex(x,y,z)]);
+  }
+  size_t atomIndex = phymodel_atomindex(model,x,y,z);
   phyatom* atom = &model->atoms[atomIndex];
   return(atom);
   
 }
 
+static void
+phymodel_invalidaterockbeside(struct phymodel* model,
+			      unsigned int startX,
+			      unsigned int endX,
+			      unsigned int startY,
+			      unsigned int endY,
+			      unsigned int startZ,
+			      unsigned int endZ) {
+  
+  unsigned int bx;
+  unsigned int by;
+  unsigned int bz;
+  
+  /*
+   * A change can affect the masks of the atoms next to it in x and
+   * y, which may be in the neighbouring bricks
+   */
+  
+  if (startX > 0) startX--;
+  if (startY > 0) startY--;
+  if (endX < model->xSize) endX++;
+  if (endY < model->ySize) endY++;
+  for (bz = startZ >> phymodel_brickshift; bz <= (endZ - 1) >> phymodel_brickshift; bz++) {
+    for (by = startY >> phymodel_brickshift; by <= (endY - 1) >> phymodel_brickshift; by++) {
+      for (bx = startX >> phymodel_brickshift; bx <= (endX - 1) >> phymodel_brickshift; bx++) {
+	model->rockbesidebuilt[phymodel_brickindex(model,
+						   bx << phymodel_brickshift,
+						   by << phymodel_brickshift,
+						   bz << phymodel_brickshift)] = 0;
+      }
+    }
+  }
+}
+
+void
+phymodel_setatom(struct phymodel* model,
+		 unsigned int x,
+		 unsigned int y,
+		 unsigned int z,
+		 phyatom value) {
+  
+  /*
+   * Setting an atom in a uniform brick to the value it already has
+   * does not need the brick to be allocated.
+   */
+  
+  if (model->bitplanes != 0) {
+    enum material mat = phyatom_mat(&value);
+    uint64_t bit = phymodel_bitplanebit(x);
+    unsigned int plane;
+    for (plane = 0; plane < phymodel_nbitplanes; plane++) {
+      if (plane == mat) {
+	phymodel_bitplaneword(model,plane,x,y,z) |= bit;
+      } else {
+	phymodel_bitplaneword(model,plane,x,y,z) &= ~bit;
+      }
+    }
+  }
+  int rockchanged = ((model->rockbeside != 0 || model->surface != 0) &&
+		     (phyatom_mat(&value) == material_rock) != (phymodel_atommat(model,x,y,z) == material_rock));
+  if (rockchanged && model->rockbeside != 0) {
+    phymodel_invalidaterockbeside(model,x,x+1,y,y+1,z,z+1);
+  }
+  if (model->solidcolumns != 0 && model->solidcolumnsbuilt[phymodel_brickcolumn(model,x,y)]) {
+    uint64_t* word = &phymodel_solidcolumn(model,x,y)[z >> 6];
+    if (phyatom_mat(&value) == material_air) *word &= ~phymodel_bitplanebit(z);
+    else *word |= phymodel_bitplanebit(z);
+  }
+  if (model->layout == phymodellayout_sparse) {
+    size_t brick = phymodel_brickindex(model,x,y,z);
+    if (model->bricks[brick] == 0 && model->brickvalues[brick] == value) return;
+  }
+  if (model->brickepochs != 0) {
+    phyatom* atom = phymodel_getatom(model,x,y,z);
+    if (*atom == value) return;
+    phymodel_markchanged(model,x,y,z);
+    *atom = value;
+  } else {
+    *phymodel_getatom(model,x,y,z) = value;
+  }
+  if (rockchanged && model->surface != 0) {
+    phymodel_updatesurface(model,x,x+1,y,y+1,z,z+1);
+  }
+}
+
+void
+phymodel_setatommat(struct phymodel* model,
+		    unsigned int x,
+		    unsigned int y,
+		    unsigned int z,
+		    enum material mat) {
+  phyatom atom = *phymodel_getatom_readonly(model,x,y,z);
+  phyatom_set_mat(&atom,mat);
+  phymodel_setatom(model,x,y,z,atom);
+}
+
+static void
+phymodel_bitplane_setrange(uint64_t* row,
+			   unsigned int startX,
+			   unsigned int endX,
+			   int set) {
+  unsigned int x = startX;
+  while (x < endX) {
+    unsigned int bit = x & 63;
+    unsigned int n = endX - x < 64 - bit ? endX - x : 64 - bit;
+    uint64_t mask = (n == 64 ? ~((uint64_t)0) : ((((uint64_t)1) << n) - 1)) << bit;
+    if (set) row[x >> 6] |= mask;
+    else row[x >> 6] &= ~mask;
+    x += n;
+  }
+}
+
+static int
+phymodel_brickinbox(struct phymodel* model,
+		    unsigned int x,
+		    unsigned int y,
+		    unsigned int z,
+		    unsigned int startX,
+		    unsigned int endX,
+		    unsigned int startY,
+		    unsigned int endY,
+		    unsigned int startZ,
+		    unsigned int endZ) {
+  
+  /*
+   * Is the part of the brick with (x,y,z) that is within the model
+   * entirely inside the box?
+   */
+  
+  unsigned int brickX = x & ~phymodel_brickmask;
+  unsigned int brickY = y & ~phymodel_brickmask;
+  unsigned int brickZ = z & ~phymodel_brickmask;
+  unsigned int brickEndX = brickX + phymodel_brickedge < model->xSize ? brickX + phymodel_brickedge : model->xSize;
+  unsigned int brickEndY = brickY + phymodel_brickedge < model->ySize ? brickY + phymodel_brickedge : model->ySize;
+  unsigned int brickEndZ = brickZ + phymodel_brickedge < model->zSize ? brickZ + phymodel_brickedge : model->zSize;
+  return(brickX >= startX && brickEndX <= endX &&
+	 brickY >= startY && brickEndY <= endY &&
+	 brickZ >= startZ && brickEndZ <= endZ);
+}
+
+static void
+phymodel_fillbox_slab(struct phymodel* model,
+		      unsigned int startX,
+		      unsigned int endX,
+		      unsigned int startY,
+		      unsigned int endY,
+		      unsigned int startZ,
+		      unsigned int endZ,
+		      unsigned int boxStartZ,
+		      unsigned int boxEndZ,
+		      phyatom value) {
+  
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  
+  if (model->bitplanes != 0) {
+    enum material mat = phyatom_mat(&value);
+    unsigned int plane;
+    for (z = startZ; z < endZ; z++) {
+      for (y = startY; y < endY; y++) {
+	for (plane = 0; plane < phymodel_nbitplanes; plane++) {
+	  phymodel_bitplane_setrange(phymodel_bitplanerow(model,plane,y,z),
+				     startX,endX,
+				     plane == mat);
+	}
+      }
+    }
+  }
+  
+  for (z = startZ; z < endZ; z++) {
+    for (y = startY; y < endY; y++) {
+      for (x = startX; x < endX; ) {
+	unsigned int length;
+	ptrdiff_t stride;
+	phymodel_segment(model,phymodelaxis_x,x,y,z,&length,&stride);
+	if (length > endX - x) length = endX - x;
+	if (model->brickepochs != 0) {
+	  unsigned int brickX;
+	  for (brickX = x & ~phymodel_brickmask; brickX < x + length; brickX += phymodel_brickedge) {
+	    phymodel_markchanged(model,brickX,y,z);
+	  }
+	}
+	if (model->layout == phymodellayout_sparse) {
+	  size_t brick = phymodel_brickindex(model,x,y,z);
+	  if (phymodel_brickinbox(model,x,y,z,startX,endX,startY,endY,boxStartZ,boxEndZ)) {
+	    if (model->sharedbricks != 0 && model->sharedbricks[brick]) {
+	      model->bricks[brick] = 0;
+	      model->sharedbricks[brick] = 0;
+	    } else if (model->bricks[brick] != 0) {
+	      free(model->bricks[brick]);
+	      model->bricks[brick] = 0;
+	      __atomic_sub_fetch(&model->nallocatedbricks,1,__ATOMIC_RELAXED);
+	    }
+	    model->brickvalues[brick] = value;
+	  } else if (model->bricks[brick] != 0 || model->brickvalues[brick] != value) {
+	    memset(phymodel_getatom(model,x,y,z),value,length);
+	  }
+	} else {
+	  memset(&model->atoms[phymodel_atomindex(model,x,y,z)],value,length);
+	}
+	x += length;
+      }
+    }
+  }
+}
+
+struct phymodel_fillbox_job {
+  struct phymodel* model;
+  unsigned int startX;
+  unsigned int endX;
+  unsigned int startY;
+  unsigned int endY;
+  unsigned int startZ;
+  unsigned int endZ;
+  phyatom value;
+};
+
+static void
+phymodel_fillbox_slabjob(unsigned int slab,
+			 void* data) {
+  struct phymodel_fillbox_job* job = (struct phymodel_fillbox_job*)data;
+  unsigned int slabStartZ = (job->startZ & ~phymodel_brickmask) + slab * phymodel_slabdepth;
+  unsigned int slabEndZ = slabStartZ + phymodel_slabdepth;
+  if (slabStartZ < job->startZ) slabStartZ = job->startZ;
+  if (slabEndZ > job->endZ) slabEndZ = job->endZ;
+  phymodel_fillbox_slab(job->model,
+			job->startX,job->endX,
+			job->startY,job->endY,
+			slabStartZ,slabEndZ,
+			job->startZ,job->endZ,
+			job->value);
+}
+
+void
+phymodel_fillbox(struct phymodel* model,
+		 unsigned int startX,
+		 unsigned int endX,
+		 unsigned int startY,
+		 unsigned int endY,
+		 unsigned int startZ,
+		 unsigned int endZ,
+		 phyatom value) {
+  
+  /*
+   * Set all atoms in [start,end) to value, a row segment at a
+   * time. In sparse models, bricks that are entirely inside the box
+   * become uniform without being allocated. Large boxes are filled
+   * one z-slab per thread; the slabs are brick aligned, so no two
+   * threads ever touch the same brick. The list of changed bricks is
+   * shared, though, so models with change epochs are filled on one
+   * thread.
+   */
+  
+  assert(phymodel_isvalid(model));
+  if (endX > model->xSize) endX = model->xSize;
+  if (endY > model->ySize) endY = model->ySize;
+  if (endZ > model->zSize) endZ = model->zSize;
+  if (startX >= endX || startY >= endY || startZ >= endZ) return;
+  
+  if (phymodel_natoms(endX - startX,endY - startY,endZ - startZ) >= phymodel_parallelminatoms &&
+      model->brickepochs == 0) {
+    struct phymodel_fillbox_job job;
+    job.model = model;
+    job.startX = startX;
+    job.endX = endX;
+    job.startY = startY;
+    job.endY = endY;
+    job.startZ = startZ;
+    job.endZ = endZ;
+    job.value = value;
+    parallel_for(phymodel_nslabs(startZ,endZ),phymodel_fillbox_slabjob,&job);
+  } else {
+    phymodel_fillbox_slab(model,startX,endX,startY,endY,startZ,endZ,startZ,endZ,value);
+  }
+  
+  if (model->solidcolumns != 0) {
+    unsigned int x;
+    unsigned int y;
+    for (y = startY; y < endY; y++) {
+      for (x = startX; x < endX; x++) {
+	if (model->solidcolumnsbuilt[phymodel_brickcolumn(model,x,y)]) {
+	  phymodel_bitplane_setrange(phymodel_solidcolumn(model,x,y),
+				     startZ,endZ,
+				     phyatom_mat(&value) != material_air);
+	}
+      }
+    }
+  }
+  if (model->rockbeside != 0) {
+    phymodel_invalidaterockbeside(model,startX,endX,startY,endY,startZ,endZ);
+  }
+  if (model->surface != 0) {
+    phymodel_updatesurface(model,startX,endX,startY,endY,startZ,endZ);
+  }
+}
+
+void
+phymodel_enablebitplanes(struct phymodel* model) {
+
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  
+  assert(phymodel_isvalid(model));
+  if (model->bitplanes != 0) return;
+  
+  /*
+   * The bits past the end of each row are never set, so scans along
+   * a row stop there.
+   */
+  
+  model->bitplanerowwords = phymodel_bitplanerowwords(model->xSize);
+  model->bitplanewords = phymodel_natoms(model->bitplanerowwords,model->ySize,model->zSize);
+  model->bitplanes = (uint64_t*)calloc(phymodel_nbitplanes * model->bitplanewords,sizeof(uint64_t));
+  if (model->bitplanes == 0) {
+    fatalz("cannot allocate bit-planes of bytes",
+	   phymodel_nbitplanes * model->bitplanewords * sizeof(uint64_t));
+    return;
+  }
+  
+  for (z = 0; z < model->zSize; z++) {
+    for (y = 0; y < model->ySize; y++) {
+      uint64_t* air = phymodel_bitplanerow(model,material_air,y,z);
+      uint64_t* rock = phymodel_bitplanerow(model,material_rock,y,z);
+      uint64_t* water = phymodel_bitplanerow(model,material_water,y,z);
+      for (x = 0; x < model->xSize; x++) {
+	const phyatom* atom = (model->layout == phymodellayout_sparse ?
+			       phymodel_getatom_readonly(model,x,y,z) :
+			       &model->atoms[phymodel_atomindex(model,x,y,z)]);
+	uint64_t bit = phymodel_bitplanebit(x);
+	switch (phyatom_mat(atom)) {
+	case material_air: air[x >> 6] |= bit; break;
+	case material_rock: rock[x >> 6] |= bit; break;
+	case material_water: water[x >> 6] |= bit; break;
+	default: break;
+	}
+      }
+    }
+  }
+  debugf("bit-planes enabled, %zu MB",
+	 (phymodel_nbitplanes * model->bitplanewords * sizeof(uint64_t)) / (1024 * 1024));
+}
+
+void
+phymodel_disablebitplanes(struct phymodel* model) {
+  assert(phymodel_isvalid(model));
+  if (model->bitplanes == 0) return;
+  free(model->bitplanes);
+  model->bitplanes = 0;
+  model->bitplanewords = 0;
+  model->bitplanerowwords = 0;
+}
+
+static pthread_mutex_t phymodel_solidcolumns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+phymodel_enablesolidcolumns(struct phymodel* model) {
+
+  size_t ncolumnwords;
+  
+  assert(phymodel_isvalid(model));
+  if (model->solidcolumns != 0) return;
+  
+  /*
+   * The columns are built one brick column at a time, when first
+   * searched. The bits past the bottom of each column are never set,
+   * so scans down a column stop there.
+   */
+  
+  model->solidcolumnwords = phymodel_bitplanerowwords(model->zSize);
+  ncolumnwords = ((size_t)model->xSize) * model->ySize * model->solidcolumnwords;
+  model->solidcolumns = (uint64_t*)calloc(ncolumnwords,sizeof(uint64_t));
+  model->solidcolumnsbuilt = (uint8_t*)calloc(((size_t)model->xBricks) * model->yBricks,sizeof(uint8_t));
+  if (model->solidcolumns == 0 || model->solidcolumnsbuilt == 0) {
+    fatalz("cannot allocate solid columns of bytes", ncolumnwords * sizeof(uint64_t));
+    return;
+  }
+  debugf("solid columns enabled, %zu MB", (ncolumnwords * sizeof(uint64_t)) / (1024 * 1024));
+}
+
+static void
+phymodel_buildsolidcolumns(struct phymodel* model,
+			   size_t brickcolumn) {
+  
+  unsigned int startX = (brickcolumn % model->xBricks) << phymodel_brickshift;
+  unsigned int startY = (brickcolumn / model->xBricks) << phymodel_brickshift;
+  unsigned int endX = startX + phymodel_brickedge < model->xSize ? startX + phymodel_brickedge : model->xSize;
+  unsigned int endY = startY + phymodel_brickedge < model->ySize ? startY + phymodel_brickedge : model->ySize;
+  unsigned int x;
+  unsigned int y;
+  
+  /*
+   * Columns may be searched from several threads while moves are
+   * planned, but they are only changed when no searches are going
+   * on. Built brick columns can then be searched without the lock.
+   */
+  
+  pthread_mutex_lock(&phymodel_solidcolumns_lock);
+  if (model->solidcolumnsbuilt[brickcolumn] == 0) {
+    for (y = startY; y < endY; y++) {
+      for (x = startX; x < endX; x++) {
+	uint64_t* column = phymodel_solidcolumn(model,x,y);
+	unsigned int z = 0;
+	while (z < model->zSize) {
+	  unsigned int length;
+	  ptrdiff_t stride;
+	  const phyatom* atoms = phymodel_segment(model,phymodelaxis_z,x,y,z,&length,&stride);
+	  unsigned int i;
+	  for (i = 0; i < length; i++) {
+	    if (phyatom_mat(&atoms[i * stride]) != material_air) {
+	      column[(z + i) >> 6] |= phymodel_bitplanebit(z + i);
+	    }
+	  }
+	  z += length;
+	}
+      }
+    }
+    __atomic_store_n(&model->solidcolumnsbuilt[brickcolumn],1,__ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&phymodel_solidcolumns_lock);
+}
+
+void
+phymodel_disablesolidcolumns(struct phymodel* model) {
+  assert(phymodel_isvalid(model));
+  if (model->solidcolumns == 0) return;
+  free(model->solidcolumns);
+  free(model->solidcolumnsbuilt);
+  model->solidcolumns = 0;
+  model->solidcolumnsbuilt = 0;
+  model->solidcolumnwords = 0;
+}
+
+static pthread_mutex_t phymodel_rockbeside_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+phymodel_enablerockbeside(struct phymodel* model) {
+  
+  assert(phymodel_isvalid(model));
+  if (model->rockbeside != 0) return;
+  
+  model->rockbeside = (uint16_t*)calloc(model->nbricks * phymodel_rockbesiderows,sizeof(uint16_t));
+  model->rockbesidebuilt = (uint8_t*)calloc(model->nbricks,sizeof(uint8_t));
+  if (model->rockbeside == 0 || model->rockbesidebuilt == 0) {
+    fatalz("cannot allocate rock-beside masks of bytes",
+	   model->nbricks * phymodel_rockbesiderows * sizeof(uint16_t));
+    return;
+  }
+  debugf("rock-beside masks enabled, %zu MB",
+	 (model->nbricks * phymodel_rockbesiderows * sizeof(uint16_t)) / (1024 * 1024));
+}
+
+static uint32_t
+phymodel_rockrow(struct phymodel* model,
+		 unsigned int startX,
+		 unsigned int endX,
+		 int y,
+		 unsigned int z) {
+  
+  uint32_t row = 0;
+  unsigned int x;
+  
+  /*
+   * Bit i is set if the atom at x = startX - 1 + i is rock, for the
+   * atoms from startX - 1 to endX that are in the model
+   */
+  
+  if (y < 0 || (unsigned int)y >= model->ySize) return(0);
+  if (endX < model->xSize) endX++;
+  for (x = (startX > 0 ? startX - 1 : 0); x < endX; x++) {
+    if (phymodel_atommat(model,x,y,z) == material_rock) {
+      row |= ((uint32_t)1) << (x + 1 - startX);
+    }
+  }
+  return(row);
+}
+
+static void
+phymodel_buildrockbeside(struct phymodel* model,
+			 unsigned int x,
+			 unsigned int y,
+			 unsigned int z) {
+  
+  size_t brick = phymodel_brickindex(model,x,y,z);
+  unsigned int startX = x & ~phymodel_brickmask;
+  unsigned int startY = y & ~phymodel_brickmask;
+  unsigned int startZ = z & ~phymodel_brickmask;
+  unsigned int endX = startX + phymodel_brickedge < model->xSize ? startX + phymodel_brickedge : model->xSize;
+  unsigned int endY = startY + phymodel_brickedge < model->ySize ? startY + phymodel_brickedge : model->ySize;
+  unsigned int endZ = startZ + phymodel_brickedge < model->zSize ? startZ + phymodel_brickedge : model->zSize;
+  
+  /*
+   * Like the solid columns, masks may be asked for from several
+   * threads while moves are planned, but are only invalidated when
+   * no one is asking.
+   */
+  
+  pthread_mutex_lock(&phymodel_rockbeside_lock);
+  if (model->rockbesidebuilt[brick] == 0) {
+    unsigned int bz;
+    for (bz = startZ; bz < endZ; bz++) {
+      uint32_t above = phymodel_rockrow(model,startX,endX,(int)startY - 1,bz);
+      uint32_t here = phymodel_rockrow(model,startX,endX,startY,bz);
+      unsigned int by;
+      for (by = startY; by < endY; by++) {
+	uint32_t below = phymodel_rockrow(model,startX,endX,by + 1,bz);
+	uint32_t around = (above | (above << 1) | (above >> 1) |
+			   (here << 1) | (here >> 1) |
+			   below | (below << 1) | (below >> 1));
+	phymodel_rockbesiderow(model,startX,by,bz) = (uint16_t)(around >> 1);
+	above = here;
+	here = below;
+      }
+    }
+    __atomic_store_n(&model->rockbesidebuilt[brick],1,__ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&phymodel_rockbeside_lock);
+}
+
+void
+phymodel_disablerockbeside(struct phymodel* model) {
+  assert(phymodel_isvalid(model));
+  if (model->rockbeside == 0) return;
+  free(model->rockbeside);
+  free(model->rockbesidebuilt);
+  model->rockbeside = 0;
+  model->rockbesidebuilt = 0;
+}
+
+int
+phymodel_hasrockbeside(struct phymodel* model,
+		       unsigned int x,
+		       unsigned int y,
+		       unsigned int z) {
+  
+  size_t brick;
+  
+  /*
+   * Without the masks, look at the atoms around one by one
+   */
+  
+  if (model->rockbeside == 0) {
+    unsigned int startX = x > 0 ? x - 1 : x;
+    unsigned int startY = y > 0 ? y - 1 : y;
+    unsigned int endX = x + 1 < model->xSize ? x + 1 : x;
+    unsigned int endY = y + 1 < model->ySize ? y + 1 : y;
+    unsigned int ax;
+    unsigned int ay;
+    for (ay = startY; ay <= endY; ay++) {
+      for (ax = startX; ax <= endX; ax++) {
+	if ((ax != x || ay != y) && phymodel_atommat(model,ax,ay,z) == material_rock) return(1);
+      }
+    }
+    return(0);
+  }
+  
+  brick = phymodel_brickindex(model,x,y,z);
+  if (__atomic_load_n(&model->rockbesidebuilt[brick],__ATOMIC_ACQUIRE) == 0) {
+    phymodel_buildrockbeside(model,x,y,z);
+  }
+  return((phymodel_rockbesiderow(model,x,y,z) >> (x & phymodel_brickmask)) & 1);
+}
+
+void
+phymodel_enableepochs(struct phymodel* model) {
+  assert(phymodel_isvalid(model));
+  if (model->brickepochs != 0) return;
+  model->brickepochs = (uint32_t*)calloc(model->nbricks,sizeof(uint32_t));
+  if (model->brickepochs == 0) {
+    fatalz("cannot allocate brick epochs of bytes", model->nbricks * sizeof(uint32_t));
+    return;
+  }
+  model->epoch = 1;
+  model->ndirtybricks = 0;
+}
+
+void
+phymodel_disableepochs(struct phymodel* model) {
+  if (model->brickepochs == 0) return;
+  free(model->brickepochs);
+  free(model->dirtybricks);
+  model->brickepochs = 0;
+  model->dirtybricks = 0;
+  model->ndirtybricks = 0;
+  model->maxdirtybricks = 0;
+}
+
+void
+phymodel_nextepoch(struct phymodel* model) {
+  
+  assert(model->brickepochs != 0);
+  
+  /*
+   * When the epoch counter wraps, forget the old epochs so that no
+   * brick seems to have changed in the new epoch
+   */
+  
+  model->epoch++;
+  if (model->epoch == 0) {
+    memset(model->brickepochs,0,model->nbricks * sizeof(uint32_t));
+    model->epoch = 1;
+  }
+  model->ndirtybricks = 0;
+}
+
+void
+phymodel_markbrickchanged(struct phymodel* model,
+			  size_t brick) {
+  assert(brick < model->nbricks);
+  if (model->ndirtybricks == model->maxdirtybricks) {
+    size_t maxdirtybricks = (model->maxdirtybricks == 0) ? 64 : 2 * model->maxdirtybricks;
+    size_t* dirtybricks = (size_t*)realloc(model->dirtybricks,maxdirtybricks * sizeof(size_t));
+    if (dirtybricks == 0) {
+      fatalz("cannot allocate dirty bricks of entries", maxdirtybricks);
+      return;
+    }
+    model->dirtybricks = dirtybricks;
+    model->maxdirtybricks = maxdirtybricks;
+  }
+  model->brickepochs[brick] = model->epoch;
+  model->dirtybricks[model->ndirtybricks++] = brick;
+}
+
+int
+phymodel_boxchanged(struct phymodel* model,
+		    unsigned int startX,
+		    unsigned int endX,
+		    unsigned int startY,
+		    unsigned int endY,
+		    unsigned int startZ,
+		    unsigned int endZ) {
+  
+  /*
+   * Check if any brick overlapping [startX,endX) x [startY,endY) x
+   * [startZ,endZ) has changed in the current epoch. The box may
+   * extend beyond the model.
+   */
+  
+  assert(model->brickepochs != 0);
+  if (model->ndirtybricks == 0) return(0);
+  return(phymodel_boxchangedsince(model,model->epoch,startX,endX,startY,endY,startZ,endZ));
+}
+
+int
+phymodel_boxchangedsince(struct phymodel* model,
+			 uint32_t epoch,
+			 unsigned int startX,
+			 unsigned int endX,
+			 unsigned int startY,
+			 unsigned int endY,
+			 unsigned int startZ,
+			 unsigned int endZ) {
+  
+  unsigned int bx;
+  unsigned int by;
+  unsigned int bz;
+  
+  /*
+   * Check if any brick overlapping the box has changed in the given
+   * epoch or after it. Epochs before the counter last wrapped are
+   * not remembered.
+   */
+  
+  assert(model->brickepochs != 0);
+  if (endX > model->xSize) endX = model->xSize;
+  if (endY > model->ySize) endY = model->ySize;
+  if (endZ > model->zSize) endZ = model->zSize;
+  if (startX >= endX || startY >= endY || startZ >= endZ) return(0);
+  for (bz = startZ >> phymodel_brickshift; bz <= (endZ - 1) >> phymodel_brickshift; bz++) {
+    for (by = startY >> phymodel_brickshift; by <= (endY - 1) >> phymodel_brickshift; by++) {
+      size_t brick = (((size_t)bz) * model->yBricks + by) * model->xBricks;
+      for (bx = startX >> phymodel_brickshift; bx <= (endX - 1) >> phymodel_brickshift; bx++) {
+	if (model->brickepochs[brick + bx] >= epoch) return(1);
+      }
+    }
+  }
+  
+  return(0);
+}
+
+unsigned int
+phymodel_nextsolid(struct phymodel* model,
+		   unsigned int x,
+		   unsigned int y,
+		   unsigned int z,
+		   unsigned int limit) {
+  
+  const uint64_t* column;
+  size_t brickcolumn;
+  
+  /*
+   * Find the first atom at z, z+1, ..., limit-1 that is not air, or
+   * return limit if there is none
+   */
+  
+  if (limit > model->zSize) limit = model->zSize;
+  if (model->solidcolumns == 0) {
+    while (z < limit && phymodel_atomisfree(model,x,y,z)) z++;
+    return(z < limit ? z : limit);
+  }
+  
+  brickcolumn = phymodel_brickcolumn(model,x,y);
+  if (__atomic_load_n(&model->solidcolumnsbuilt[brickcolumn],__ATOMIC_ACQUIRE) == 0) {
+    phymodel_buildsolidcolumns(model,brickcolumn);
+  }
+  column = phymodel_solidcolumn(model,x,y);
+  while (z < limit) {
+    uint64_t word = column[z >> 6] >> (z & 63);
+    if (word != 0) {
+      z += __builtin_ctzll(word);
+      return(z < limit ? z : limit);
+    }
+    z = (z | 63) + 1;
+  }
+  return(limit);
+}
+
+unsigned int
+phymodel_freerun_forward(struct phymodel* model,
+			 unsigned int x,
+			 unsigned int y,
+			 unsigned int z,
+			 unsigned int max) {
+
+  const uint64_t* row;
+  unsigned int n = 0;
+  unsigned int pos = x + 1;
+  
+  /*
+   * Count the free atoms at x+1, x+2, ..., up to max of them
+   */
+  
+  if (model->bitplanes == 0) {
+    while (n < max && pos < model->xSize && phymodel_atomisfree(model,pos,y,z)) {
+      n++;
+      pos++;
+    }
+    return(n);
+  }
+
+  row = phymodel_bitplanerow(model,material_air,y,z);
+  while (n < max && pos < model->xSize) {
+    uint64_t word = ~(row[pos >> 6] >> (pos & 63));
+    unsigned int avail = 64 - (pos & 63);
+    unsigned int ones = word == 0 ? 64 : __builtin_ctzll(word);
+    if (ones > avail) ones = avail;
+    n += ones;
+    pos += ones;
+    if (ones < avail) break;
+  }
+  return(n < max ? n : max);
+}
+
+unsigned int
+phymodel_freerun_backward(struct phymodel* model,
+			  unsigned int x,
+			  unsigned int y,
+			  unsigned int z,
+			  unsigned int max) {
+
+  const uint64_t* row;
+  unsigned int n = 0;
+  unsigned int pos = x;
+  
+  /*
+   * Count the free atoms at x-1, x-2, ..., up to max of them
+   */
+  
+  if (model->bitplanes == 0) {
+    while (n < max && pos > 0 && phymodel_atomisfree(model,pos - 1,y,z)) {
+      n++;
+      pos--;
+    }
+    return(n);
+  }
+
+  row = phymodel_bitplanerow(model,material_air,y,z);
+  while (n < max && pos > 0) {
+    unsigned int p = pos - 1;
+    uint64_t word = ~(row[p >> 6] << (63 - (p & 63)));
+    unsigned int avail = (p & 63) + 1;
+    unsigned int ones = word == 0 ? 64 : __builtin_clzll(word);
+    if (ones > avail) ones = avail;
+    n += ones;
+    pos -= ones;
+    if (ones < avail) break;
+  }
+  return(n < max ? n : max);
+}
+
+int
+phymodel_rangeisfree(struct phymodel* model,
+		     unsigned int startX,
+		     unsigned int endX,
+		     unsigned int y,
+		     unsigned int z) {
+  return(phymodel_boxisfree(model,startX,endX,y,y + 1,z));
+}
+
+int
+phymodel_boxisfree(struct phymodel* model,
+		   unsigned int startX,
+		   unsigned int endX,
+		   unsigned int startY,
+		   unsigned int endY,
+		   unsigned int z) {
+
+  unsigned int x;
+  unsigned int y;
+  
+  /*
+   * Check that all atoms in [startX,endX) x [startY,endY) on plane z
+   * are free
+   */
+  
+  if (startX >= endX) return(1);
+  if (model->bitplanes == 0) {
+    for (y = startY; y < endY; y++) {
+      for (x = startX; x < endX; x++) {
+	if (!phymodel_atomisfree(model,x,y,z)) return(0);
+      }
+    }
+    return(1);
+  }
+  
+  if ((startX >> 6) == ((endX - 1) >> 6)) {
+    
+    /*
+     * The common case of a narrow box, one word per row
+     */
+    
+    unsigned int n = endX - startX;
+    uint64_t mask = (n == 64 ? ~((uint64_t)0) : ((((uint64_t)1) << n) - 1)) << (startX & 63);
+    for (y = startY; y < endY; y++) {
+      if ((phymodel_bitplaneword(model,material_air,startX,y,z) & mask) != mask) return(0);
+    }
+    return(1);
+  }
+  
+  for (y = startY; y < endY; y++) {
+    const uint64_t* row = phymodel_bitplanerow(model,material_air,y,z);
+    x = startX;
+    while (x < endX) {
+      unsigned int bit = x & 63;
+      unsigned int n = endX - x < 64 - bit ? endX - x : 64 - bit;
+      uint64_t mask = (n == 64 ? ~((uint64_t)0) : ((((uint64_t)1) << n) - 1)) << bit;
+      if ((row[x >> 6] & mask) != mask) return(0);
+      x += n;
+    }
+  }
+  return(1);
+}
+
+int
+phymodel_sparse_brickisuniform(struct phymodel* model,
+			       unsigned int bx,
+			       unsigned int by,
+			       unsigned int bz,
+			       const phyatom* atoms) {
+  unsigned int xEnd = phymodel_brickedge;
+  unsigned int yEnd = phymodel_brickedge;
+  unsigned int zEnd = phymodel_brickedge;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  
+  /*
+   * Bricks at the far edges of the model are partial, their padding
+   * atoms do not count.
+   */
+  
+  if ((bx + 1) << phymodel_brickshift > model->xSize) xEnd = model->xSize & phymodel_brickmask;
+  if ((by + 1) << phymodel_brickshift > model->ySize) yEnd = model->ySize & phymodel_brickmask;
+  if ((bz + 1) << phymodel_brickshift > model->zSize) zEnd = model->zSize & phymodel_brickmask;
+  for (z = 0; z < zEnd; z++) {
+    for (y = 0; y < yEnd; y++) {
+      for (x = 0; x < xEnd; x++) {
+	if (atoms[phymodel_inbrickindex(x,y,z)] != atoms[0]) return(0);
+      }
+    }
+  }
+  return(1);
+}
+
+static void
+phymodel_sparse_compactbrick(struct phymodel* model,
+			     unsigned int bx,
+			     unsigned int by,
+			     unsigned int bz) {
+  size_t brick = (((size_t)bz) * model->yBricks + by) * model->xBricks + bx;
+  phyatom* atoms = model->bricks[brick];
+  
+  if (atoms == 0) return;
+  if (model->sharedbricks != 0 && model->sharedbricks[brick]) return;
+  if (!phymodel_sparse_brickisuniform(model,bx,by,bz,atoms)) return;
+  model->brickvalues[brick] = atoms[0];
+  model->bricks[brick] = 0;
+  model->nallocatedbricks--;
+  free(atoms);
+}
+
+void
+phymodel_compact_region(struct phymodel* model,
+			unsigned int startX,
+			unsigned int startY,
+			unsigned int startZ,
+			unsigned int endX,
+			unsigned int endY,
+			unsigned int endZ) {
+
+  unsigned int bx;
+  unsigned int by;
+  unsigned int bz;
+  
+  /*
+   * Release all allocated bricks that overlap the region [start,end)
+   * and have only one kind of atom in them. Only sparse models have
+   * bricks that can be released.
+   */
+  
+  assert(phymodel_isvalid(model));
+  if (model->layout != phymodellayout_sparse) return;
+  if (endX > model->xSize) endX = model->xSize;
+  if (endY > model->ySize) endY = model->ySize;
+  if (endZ > model->zSize) endZ = model->zSize;
+  if (startX >= endX || startY >= endY || startZ >= endZ) return;
+  for (bz = startZ >> phymodel_brickshift; bz <= (endZ - 1) >> phymodel_brickshift; bz++) {
+    for (by = startY >> phymodel_brickshift; by <= (endY - 1) >> phymodel_brickshift; by++) {
+      for (bx = startX >> phymodel_brickshift; bx <= (endX - 1) >> phymodel_brickshift; bx++) {
+	phymodel_sparse_compactbrick(model,bx,by,bz);
+      }
+    }
+  }
+}
+
+void
+phymodel_compact(struct phymodel* model) {
+  assert(phymodel_isvalid(model));
+  if (model->layout != phymodellayout_sparse) return;
+  phymodel_compact_region(model,0,0,0,model->xSize,model->ySize,model->zSize);
+  phymodel_sparse_describe(model);
+}
+
 void
 phymodel_mapatoms(struct phymodel* model,
 		  phyatom_fn fn,
@@ -148,11 +1256,67 @@ phymodel_mapatoms(struct phymodel* model,
     }
   }
 }
+
+struct phymodel_mapatoms_job {
+  struct phymodel* model;
+  phyatom_fn fn;
+  void* data;
+};
+
+static void
+phymodel_mapatoms_slabjob(unsigned int slab,
+			  void* data) {
+  
+  struct phymodel_mapatoms_job* job = (struct phymodel_mapatoms_job*)data;
+  struct phymodel* model = job->model;
+  unsigned int startZ = slab * phymodel_slabdepth;
+  unsigned int endZ = startZ + phymodel_slabdepth;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  
+  if (endZ > model->zSize) endZ = model->zSize;
+  for (z = startZ; z < endZ; z++) {
+    for (y = 0; y < model->ySize; y++) {
+      for (x = 0; x < model->xSize; x++) {
+	(*job->fn)(x,
+		   y,
+		   z,
+		   model,
+		   phymodel_getatom(model,x,y,z),
+		   job->data);
+      }
+    }
+  }
+}
+
+void
+phymodel_mapatoms_parallel(struct phymodel* model,
+			   phyatom_fn fn,
+			   void* data) {
+  
+  struct phymodel_mapatoms_job job;
+  
+  /*
+   * Same as phymodel_mapatoms, but the z-slabs of the model are
+   * visited by several threads at once, in no particular order. The
+   * callback may only change the atom it is given, and may not read
+   * other atoms, and anything it does with data must be thread
+   * safe. Bitplanes are not updated.
+   */
+  
+  assert(phymodel_isvalid(model));
+  assert(fn != 0);
+  job.model = model;
+  job.fn = fn;
+  job.data = data;
+  parallel_for(phymodel_nslabs(0,model->zSize),phymodel_mapatoms_slabjob,&job);
+}
   
 void
 phymodel_mapatoms_atz(struct phymodel* model,
 		      unsigned int z,
-		      phyatom_fn fn,
+		      phyatom_readfn fn,
 		      void* data) {
   
   unsigned int x;
@@ -163,14 +1327,18 @@ phymodel_mapatoms_atz(struct phymodel* model,
   assert(fn != 0);
   assert(z < model->zSize);
   for (y = 0; y < model->ySize; y++) {
-    for (x = 0; x < model->xSize; x++) {
-      phyatom* atom = phymodel_getatom(model,x,y,z);
-      (*fn)(x,
-	    y,
-	    z,
-	    model,
-	    atom,
-	    data);
+    for (x = 0; x < model->xSize; ) {
+      unsigned int length;
+      ptrdiff_t stride;
+      const phyatom* atom = phymodel_segment(model,phymodelaxis_x,x,y,z,&length,&stride);
+      for (; length > 0; length--, x++, atom += stride) {
+	(*fn)(x,
+	      y,
+	      z,
+	      model,
+	      atom,
+	      data);
+      }
     }
   }
 }
@@ -178,7 +1346,7 @@ phymodel_mapatoms_atz(struct phymodel* model,
 void
 phymodel_mapatoms_atx(struct phymodel* model,
 		      unsigned int x,
-		      phyatom_fn fn,
+		      phyatom_readfn fn,
 		      void* data) {
   
   unsigned int z;
@@ -189,14 +1357,18 @@ phymodel_mapatoms_atx(struct phymodel* model,
   assert(fn != 0);
   assert(x < model->xSize);
   for (y = 0; y < model->ySize; y++) {
-    for (z = 0; z < model->zSize; z++) {
-      phyatom* atom = phymodel_getatom(model,x,y,z);
-      (*fn)(x,
-	    y,
-	    z,
-	    model,
-	    atom,
-	    data);
+    for (z = 0; z < model->zSize; ) {
+      unsigned int length;
+      ptrdiff_t stride;
+      const phyatom* atom = phymodel_segment(model,phymodelaxis_z,x,y,z,&length,&stride);
+      for (; length > 0; length--, z++, atom += stride) {
+	(*fn)(x,
+	      y,
+	      z,
+	      model,
+	      atom,
+	      data);
+      }
     }
   }
 }
@@ -204,7 +1376,7 @@ phymodel_mapatoms_atx(struct phymodel* model,
 void
 phymodel_mapatoms_aty(struct phymodel* model,
 		      unsigned int y,
-		      phyatom_fn fn,
+		      phyatom_readfn fn,
 		      void* data) {
   
   unsigned int z;
@@ -215,14 +1387,18 @@ phymodel_mapatoms_aty(struct phymodel* model,
   assert(fn != 0);
   assert(y < model->ySize);
   for (x = 0; x < model->xSize; x++) {
-    for (z = 0; z < model->zSize; z++) {
-      phyatom* atom = phymodel_getatom(model,x,y,z);
-      (*fn)(x,
-	    y,
-	    z,
-	    model,
-	    atom,
-	    data);
+    for (z = 0; z < model->zSize; ) {
+      unsigned int length;
+      ptrdiff_t stride;
+      const phyatom* atom = phymodel_segment(model,phymodelaxis_z,x,y,z,&length,&stride);
+      for (; length > 0; length--, z++, atom += stride) {
+	(*fn)(x,
+	      y,
+	      z,
+	      model,
+	      atom,
+	      data);
+      }
     }
   }
 }
@@ -230,127 +1406,556 @@ phymodel_mapatoms_aty(struct phymodel* model,
 void
 phymodel_destroy(struct phymodel* model) {
   assert(phymodel_isvalid(model));
+  phymodel_disablesurface(model);
   model->magic = 0;
+  switch (model->storage) {
+  case phymodelstorage_allocated:
+    if (model->layout == phymodellayout_sparse) {
+      size_t brick;
+      for (brick = 0; brick < model->nbricks; brick++) {
+	if (model->sharedbricks != 0 && model->sharedbricks[brick]) continue;
+	if (model->bricks[brick] != 0) free(model->bricks[brick]);
+      }
+      free(model->bricks);
+      free(model->brickvalues);
+      free(model->sharedbricks);
+    } else {
+      free(model->atoms);
+    }
+    break;
+  case phymodelstorage_mapped:
+    if (munmap(model->mapping,model->mappingSize) != 0) {
+      fatals("failed to unmap model file",model->filename);
+    }
+    free(model->filename);
+    break;
+  default:
+    fatal("unrecognised model storage");
+  }
+  if (model->bitplanes != 0) free(model->bitplanes);
+  if (model->solidcolumns != 0) free(model->solidcolumns);
+  if (model->solidcolumnsbuilt != 0) free(model->solidcolumnsbuilt);
+  if (model->rockbeside != 0) free(model->rockbeside);
+  if (model->rockbesidebuilt != 0) free(model->rockbesidebuilt);
+  phymodel_disableepochs(model);
   free(model);
 }
 
-struct phymodel*
-phymodel_read(const char* filename) {
-
-  struct phymodel* model = 0;
-  unsigned int sz = 0;
-  size_t ret = 0;
+static enum phymodellayout
+phymodel_checkheader(const struct phymodelheader* header,
+		     size_t sz,
+		     const char* filename) {
+  
+  enum phymodellayout layout;
   
   /*
-   * Open file
+   * Check magic number, it tells the layout
    */
   
-  FILE* f = fopen(filename,"r");
-  if (f == 0) {
-    fatals("failed to open file", filename);
-    return(0);
+  switch (header->magic) {
+  case PHYMODEL_MAGIC:
+    layout = phymodellayout_linear;
+    break;
+  case PHYMODEL_MAGIC_BRICKED:
+    layout = phymodellayout_bricked;
+    break;
+  default:
+    fatalxx("file does not contain right magic number for a model",header->magic,PHYMODEL_MAGIC);
+    return(phymodellayout_linear);
   }
 
   /*
-   * Determine size
+   * Check dimensions
    */
   
-  fseek(f, 0L, SEEK_END);
-  sz = ftell(f);
-  fseek(f, 0L, SEEK_SET);
+  size_t expectedSz = phymodel_sizeinbytes(layout,
+					   header->xSize,
+					   header->ySize,
+					   header->zSize);
+  debugf("size %ux%ux%u, expecting %zu bytes got %zu bytes",
+	 header->xSize,
+	 header->ySize,
+	 header->zSize,
+	 expectedSz,
+	 sz);
+  if (expectedSz != sz) {
+    fatalzz("file size and given dimensions do not match",sz,expectedSz);
+    return(layout);
+  }
+
+  return(layout);
+}
 
+static void*
+phymodel_mapfile(const char* filename,
+		 enum phymodelaccess access,
+		 size_t* size) {
+  
+  struct stat st;
+  int prot = 0;
+  int flags = 0;
+  int fd;
+  void* mapping;
+  
   /*
-   * Check size
+   * Open file and determine size
    */
-
-  if (sz < sizeof(struct phymodel)) {
-    fclose(f);
-    fatalsu("file is too short to be a model", filename, sz);
+  
+  fd = open(filename,access == phymodelaccess_shared ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    fatals("failed to open file", filename);
     return(0);
   }
   
-  /*
-   * Allocate model
-   */
+  if (fstat(fd,&st) != 0) {
+    close(fd);
+    fatals("failed to determine file size", filename);
+    return(0);
+  }
+
+  if (st.st_size < sizeof(struct phymodelheader)) {
+    close(fd);
+    fatalsz("file is too short to be a model", filename, st.st_size);
+    return(0);
+  }
   
-  model = (struct phymodel*)malloc(sz);
-  if (model == 0) {
-    fclose(f);
-    fatalsu("cannot allocate memory for file contents", filename, sz);
+  if ((off_t)(size_t)st.st_size != st.st_size) {
+    close(fd);
+    fatals("file is too large to be mapped on this system", filename);
     return(0);
   }
   
   /*
-   * Read model
+   * Map the file. Only the pages that are actually touched will be
+   * read from the disk.
    */
   
-  ret = fread(model,sz,1,f);
+  switch (access) {
+  case phymodelaccess_readonly:
+    prot = PROT_READ;
+    flags = MAP_SHARED;
+    break;
+  case phymodelaccess_private:
+    prot = PROT_READ | PROT_WRITE;
+    flags = MAP_PRIVATE;
+    break;
+  case phymodelaccess_shared:
+    prot = PROT_READ | PROT_WRITE;
+    flags = MAP_SHARED;
+    break;
+  default:
+    close(fd);
+    fatal("unrecognised model access mode");
+    return(0);
+  }
   
-  if (ret != 1) {
-    fclose(f);
-    fatalsu("unable to read file contents and bytes", filename, sz);
+  mapping = mmap(0,st.st_size,prot,flags,fd,0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fatalsz("cannot map file contents and bytes", filename, st.st_size);
     return(0);
   }
+  
+  *size = st.st_size;
+  return(mapping);
+}
+
+static struct phymodel*
+phymodel_read_mapped(void* mapping,
+		     size_t size,
+		     const char* filename,
+		     enum phymodelaccess access) {
 
+  struct phymodel* model = 0;
+  enum phymodellayout layout;
+  
   /*
    * Sanity checks
    */
   
-  if (model->magic != PHYMODEL_MAGIC) {
-    fclose(f);
-    fatalxx("file does not contain right magic number for a model",model->magic,PHYMODEL_MAGIC);
+  layout = phymodel_checkheader((const struct phymodelheader*)mapping,size,filename);
+  
+  /*
+   * Allocate model
+   */
+  
+  model = (struct phymodel*)malloc(sizeof(struct phymodel));
+  if (model == 0) {
+    munmap(mapping,size);
+    fatalsz("cannot allocate memory for model", filename, sizeof(struct phymodel));
     return(0);
   }
+  memset(model,0,sizeof(*model));
   
-  size_t expectedSz = phymodel_sizeinbytes(model->xSize,
-					   model->ySize,
-					   model->zSize);
-  debugf("size %ux%ux%u, expecting %u bytes got %u bytes",
-	 model->xSize,
-	 model->ySize,
-	 model->zSize,
-	 sz,
-	 expectedSz);
-  if (expectedSz != sz) {
-    fclose(f);
-    fatalxx("file size and given dimensions do not match",sz,expectedSz);
+  model->filename = strdup(filename);
+  if (model->filename == 0) {
+    munmap(mapping,size);
+    fatals("cannot allocate memory for file name", filename);
     return(0);
   }
   
+  model->magic = PHYMODEL_MAGIC;
+  phymodel_setdimensions(model,
+			 layout,
+			 ((const struct phymodelheader*)mapping)->unit,
+			 ((const struct phymodelheader*)mapping)->xSize,
+			 ((const struct phymodelheader*)mapping)->ySize,
+			 ((const struct phymodelheader*)mapping)->zSize);
+  model->atoms = ((phyatom*)mapping) + sizeof(struct phymodelheader);
+  model->storage = phymodelstorage_mapped;
+  model->access = access;
+  model->format = phymodelformat_raw;
+  model->mapping = mapping;
+  model->mappingSize = size;
+  
   /*
-   * Cleanup and return
+   * Done
    */
   
-  fclose(f);
   assert(phymodel_isvalid(model));
   return(model);
 }
 
+static int
+phymodel_ischunked(const void* mapping,
+		   size_t size) {
+  return(size >= sizeof(struct phymodelchunkedheader) &&
+	 ((const struct phymodelchunkedheader*)mapping)->magic == PHYMODEL_MAGIC_CHUNKED);
+}
+
+struct phymodel*
+phymodel_read_region(const char* filename,
+		     enum phymodelaccess access,
+		     unsigned int startZ,
+		     unsigned int endZ) {
+  
+  struct phymodel* model;
+  size_t size;
+  void* mapping = phymodel_mapfile(filename,access,&size);
+  
+  /*
+   * Raw model files are used directly from the mapping. Compressed
+   * ones are decoded into memory, and then the mapping is no longer
+   * needed.
+   */
+  
+  if (!phymodel_ischunked(mapping,size)) {
+    return(phymodel_read_mapped(mapping,size,filename,access));
+  }
+  model = phymodel_chunked_decode((const unsigned char*)mapping,size,filename,0,startZ,endZ);
+  munmap(mapping,size);
+  return(model);
+}
+
+struct phymodel*
+phymodel_read(const char* filename,
+	      enum phymodelaccess access) {
+  return(phymodel_read_region(filename,access,0,UINT_MAX));
+}
+
+struct phymodel*
+phymodel_read_sparse(const char* filename) {
+  
+  struct phymodel* model;
+  struct phymodel* newmodel;
+  size_t size;
+  void* mapping = phymodel_mapfile(filename,phymodelaccess_readonly,&size);
+
+  /*
+   * Compressed files are decoded directly into bricks, so that the
+   * full model never needs to be in memory.
+   */
+  
+  if (phymodel_ischunked(mapping,size)) {
+    model = phymodel_chunked_decode((const unsigned char*)mapping,size,filename,1,0,UINT_MAX);
+    munmap(mapping,size);
+    return(model);
+  }
+  
+  model = phymodel_read_mapped(mapping,size,filename,phymodelaccess_readonly);
+  newmodel = phymodel_relayout(model,phymodellayout_sparse);
+  phymodel_destroy(model);
+  return(newmodel);
+}
+
+struct phymodel*
+phymodel_overlay(const struct phymodel* base) {
+  
+  struct phymodel* model;
+  size_t brick;
+  
+  /*
+   * The overlay starts with the bricks of the base. In a bricked base
+   * each brick is a contiguous run of atoms that can be shared as
+   * such.
+   */
+  
+  assert(phymodel_isvalid(base));
+  if (base->layout == phymodellayout_linear) {
+    fatal("cannot make an overlay on a model with the linear layout");
+    return(0);
+  }
+  model = phymodel_create(phymodellayout_sparse,base->unit,base->xSize,base->ySize,base->zSize);
+  model->format = base->format;
+  model->sharedbricks = (uint8_t*)calloc(model->nbricks,sizeof(uint8_t));
+  if (model->sharedbricks == 0) {
+    fatalz("cannot allocate shared brick flags for bricks",model->nbricks);
+    return(0);
+  }
+  for (brick = 0; brick < model->nbricks; brick++) {
+    if (base->layout == phymodellayout_bricked) {
+      model->bricks[brick] = &base->atoms[brick << phymodel_brickatomshift];
+    } else {
+      model->bricks[brick] = base->bricks[brick];
+      model->brickvalues[brick] = base->brickvalues[brick];
+    }
+    model->sharedbricks[brick] = (model->bricks[brick] != 0);
+  }
+  
+  return(model);
+}
+
 void
-phymodel_write(struct phymodel* model,
-	       const char* filename) {
-  FILE* f = fopen(filename,"w");
-  unsigned int size;
+phymodel_sync(struct phymodel* model) {
+  assert(phymodel_isvalid(model));
+  assert(model->storage == phymodelstorage_mapped);
+  assert(model->access == phymodelaccess_shared);
+  if (msync(model->mapping,model->mappingSize,MS_SYNC) != 0) {
+    fatals("failed to write model changes to file",model->filename);
+  }
+}
+
+static size_t
+phymodel_write_sparsebricks(struct phymodel* model,
+			    FILE* f) {
+
+  phyatom uniform[phymodel_brickatoms];
+  size_t brick;
+  
+  /*
+   * A sparse model is written as a bricked file, brick by brick, with
+   * uniform bricks expanded on the fly.
+   */
+  
+  for (brick = 0; brick < model->nbricks; brick++) {
+    const phyatom* atoms = model->bricks[brick];
+    if (atoms == 0) {
+      memset(uniform,model->brickvalues[brick],sizeof(uniform));
+      atoms = uniform;
+    }
+    if (fwrite(atoms,sizeof(uniform),1,f) != 1) return(0);
+  }
+  return(1);
+}
+
+static void
+phymodel_write_raw(struct phymodel* model,
+		   FILE* f,
+		   const char* filename) {
+  struct phymodelheader header;
+  const unsigned char padding[phymodel_filepadding] = { 0 };
+  size_t size;
   size_t ret;
   
-  assert(phymodel_isvalid(model));
-  if (f == 0) {
-    fatals("failed to open file", filename);
+  memset(&header,0,sizeof(header));
+  header.magic = phymodel_layoutmagic(model->layout);
+  header.unit = model->unit;
+  header.xSize = model->xSize;
+  header.ySize = model->ySize;
+  header.zSize = model->zSize;
+  size = model->natoms * sizeof(phyatom);
+  
+  if (fwrite(&header,sizeof(header),1,f) != 1) {
+    fatals("failed to write model header to file", filename);
     return;
   }
-  
-  size = phymodel_sizeinbytes(model->xSize,
-			      model->ySize,
-			      model->zSize);
-  ret = fwrite(model,size,1,f);
+  if (model->layout == phymodellayout_sparse) {
+    ret = phymodel_write_sparsebricks(model,f);
+  } else {
+    ret = fwrite(model->atoms,size,1,f);
+  }
   if (ret != 1) {
-    fatalsu("failed to write all model bytes to file",
+    fatalsz("failed to write all model bytes to file",
 	    filename,
 	    size);
-    fclose(f);
     return;
   }
-  fclose(f);
+  if (fwrite(padding,sizeof(padding),1,f) != 1) {
+    fatals("failed to write model padding to file", filename);
+    return;
+  }
+}
+
+static void
+phymodel_write_file(struct phymodel* model,
+		    FILE* f,
+		    const char* filename) {
+  switch (model->format) {
+  case phymodelformat_raw:
+    phymodel_write_raw(model,f,filename);
+    break;
+  case phymodelformat_compressed:
+    phymodel_chunked_write(model,f,filename);
+    break;
+  default:
+    fatal("unrecognised model format");
+  }
+  if (fclose(f) != 0) {
+    fatals("failed to write model file", filename);
+  }
+}
+
+void
+phymodel_write(struct phymodel* model,
+	       const char* filename) {
+  FILE* f;
+  char* target;
+  char* tmpfilename;
+  struct stat st;
+  mode_t mode;
+  int fd;
+  
+  assert(phymodel_isvalid(model));
+  
+  /*
+   * If the model is a writable mapping of the same file, there is no
+   * need to rewrite the file, just flush the changed pages.
+   */
+
+  if (model->storage == phymodelstorage_mapped &&
+      model->access == phymodelaccess_shared &&
+      model->format == phymodelformat_raw &&
+      samefile(model->filename,filename)) {
+    debugf("syncing mapped model to %s", filename);
+    phymodel_sync(model);
+    return;
+  }
+  
+  /*
+   * Write to the file that the name leads to, through any symbolic
+   * links, rather than replacing the links
+   */
+  
+  target = realpath(filename,0);
+  if (target == 0) {
+    if (lstat(filename,&st) == 0) {
+      fatals("cannot find the file that output file leads to", filename);
+      return;
+    }
+    target = strdup(filename);
+    if (target == 0) {
+      fatals("cannot allocate memory for file name", filename);
+      return;
+    }
+  }
+  
+  /*
+   * A file with several hard links is written in place, so that all
+   * its names see the new model. That would truncate it under a
+   * mapping, so it cannot be the file the model is mapped from.
+   */
+  
+  if (stat(target,&st) == 0 && st.st_nlink > 1) {
+    if (model->storage == phymodelstorage_mapped && samefile(model->filename,target)) {
+      fatals("cannot write a model over the hard-linked file it is mapped from", filename);
+      return;
+    }
+    f = fopen(target,"w");
+    if (f == 0) {
+      fatals("failed to open file", target);
+      return;
+    }
+    phymodel_write_file(model,f,target);
+    free(target);
+    return;
+  }
+
+  /*
+   * Otherwise, write a new file next to the old one and then replace
+   * the old one with it. The file may be mapped, by this model or
+   * another, under any name, and must not be truncated under it.
+   * The new file gets the permissions of the old one, or those of a
+   * newly created file.
+   */
+  
+  tmpfilename = (char*)malloc(strlen(target) + 8);
+  if (tmpfilename == 0) {
+    fatals("cannot allocate memory for file name", target);
+    return;
+  }
+  strcpy(tmpfilename,target);
+  strcat(tmpfilename,".XXXXXX");
+  fd = mkstemp(tmpfilename);
+  if (fd < 0) {
+    fatals("failed to create file", tmpfilename);
+    return;
+  }
+  if (stat(target,&st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode = umask(0);
+    umask(mode);
+    mode = 0666 & ~mode;
+  }
+  if (fchmod(fd,mode) != 0) {
+    unlink(tmpfilename);
+    fatals("failed to set the permissions of file", tmpfilename);
+    return;
+  }
+  f = fdopen(fd,"w");
+  if (f == 0) {
+    unlink(tmpfilename);
+    fatals("failed to open file", tmpfilename);
+    return;
+  }
+  phymodel_write_file(model,f,tmpfilename);
+  if (rename(tmpfilename,target) != 0) {
+    unlink(tmpfilename);
+    fatals("failed to replace model file", target);
+    return;
+  }
+  free(tmpfilename);
+  free(target);
+}
+
+struct phymodel*
+phymodel_relayout(struct phymodel* model,
+		  enum phymodellayout layout) {
+
+  struct phymodel* newmodel;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  
+  assert(phymodel_isvalid(model));
+  newmodel = phymodel_create(layout,
+			     model->unit,
+			     model->xSize,
+			     model->ySize,
+			     model->zSize);
+  for (z = 0; z < model->zSize; z++) {
+    for (y = 0; y < model->ySize; y++) {
+      for (x = 0; x < model->xSize; x++) {
+	phymodel_setatom(newmodel,x,y,z,*phymodel_getatom_readonly(model,x,y,z));
+      }
+    }
+    
+    /*
+     * Release uniform bricks as soon as a layer of bricks is
+     * complete, so that a sparse copy never needs to hold the full
+     * model in memory.
+     */
+    
+    if (((z + 1) & phymodel_brickmask) == 0 || z + 1 == model->zSize) {
+      phymodel_compact_region(newmodel,
+			      0,0,z & ~phymodel_brickmask,
+			      model->xSize,model->ySize,z + 1);
+    }
+  }
+  
+  if (layout == phymodellayout_sparse) phymodel_sparse_describe(newmodel);
+  
+  return(newmodel);
 }
 
 double
@@ -406,6 +2011,91 @@ phymodel_distance3d(unsigned int x1,
   return(c);
 }
 
+#define phymodel_maxshells	65536
+
+static struct phymodelshell* phymodel_shells[phymodel_maxshells];
+static pthread_mutex_t phymodel_shells_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct phymodelshell*
+phymodel_shell_build(unsigned int distance) {
+  
+  struct phymodelshell* shell = (struct phymodelshell*)malloc(sizeof(struct phymodelshell));
+  int d = (int)distance;
+  int pass;
+  int x;
+  int y;
+  int z;
+
+  /*
+   * Go through the cube around the shell twice, first counting and
+   * then storing the offsets. The distance is calculated exactly as
+   * phymodel_distance3d() does it, so that the shells are the same
+   * as when scanning the cube around each point.
+   */
+  
+  if (shell == 0) {
+    fatalu("cannot allocate shell at distance", distance);
+    return(0);
+  }
+  shell->distance = distance;
+  shell->noffsets = 0;
+  shell->offsets = 0;
+  for (pass = 0; pass < 2; pass++) {
+    size_t n = 0;
+    for (x = -d; x <= d; x++) {
+      for (y = -d; y <= d; y++) {
+	for (z = -d; z <= d; z++) {
+	  double distancefloat = phymodel_distance3d(abs(x),abs(y),abs(z),0,0,0);
+	  if ((unsigned int)floor(distancefloat) != distance) continue;
+	  if (pass == 1) {
+	    shell->offsets[n].x = x;
+	    shell->offsets[n].y = y;
+	    shell->offsets[n].z = z;
+	  }
+	  n++;
+	}
+      }
+    }
+    if (pass == 0) {
+      shell->noffsets = n;
+      shell->offsets = (struct phymodeloffset*)malloc(n * sizeof(struct phymodeloffset));
+      if (shell->offsets == 0) {
+	fatalu("cannot allocate shell offsets at distance", distance);
+	return(0);
+      }
+    }
+  }
+  
+  deepdebugf("shell at distance %u has %zu atoms", distance, shell->noffsets);
+  return(shell);
+}
+
+const struct phymodelshell*
+phymodel_shell(unsigned int distance) {
+  
+  struct phymodelshell* shell;
+
+  /*
+   * Shells are never changed or freed once built, so they can be
+   * looked up without the lock.
+   */
+  
+  if (distance >= phymodel_maxshells) {
+    fatalu("shell distance is too large", distance);
+    return(0);
+  }
+  shell = __atomic_load_n(&phymodel_shells[distance],__ATOMIC_ACQUIRE);
+  if (shell != 0) return(shell);
+  pthread_mutex_lock(&phymodel_shells_lock);
+  shell = phymodel_shells[distance];
+  if (shell == 0) {
+    shell = phymodel_shell_build(distance);
+    __atomic_store_n(&phymodel_shells[distance],shell,__ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&phymodel_shells_lock);
+  return(shell);
+}
+
 void
 phymodel_mapatoms_atdistance2dx(struct phymodel* model,
 				unsigned int x,
@@ -522,38 +2212,25 @@ phymodel_mapatoms_atdistance3d(struct phymodel* model,
 			       unsigned int distance,
 			       phyatom_fn fn,
 			       void* data) {
-  unsigned int x;
+  const struct phymodelshell* shell = phymodel_shell(distance);
+  size_t i;
   
   assert(phymodel_isvalid(model));
 
-  for (x = origox > distance ? origox - distance : 0;
-       x < model->xSize && x <= origox + distance;
-       x++) {
+  for (i = 0; i < shell->noffsets; i++) {
     
-    unsigned int y;
+    const struct phymodeloffset* offset = &shell->offsets[i];
+    long x = (long)origox + offset->x;
+    long y = (long)origoy + offset->y;
+    long z = (long)origoz + offset->z;
     
-    for (y = origoy > distance ? origoy - distance : 0;
-	 y < model->ySize && y <= origoy + distance;
-	 y++) {
-
-      unsigned int z;
-      
-      for (z = origoz > distance ? origoz - distance : 0;
-	   z < model->zSize && z <= origoz + distance;
-	   z++) {
-	
-	double xyzdistancefloat = phymodel_distance3d(x,y,z,origox,origoy,origoz);
-	unsigned int xyzdistance = (unsigned int)floor(xyzdistancefloat);
-	/* debugf("(%u,%u,%u) to (%u,%u,%u) distance is %.2f (%u)",
-	   x,y,z,origox,origoy,origoz,xyzdistancefloat,xyzdistance); */
-	if (xyzdistance == distance) {
-	  phyatom* atom = phymodel_getatom(model,x,y,z);
-	  (*fn)(x,y,z,model,atom,data);
-	}
-	
-      }
-      
-    }
+    if (x < 0 || x >= model->xSize ||
+	y < 0 || y >= model->ySize ||
+	z < 0 || z >= model->zSize) continue;
+    (*fn)((unsigned int)x,(unsigned int)y,(unsigned int)z,
+	  model,
+	  phymodel_getatom(model,(unsigned int)x,(unsigned int)y,(unsigned int)z),
+	  data);
     
   }
 }
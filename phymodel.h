@@ -26,7 +26,14 @@
 #ifndef PHYMODEL_H
 #define PHYMODEL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+
 #define PHYMODEL_MAGIC		0xCA5EF058
+#define PHYMODEL_MAGIC_BRICKED	0xCA5EF0B1
+#define PHYMODEL_MAGIC_CHUNKED	0xCA5EF0C7
 
 enum material {
   material_air   = 0,
@@ -80,22 +87,311 @@ typedef unsigned char phyatom;
  *
  */
 
+/*
+ * A model file consists of a header, followed directly by the atoms,
+ * followed by a few bytes of padding. (The padding is there because
+ * the files used to be plain dumps of a struct that ended with a
+ * one-element atom array.)
+ */
+
+struct phymodelheader {
+  unsigned int magic;
+  unsigned int unit;
+  unsigned int xSize;
+  unsigned int ySize;
+  unsigned int zSize;
+};
+
+#define phymodel_filepadding		3
+
+/*
+ * A compressed model file consists of a header, followed by an index
+ * of chunks, followed by the chunks. Each chunk holds the atoms of
+ * phymodel_chunkdepth planes in the z direction, in the layout given
+ * in the header, and is compressed independently of the others. In
+ * both layouts the atoms of a chunk are contiguous, and in the
+ * bricked layout a chunk is exactly one layer of bricks. The chunk
+ * index gives the file offset and compressed size of each chunk, so
+ * chunks can be decoded in parallel, or only some of them.
+ */
+
+#define PHYMODEL_CHUNKED_VERSION	1
+#define phymodel_chunkdepth		phymodel_brickedge
+
+enum phymodelcodec {
+  phymodelcodec_rle = 1           /* see rle.h */
+};
+
+struct phymodelchunkedheader {
+  unsigned int magic;             /* PHYMODEL_MAGIC_CHUNKED */
+  unsigned int unit;
+  unsigned int xSize;
+  unsigned int ySize;
+  unsigned int zSize;
+  unsigned int version;           /* PHYMODEL_CHUNKED_VERSION */
+  unsigned int layout;            /* linear or bricked */
+  unsigned int chunkDepth;        /* in number of z planes */
+  unsigned int nChunks;
+  unsigned int codec;             /* enum phymodelcodec */
+};
+
+struct phymodelchunkentry {
+  uint64_t offset;                /* from the start of the file */
+  uint64_t size;                  /* compressed size in bytes */
+};
+
+/*
+ * How the atoms are ordered in the atoms array. The linear layout is
+ * x-fastest, then y, then z. The bricked layout stores the model as
+ * cubic bricks of phymodel_brickedge^3 atoms, ordered x-fastest,
+ * then y, then z, and the atoms inside a brick are again in x-fastest
+ * order. A step in any direction then usually stays within the same
+ * 4 KB brick, rather than jumping a whole plane in the z direction.
+ * In the bricked layout the model is padded to full bricks.
+ *
+ * The sparse layout is an in-memory variant of the bricked layout,
+ * where each brick is allocated separately, and bricks where all
+ * atoms are the same are not allocated at all. Instead, only the one
+ * atom value is stored for them. Such bricks are allocated when an
+ * atom in them is accessed through phymodel_getatom(), and
+ * phymodel_compact() releases bricks that have become uniform again.
+ * When written to a file, a sparse model becomes a bricked model.
+ *
+ * A sparse model can also be an overlay on a base model: it starts
+ * with the bricks of the base, shared and not copied, and a shared
+ * brick is copied the first time it is written to through
+ * phymodel_getatom(). The base must not change or be destroyed while
+ * it has overlays.
+ */
+
+enum phymodellayout {
+  phymodellayout_linear = 0,
+  phymodellayout_bricked = 1,
+  phymodellayout_sparse = 2
+};
+
+#define phymodel_brickshift		4
+#define phymodel_brickedge		(1 << phymodel_brickshift)
+#define phymodel_brickmask		(phymodel_brickedge - 1)
+#define phymodel_brickatomshift		(3 * phymodel_brickshift)
+#define phymodel_brickatoms		(1 << phymodel_brickatomshift)
+#define phymodel_nbricks(n)		(((n) + phymodel_brickmask) >> phymodel_brickshift)
+
+/*
+ * Bulk operations over large parts of a model are split across
+ * threads in slabs of phymodel_slabdepth planes in the z
+ * direction. Slabs are aligned to layers of bricks, so in the bricked
+ * and sparse layouts no brick is ever shared between two slabs.
+ */
+
+#define phymodel_slabdepth		phymodel_brickedge
+#define phymodel_nslabs(startZ,endZ)	((((endZ) - 1) >> phymodel_brickshift) - ((startZ) >> phymodel_brickshift) + 1)
+#define phymodel_parallelminatoms	(1 << 22)
+
+/*
+ * How the atoms of an in-memory model are stored
+ */
+
+enum phymodelstorage {
+  phymodelstorage_allocated,      /* atoms are in malloc'ed memory */
+  phymodelstorage_mapped          /* atoms are in a memory-mapped model file */
+};
+
+/*
+ * How a model is written to a file
+ */
+
+enum phymodelformat {
+  phymodelformat_raw,             /* header followed by the atoms as such */
+  phymodelformat_compressed       /* chunked and compressed */
+};
+
+/*
+ * How a model file is opened
+ */
+
+enum phymodelaccess {
+  phymodelaccess_readonly,        /* map the file read-only, e.g., for --image */
+  phymodelaccess_private,         /* map copy-on-write, changes stay in memory */
+  phymodelaccess_shared           /* map writable, changes go to the file */
+};
+
+/*
+ * A model may optionally have material bit-planes, one for air, rock
+ * and water. Each has one bit per atom, in x-fastest rows of 64-bit
+ * words, so that free space in x direction can be scanned 64 atoms at
+ * a time. The bit-planes are only kept up to date when materials are
+ * changed through phymodel_setatom() or phymodel_setatommat(), not
+ * when they are changed through a pointer from phymodel_getatom().
+ */
+
+#define phymodel_nbitplanes		3
+#define phymodel_bitplanerowwords(x)	(((x) + 63) >> 6)
+#define phymodel_bitplanebit(x)		(((uint64_t)1) << ((x) & 63))
+#define phymodel_bitplanerow(m,mat,y,z)	(&(m)->bitplanes[((size_t)(mat)) * (m)->bitplanewords + \
+						 (((size_t)(z)) * (m)->ySize + (y)) * (m)->bitplanerowwords])
+#define phymodel_bitplaneword(m,mat,x,y,z) (phymodel_bitplanerow((m),(mat),(y),(z))[(x) >> 6])
+
+/*
+ * A model may also keep a solid column for each (x,y), with one bit
+ * per z that is set when the atom is not air, so that the next solid
+ * atom below a point is found 64 atoms at a time. The columns of a
+ * 16x16 brick column are built when first searched. Like the
+ * bit-planes, they follow changes made through phymodel_setatom(),
+ * phymodel_setatommat() and phymodel_fillbox().
+ */
+
+#define phymodel_solidcolumn(m,x,y)	(&(m)->solidcolumns[(((size_t)(y)) * (m)->xSize + (x)) * \
+						    (m)->solidcolumnwords])
+#define phymodel_brickcolumn(m,x,y)	(((size_t)((y) >> phymodel_brickshift)) * (m)->xBricks + \
+					 ((x) >> phymodel_brickshift))
+
+/*
+ * A model may also keep a rock-beside mask, with one bit per atom
+ * that is set when any of the eight atoms around it at the same z is
+ * rock. The mask of a brick is one 16-bit row per (y,z), and is built
+ * when first asked for. Changes to rock through phymodel_setatom(),
+ * phymodel_setatommat() and phymodel_fillbox() make the masks of the
+ * bricks next to them be built again.
+ */
+
+#define phymodel_rockbesiderows		(phymodel_brickedge * phymodel_brickedge)
+#define phymodel_rockbesiderow(m,x,y,z)	((m)->rockbeside[(phymodel_brickindex((m),(x),(y),(z)) * \
+						  phymodel_rockbesiderows) +	\
+						 (((z) & phymodel_brickmask) << phymodel_brickshift) + \
+						 ((y) & phymodel_brickmask)])
+
+/*
+ * A model may also keep its surface: the atoms that are not rock but
+ * have rock on at least one of their six sides. All growth happens
+ * there, and it is a small part of a large model. The surface is a
+ * bit per atom, kept only for the bricks that have surface atoms,
+ * which are found by brick index from a hash table with open
+ * addressing and linear probing. The surface is built in parallel,
+ * one slab of bricks at a time, and then follows changes to rock made
+ * through phymodel_setatom(), phymodel_setatommat() and
+ * phymodel_fillbox(). Only the export of the surface (--model) enables
+ * it; reading a model does not, and the simulation does not use it.
+ */
+
+#define phymodelsurface_initialsize	64
+#define phymodelsurface_empty		(~(size_t)0)
+#define phymodelsurface_brickwords	(phymodel_brickatoms / 64)
+
+struct phymodelsurfacebrick {
+  size_t brick;                 /* brick index, or phymodelsurface_empty */
+  uint64_t* bits;               /* phymodel_brickatoms bits, in phymodel_inbrickindex order */
+};
+
+struct phymodelsurface {
+  size_t natoms;                /* number of surface atoms */
+  size_t nbricks;               /* number of bricks in the table */
+  size_t size;                  /* a power of two */
+  struct phymodelsurfacebrick* bricks;
+};
+
 struct phymodel {
   unsigned int magic;
   unsigned int unit;  /* in fractions of a meter, e.g., 1000 = 1mm, 100 000 = 0.01mm */
   unsigned int xSize; /* in number of units */
   unsigned int ySize; /* in number of units */
   unsigned int zSize; /* in number of units */
-  phyatom atoms[1];
+  enum phymodellayout layout;
+  unsigned int xBricks;         /* in number of bricks */
+  unsigned int yBricks;         /* in number of bricks */
+  unsigned int zBricks;         /* in number of bricks */
+  size_t natoms;                /* size of the atoms array */
+  phyatom* atoms;               /* not used in the sparse layout */
+  size_t nbricks;               /* sparse layout: number of bricks */
+  size_t nallocatedbricks;      /* sparse layout: number of allocated bricks */
+  phyatom** bricks;             /* sparse layout: brick atoms, or 0 if uniform */
+  phyatom* brickvalues;         /* sparse layout: atom value of uniform bricks */
+  uint8_t* sharedbricks;        /* sparse overlay: 1 if the brick belongs to the base, or 0 if not an overlay */
+  enum phymodelstorage storage;
+  enum phymodelaccess access;   /* only used for mapped storage */
+  enum phymodelformat format;   /* format used by phymodel_write */
+  void* mapping;                /* start of the mapped file, if mapped */
+  size_t mappingSize;           /* size of the mapped file, if mapped */
+  char* filename;               /* name of the mapped file, if mapped */
+  uint64_t* bitplanes;          /* material bit-planes, or 0 if none */
+  size_t bitplanewords;         /* number of words in one bit-plane */
+  size_t bitplanerowwords;      /* number of words in one row of a bit-plane */
+  uint64_t* solidcolumns;       /* solid columns, or 0 if none */
+  size_t solidcolumnwords;      /* number of words in one solid column */
+  uint8_t* solidcolumnsbuilt;   /* per brick column: 1 if its solid columns are built */
+  uint16_t* rockbeside;         /* rock-beside masks, or 0 if none */
+  uint8_t* rockbesidebuilt;     /* per brick: 1 if its rock-beside mask is built */
+  struct phymodelsurface* surface; /* surface atoms, or 0 if not kept */
+  uint32_t epoch;               /* current change epoch, if tracking changes */
+  uint32_t* brickepochs;        /* last epoch each brick changed in, or 0 if not tracking */
+  size_t* dirtybricks;          /* bricks changed in the current epoch */
+  size_t ndirtybricks;
+  size_t maxdirtybricks;
 };
 
-#define phymodel_sizeinbytes(x,y,z)	(sizeof(struct phymodel) + ((x)*(y)*(z)-1) * sizeof(phyatom))
+#define phymodel_natoms(x,y,z)		(((size_t)(x))*((size_t)(y))*((size_t)(z)))
+#define phymodel_layoutnatoms(l,x,y,z)	((l) != phymodellayout_linear ?			 \
+					 (phymodel_natoms(phymodel_nbricks(x),		 \
+							  phymodel_nbricks(y),		 \
+							  phymodel_nbricks(z)) << phymodel_brickatomshift) : \
+					 phymodel_natoms((x),(y),(z)))
+#define phymodel_sizeinbytes(l,x,y,z)	(sizeof(struct phymodelheader) + \
+					 phymodel_layoutnatoms((l),(x),(y),(z)) * sizeof(phyatom) + \
+					 phymodel_filepadding)
 #define phymodel_isvalid(m)		((m) != 0 && (m)->magic == PHYMODEL_MAGIC)
-#define phymodel_atomindex(m,x,y,z)	(((z) * (m)->xSize * (m)->ySize) + \
-					 ((y) * (m)->xSize) +		   \
-					 (x))
-#define phymodel_atommat(m,x,y,z)       phyatom_mat(phymodel_getatom((m),(x),(y),(z)))
-#define phymodel_atomisfree(m,x,y,z)    (phyatom_mat(phymodel_getatom((m),(x),(y),(z))) == material_air)
+#define phymodel_atomindex_linear(m,x,y,z) ((((size_t)(z)) * (m)->xSize * (m)->ySize) + \
+					   (((size_t)(y)) * (m)->xSize) +		       \
+					   ((size_t)(x)))
+#define phymodel_brickindex(m,x,y,z)	(((((size_t)((z) >> phymodel_brickshift)) * (m)->yBricks) + \
+					  ((y) >> phymodel_brickshift)) * (m)->xBricks +	      \
+					 ((x) >> phymodel_brickshift))
+#define phymodel_inbrickindex(x,y,z)	((((z) & phymodel_brickmask) << (2 * phymodel_brickshift)) | \
+					 (((y) & phymodel_brickmask) << phymodel_brickshift) |	     \
+					 ((x) & phymodel_brickmask))
+#define phymodel_atomindex_bricked(m,x,y,z) ((phymodel_brickindex((m),(x),(y),(z)) << phymodel_brickatomshift) + \
+					    phymodel_inbrickindex((x),(y),(z)))
+#define phymodel_atomindex(m,x,y,z)	((m)->layout == phymodellayout_linear ?	  \
+					 phymodel_atomindex_linear((m),(x),(y),(z)) : \
+					 phymodel_atomindex_bricked((m),(x),(y),(z)))
+#define phymodel_atommat(m,x,y,z)       phyatom_mat(phymodel_getatom_readonly((m),(x),(y),(z)))
+#define phymodel_atomisfree(m,x,y,z)    ((m)->bitplanes != 0 ?						\
+					 (phymodel_bitplaneword((m),material_air,(x),(y),(z)) & phymodel_bitplanebit(x)) != 0 : \
+					 phyatom_mat(phymodel_getatom_readonly((m),(x),(y),(z))) == material_air)
+
+/*
+ * Change epochs. When enabled, every change made through
+ * phymodel_setatom(), phymodel_setatommat() or phymodel_fillbox()
+ * records the current epoch for the brick of the changed atom, and
+ * the brick is listed once in the dirty bricks of the epoch. Changes
+ * made through the pointer from phymodel_getatom() are not seen.
+ */
+
+#define phymodel_markchanged(m,x,y,z)	do {							\
+    if ((m)->brickepochs != 0) {								\
+      size_t phymodel_changedbrick = phymodel_brickindex((m),(x),(y),(z));		\
+      if ((m)->brickepochs[phymodel_changedbrick] != (m)->epoch) {				\
+	phymodel_markbrickchanged((m),phymodel_changedbrick);				\
+      }											\
+    }											\
+  } while (0)
+
+/*
+ * The atoms at distance d from a point are those whose distance,
+ * rounded down, is d. The offsets of such a shell are computed once
+ * per distance and shared by all users; they are in x, y, z order.
+ */
+
+struct phymodeloffset {
+  int x;
+  int y;
+  int z;
+};
+
+struct phymodelshell {
+  unsigned int distance;
+  size_t noffsets;
+  struct phymodeloffset* offsets;
+};
 
 typedef void (*phyatom_fn)(unsigned int x,
 			   unsigned int y,
@@ -103,35 +399,185 @@ typedef void (*phyatom_fn)(unsigned int x,
 			   struct phymodel* model,
 			   phyatom* atom,
 			   void* data);
+typedef void (*phyatom_readfn)(unsigned int x,
+			       unsigned int y,
+			       unsigned int z,
+			       struct phymodel* model,
+			       const phyatom* atom,
+			       void* data);
 
 extern struct phymodel*
-phymodel_create(unsigned int unit,
+phymodel_create(enum phymodellayout layout,
+		unsigned int unit,
 		unsigned int xSize,
 		unsigned int ySize,
 		unsigned int zSize);
+extern struct phymodel*
+phymodel_create_file(const char* filename,
+		     enum phymodellayout layout,
+		     unsigned int unit,
+		     unsigned int xSize,
+		     unsigned int ySize,
+		     unsigned int zSize);
 extern phyatom*
 phymodel_getatom(struct phymodel* model,
 		 unsigned int x,
 		 unsigned int y,
 		 unsigned int z);
 extern void
+phymodel_setatom(struct phymodel* model,
+		 unsigned int x,
+		 unsigned int y,
+		 unsigned int z,
+		 phyatom value);
+extern void
+phymodel_setatommat(struct phymodel* model,
+		    unsigned int x,
+		    unsigned int y,
+		    unsigned int z,
+		    enum material mat);
+extern void
+phymodel_enablebitplanes(struct phymodel* model);
+extern void
+phymodel_disablebitplanes(struct phymodel* model);
+extern void
+phymodel_enablesolidcolumns(struct phymodel* model);
+extern void
+phymodel_disablesolidcolumns(struct phymodel* model);
+extern void
+phymodel_enablerockbeside(struct phymodel* model);
+extern void
+phymodel_disablerockbeside(struct phymodel* model);
+extern void
+phymodel_enableepochs(struct phymodel* model);
+extern void
+phymodel_disableepochs(struct phymodel* model);
+extern void
+phymodel_nextepoch(struct phymodel* model);
+extern void
+phymodel_markbrickchanged(struct phymodel* model,
+			  size_t brick);
+extern int
+phymodel_boxchanged(struct phymodel* model,
+		    unsigned int startX,
+		    unsigned int endX,
+		    unsigned int startY,
+		    unsigned int endY,
+		    unsigned int startZ,
+		    unsigned int endZ);
+extern int
+phymodel_boxchangedsince(struct phymodel* model,
+			 uint32_t epoch,
+			 unsigned int startX,
+			 unsigned int endX,
+			 unsigned int startY,
+			 unsigned int endY,
+			 unsigned int startZ,
+			 unsigned int endZ);
+extern unsigned int
+phymodel_nextsolid(struct phymodel* model,
+		   unsigned int x,
+		   unsigned int y,
+		   unsigned int z,
+		   unsigned int limit);
+extern void
+phymodel_enablesurface(struct phymodel* model);
+extern void
+phymodel_disablesurface(struct phymodel* model);
+extern void
+phymodel_updatesurface(struct phymodel* model,
+		       unsigned int startX,
+		       unsigned int endX,
+		       unsigned int startY,
+		       unsigned int endY,
+		       unsigned int startZ,
+		       unsigned int endZ);
+extern int
+phymodel_issurface(const struct phymodel* model,
+		   unsigned int x,
+		   unsigned int y,
+		   unsigned int z);
+extern void
+phymodel_mapsurface(struct phymodel* model,
+		    phyatom_readfn fn,
+		    void* data);
+extern int
+phymodel_hasrockbeside(struct phymodel* model,
+		       unsigned int x,
+		       unsigned int y,
+		       unsigned int z);
+extern unsigned int
+phymodel_freerun_forward(struct phymodel* model,
+			 unsigned int x,
+			 unsigned int y,
+			 unsigned int z,
+			 unsigned int max);
+extern unsigned int
+phymodel_freerun_backward(struct phymodel* model,
+			  unsigned int x,
+			  unsigned int y,
+			  unsigned int z,
+			  unsigned int max);
+extern int
+phymodel_rangeisfree(struct phymodel* model,
+		     unsigned int startX,
+		     unsigned int endX,
+		     unsigned int y,
+		     unsigned int z);
+extern int
+phymodel_boxisfree(struct phymodel* model,
+		   unsigned int startX,
+		   unsigned int endX,
+		   unsigned int startY,
+		   unsigned int endY,
+		   unsigned int z);
+extern int
+phymodel_sparse_brickisuniform(struct phymodel* model,
+			       unsigned int bx,
+			       unsigned int by,
+			       unsigned int bz,
+			       const phyatom* atoms);
+extern void
+phymodel_fillbox(struct phymodel* model,
+		 unsigned int startX,
+		 unsigned int endX,
+		 unsigned int startY,
+		 unsigned int endY,
+		 unsigned int startZ,
+		 unsigned int endZ,
+		 phyatom value);
+extern void
+phymodel_compact(struct phymodel* model);
+extern void
+phymodel_compact_region(struct phymodel* model,
+			unsigned int startX,
+			unsigned int startY,
+			unsigned int startZ,
+			unsigned int endX,
+			unsigned int endY,
+			unsigned int endZ);
+extern void
 phymodel_mapatoms(struct phymodel* model,
 		  phyatom_fn fn,
 		  void* data);
 extern void
+phymodel_mapatoms_parallel(struct phymodel* model,
+			   phyatom_fn fn,
+			   void* data);
+extern void
 phymodel_mapatoms_atz(struct phymodel* model,
 		      unsigned int z,
-		      phyatom_fn fn,
+		      phyatom_readfn fn,
 		      void* data);
 extern void
 phymodel_mapatoms_atx(struct phymodel* model,
 		      unsigned int x,
-		      phyatom_fn fn,
+		      phyatom_readfn fn,
 		      void* data);
 extern void
 phymodel_mapatoms_aty(struct phymodel* model,
 		      unsigned int y,
-		      phyatom_fn fn,
+		      phyatom_readfn fn,
 		      void* data);
 extern void
 phymodel_mapatoms_atdistance2dx(struct phymodel* model,
@@ -157,6 +603,8 @@ phymodel_mapatoms_atdistance2dz(struct phymodel* model,
 				unsigned int distance,
 				phyatom_fn fn,
 				void* data);
+extern const struct phymodelshell*
+phymodel_shell(unsigned int distance);
 extern void
 phymodel_mapatoms_atdistance3d(struct phymodel* model,
 			       unsigned int origox,
@@ -183,10 +631,36 @@ rgb_set_green(struct rgb* rgb);
 extern void
 phymodel_destroy(struct phymodel* model);
 extern struct phymodel*
-phymodel_read(const char* filename);
+phymodel_read(const char* filename,
+	      enum phymodelaccess access);
+extern struct phymodel*
+phymodel_read_region(const char* filename,
+		     enum phymodelaccess access,
+		     unsigned int startZ,
+		     unsigned int endZ);
+extern struct phymodel*
+phymodel_read_sparse(const char* filename);
+extern struct phymodel*
+phymodel_overlay(const struct phymodel* base);
+extern struct phymodel*
+phymodel_chunked_decode(const unsigned char* file,
+			size_t size,
+			const char* filename,
+			int sparse,
+			unsigned int startZ,
+			unsigned int endZ);
+extern void
+phymodel_chunked_write(struct phymodel* model,
+		       FILE* f,
+		       const char* filename);
 extern void
 phymodel_write(struct phymodel* model,
 	       const char* filename);
+extern void
+phymodel_sync(struct phymodel* model);
+extern struct phymodel*
+phymodel_relayout(struct phymodel* model,
+		  enum phymodellayout layout);
 extern unsigned char
 phyatom_longrgbtoshort(unsigned char rgb);
 extern unsigned char
@@ -203,4 +677,153 @@ phymodel_distance3d(unsigned int x1,
 		    unsigned int x2,
 		    unsigned int y2,
 		    unsigned int z2);
+
+/*
+ * Inline atom access. phymodel_getatom_unchecked() does no checks at
+ * all, and is meant for inner loops that have already checked their
+ * bounds. phymodel_getatom_readonly() is the same with the checks.
+ * Neither allocates bricks in sparse models; the atom of a uniform
+ * brick is shared by all of its atoms, and must not be written to.
+ */
+
+static inline const phyatom*
+phymodel_getatom_unchecked(const struct phymodel* model,
+			   unsigned int x,
+			   unsigned int y,
+			   unsigned int z) {
+  if (model->layout == phymodellayout_sparse) {
+    size_t brick = phymodel_brickindex(model,x,y,z);
+    const phyatom* atoms = model->bricks[brick];
+    if (atoms == 0) return(&model->brickvalues[brick]);
+    return(&atoms[phymodel_inbrickindex(x,y,z)]);
+  }
+  return(&model->atoms[phymodel_atomindex(model,x,y,z)]);
+}
+
+static inline const phyatom*
+phymodel_getatom_readonly(const struct phymodel* model,
+			  unsigned int x,
+			  unsigned int y,
+			  unsigned int z) {
+  assert(phymodel_isvalid(model));
+  assert(x < model->xSize);
+  assert(y < model->ySize);
+  assert(z < model->zSize);
+  return(phymodel_getatom_unchecked(model,x,y,z));
+}
+
+/*
+ * Row access. A segment is a run of atoms along one axis, starting
+ * from (x,y,z), that are at a constant stride from each other in
+ * memory. In the linear layout a segment runs to the end of the
+ * model, in the bricked layouts to the end of the brick. In a uniform
+ * sparse brick the stride is 0, as all atoms are the same one.
+ * Segments let loops over slices and rows work on plain pointers, so
+ * that the compiler can inline and vectorise them.
+ */
+
+enum phymodelaxis {
+  phymodelaxis_x = 0,
+  phymodelaxis_y = 1,
+  phymodelaxis_z = 2
+};
+
+typedef void (*phyatom_segmentfn)(unsigned int x,
+				  unsigned int y,
+				  unsigned int z,
+				  unsigned int length,
+				  const phyatom* atoms,
+				  ptrdiff_t stride,
+				  void* data);
+
+static inline const phyatom*
+phymodel_segment(const struct phymodel* model,
+		 enum phymodelaxis axis,
+		 unsigned int x,
+		 unsigned int y,
+		 unsigned int z,
+		 unsigned int* length,
+		 ptrdiff_t* stride) {
+  
+  unsigned int position;
+  unsigned int size;
+  const phyatom* atom;
+  
+  assert(phymodel_isvalid(model));
+  assert(x < model->xSize);
+  assert(y < model->ySize);
+  assert(z < model->zSize);
+  switch (axis) {
+  case phymodelaxis_x: position = x; size = model->xSize; break;
+  case phymodelaxis_y: position = y; size = model->ySize; break;
+  default:             position = z; size = model->zSize; break;
+  }
+  *length = size - position;
+  if (model->layout == phymodellayout_linear) {
+    switch (axis) {
+    case phymodelaxis_x: *stride = 1; break;
+    case phymodelaxis_y: *stride = model->xSize; break;
+    default:             *stride = ((ptrdiff_t)model->xSize) * model->ySize; break;
+    }
+    return(&model->atoms[phymodel_atomindex_linear(model,x,y,z)]);
+  }
+  if (*length > phymodel_brickedge - (position & phymodel_brickmask)) {
+    *length = phymodel_brickedge - (position & phymodel_brickmask);
+  }
+  *stride = ((ptrdiff_t)1) << (axis * phymodel_brickshift);
+  atom = phymodel_getatom_unchecked(model,x,y,z);
+  if (model->layout == phymodellayout_sparse &&
+      model->bricks[phymodel_brickindex(model,x,y,z)] == 0) {
+    *stride = 0;
+  }
+  return(atom);
+}
+
+/*
+ * Call fn for all segments in a plane where the fixed axis has the
+ * given value, with segments running along the row axis.
+ */
+
+static inline void
+phymodel_mapsegments(struct phymodel* model,
+		     enum phymodelaxis fixedaxis,
+		     unsigned int value,
+		     enum phymodelaxis rowaxis,
+		     phyatom_segmentfn fn,
+		     void* data) {
+  
+  enum phymodelaxis outeraxis = (enum phymodelaxis)(3 - fixedaxis - rowaxis);
+  unsigned int sizes[3];
+  unsigned int coords[3];
+  unsigned int outer;
+  
+  assert(phymodel_isvalid(model));
+  assert(fixedaxis != rowaxis);
+  sizes[phymodelaxis_x] = model->xSize;
+  sizes[phymodelaxis_y] = model->ySize;
+  sizes[phymodelaxis_z] = model->zSize;
+  assert(value < sizes[fixedaxis]);
+  coords[fixedaxis] = value;
+  for (outer = 0; outer < sizes[outeraxis]; outer++) {
+    unsigned int row = 0;
+    coords[outeraxis] = outer;
+    while (row < sizes[rowaxis]) {
+      unsigned int length;
+      ptrdiff_t stride;
+      const phyatom* atoms;
+      coords[rowaxis] = row;
+      atoms = phymodel_segment(model,rowaxis,
+			       coords[phymodelaxis_x],
+			       coords[phymodelaxis_y],
+			       coords[phymodelaxis_z],
+			       &length,&stride);
+      (*fn)(coords[phymodelaxis_x],
+	    coords[phymodelaxis_y],
+	    coords[phymodelaxis_z],
+	    length,atoms,stride,data);
+      row += length;
+    }
+  }
+}
+
 #endif /* PHYMODEL_H */
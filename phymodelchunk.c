@@ -0,0 +1,458 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include "util.h"
+#include "phymodel.h"
+#include "rle.h"
+#include "parallel.h"
+
+/*
+ * Reading and writing models in the compressed, chunked file format
+ * (see struct phymodelchunkedheader).
+ */
+
+struct phymodelchunkjob {
+  struct phymodel* model;
+  const char* filename;
+  const unsigned char* file;                   /* decoding: the mapped file */
+  const struct phymodelchunkentry* index;      /* decoding: the chunk index */
+  enum phymodellayout filelayout;              /* layout of the chunks */
+  unsigned int firstchunk;                     /* first chunk of this batch */
+  size_t* nallocatedbricks;                    /* decoding to sparse: per chunk */
+  struct rle_encoder* encoders;                /* encoding: per chunk of the batch */
+};
+
+static void
+phymodel_chunk_range(enum phymodellayout layout,
+		     unsigned int xSize,
+		     unsigned int ySize,
+		     unsigned int zSize,
+		     unsigned int chunk,
+		     size_t* first,
+		     size_t* natoms);
+static size_t
+phymodel_chunk_storebrick(struct phymodel* model,
+			  unsigned int bx,
+			  unsigned int by,
+			  unsigned int bz,
+			  const phyatom* atoms);
+static void
+phymodel_chunk_decodeone(unsigned int index,
+			 void* data);
+static void
+phymodel_chunk_encodeone(unsigned int index,
+			 void* data);
+
+static void
+phymodel_chunk_range(enum phymodellayout layout,
+		     unsigned int xSize,
+		     unsigned int ySize,
+		     unsigned int zSize,
+		     unsigned int chunk,
+		     size_t* first,
+		     size_t* natoms) {
+  
+  size_t planeatoms;
+  unsigned int startZ = chunk * phymodel_chunkdepth;
+  unsigned int depth;
+  
+  /*
+   * In the bricked layouts a chunk is a whole layer of bricks,
+   * including the padding. In the linear layout it is a slab of
+   * planes, and the last slab may be thinner than the others.
+   */
+  
+  assert(startZ < zSize);
+  if (layout == phymodellayout_linear) {
+    planeatoms = ((size_t)xSize) * ySize;
+    depth = zSize - startZ < phymodel_chunkdepth ? zSize - startZ : phymodel_chunkdepth;
+    *first = planeatoms * startZ;
+    *natoms = planeatoms * depth;
+  } else {
+    *natoms = phymodel_natoms(phymodel_nbricks(xSize),phymodel_nbricks(ySize),1) << phymodel_brickatomshift;
+    *first = *natoms * chunk;
+  }
+}
+
+static size_t
+phymodel_chunk_storebrick(struct phymodel* model,
+			  unsigned int bx,
+			  unsigned int by,
+			  unsigned int bz,
+			  const phyatom* atoms) {
+  
+  size_t brick = (((size_t)bz) * model->yBricks + by) * model->xBricks + bx;
+  phyatom* copy;
+  
+  /*
+   * Store a decoded brick in a sparse model. Returns the number of
+   * bricks allocated, 0 or 1. The count of allocated bricks in the
+   * model is not updated here, as bricks are stored from several
+   * threads.
+   */
+  
+  assert(model->layout == phymodellayout_sparse);
+  assert(model->bricks[brick] == 0);
+  if (phymodel_sparse_brickisuniform(model,bx,by,bz,atoms)) {
+    model->brickvalues[brick] = atoms[0];
+    return(0);
+  }
+  copy = (phyatom*)malloc(phymodel_brickatoms * sizeof(phyatom));
+  if (copy == 0) {
+    fatalz("cannot allocate model brick of bytes",phymodel_brickatoms * sizeof(phyatom));
+    return(0);
+  }
+  memcpy(copy,atoms,phymodel_brickatoms * sizeof(phyatom));
+  model->bricks[brick] = copy;
+  return(1);
+}
+
+static void
+phymodel_chunk_decodeone(unsigned int index,
+			 void* data) {
+  
+  struct phymodelchunkjob* job = (struct phymodelchunkjob*)data;
+  struct phymodel* model = job->model;
+  unsigned int chunk = job->firstchunk + index;
+  struct rle_decoder decoder;
+  phyatom brickatoms[phymodel_brickatoms];
+  phyatom* slab = 0;
+  size_t first;
+  size_t natoms;
+  size_t nallocated = 0;
+  unsigned int bx;
+  unsigned int by;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  int ok = 1;
+  
+  phymodel_chunk_range(job->filelayout,
+		       model->xSize,model->ySize,model->zSize,
+		       chunk,
+		       &first,&natoms);
+  rle_decoder_initialize(&decoder,
+			 job->file + job->index[chunk].offset,
+			 job->index[chunk].size);
+  
+  if (model->layout != phymodellayout_sparse) {
+    
+    /*
+     * Decode directly to the model
+     */
+    
+    assert(model->layout == job->filelayout);
+    ok = rle_decoder_get(&decoder,model->atoms + first,natoms);
+    
+  } else if (job->filelayout == phymodellayout_bricked) {
+    
+    /*
+     * Decode brick by brick, long runs become uniform bricks
+     * without ever being expanded
+     */
+    
+    for (by = 0; ok && by < model->yBricks; by++) {
+      for (bx = 0; ok && bx < model->xBricks; bx++) {
+	size_t brick = (((size_t)chunk) * model->yBricks + by) * model->xBricks + bx;
+	unsigned char value;
+	if (rle_decoder_peekrun(&decoder,&value) >= phymodel_brickatoms) {
+	  ok = rle_decoder_get(&decoder,brickatoms,phymodel_brickatoms);
+	  model->brickvalues[brick] = value;
+	} else {
+	  ok = rle_decoder_get(&decoder,brickatoms,phymodel_brickatoms);
+	  if (ok) nallocated += phymodel_chunk_storebrick(model,bx,by,chunk,brickatoms);
+	}
+      }
+    }
+    
+  } else {
+    
+    /*
+     * Decode the slab of planes, and cut it into bricks
+     */
+    
+    slab = (phyatom*)malloc(natoms * sizeof(phyatom));
+    if (slab == 0) {
+      fatalz("cannot allocate decoding buffer of bytes",natoms * sizeof(phyatom));
+      return;
+    }
+    ok = rle_decoder_get(&decoder,slab,natoms);
+    for (by = 0; ok && by < model->yBricks; by++) {
+      for (bx = 0; ok && bx < model->xBricks; bx++) {
+	memset(brickatoms,0,sizeof(brickatoms));
+	for (z = chunk * phymodel_chunkdepth;
+	     z < (chunk + 1) * phymodel_chunkdepth && z < model->zSize;
+	     z++) {
+	  for (y = by << phymodel_brickshift;
+	       y < (by + 1) << phymodel_brickshift && y < model->ySize;
+	       y++) {
+	    for (x = bx << phymodel_brickshift;
+		 x < (bx + 1) << phymodel_brickshift && x < model->xSize;
+		 x++) {
+	      brickatoms[phymodel_inbrickindex(x,y,z)] =
+		slab[phymodel_atomindex_linear(model,x,y,z) - first];
+	    }
+	  }
+	}
+	nallocated += phymodel_chunk_storebrick(model,bx,by,chunk,brickatoms);
+      }
+    }
+    free(slab);
+    
+  }
+  
+  if (!ok || !rle_decoder_isfinished(&decoder)) {
+    fatalsu("corrupted chunk in model file",job->filename,chunk);
+    return;
+  }
+  if (job->nallocatedbricks != 0) job->nallocatedbricks[chunk] = nallocated;
+}
+
+struct phymodel*
+phymodel_chunked_decode(const unsigned char* file,
+			size_t size,
+			const char* filename,
+			int sparse,
+			unsigned int startZ,
+			unsigned int endZ) {
+  
+  const struct phymodelchunkedheader* header = (const struct phymodelchunkedheader*)file;
+  struct phymodelchunkjob job;
+  struct phymodel* model;
+  unsigned int firstchunk;
+  unsigned int lastchunk;
+  unsigned int chunk;
+  size_t indexSize;
+  
+  /*
+   * Sanity checks
+   */
+  
+  assert(header->magic == PHYMODEL_MAGIC_CHUNKED);
+  if (header->version != PHYMODEL_CHUNKED_VERSION) {
+    fatalsu("unsupported model file version",filename,header->version);
+    return(0);
+  }
+  if (header->layout != phymodellayout_linear &&
+      header->layout != phymodellayout_bricked) {
+    fatalsu("unsupported model file layout",filename,header->layout);
+    return(0);
+  }
+  if (header->codec != phymodelcodec_rle) {
+    fatalsu("unsupported model file compression",filename,header->codec);
+    return(0);
+  }
+  if (header->xSize == 0 || header->ySize == 0 || header->zSize == 0 ||
+      header->chunkDepth != phymodel_chunkdepth ||
+      header->nChunks != phymodel_nbricks(header->zSize)) {
+    fatals("model file has inconsistent dimensions",filename);
+    return(0);
+  }
+  indexSize = header->nChunks * sizeof(struct phymodelchunkentry);
+  if (size < sizeof(struct phymodelchunkedheader) + indexSize) {
+    fatalsz("model file is too short for its chunk index",filename,size);
+    return(0);
+  }
+  memset(&job,0,sizeof(job));
+  job.index = (const struct phymodelchunkentry*)(file + sizeof(struct phymodelchunkedheader));
+  for (chunk = 0; chunk < header->nChunks; chunk++) {
+    if (job.index[chunk].offset > size ||
+	job.index[chunk].size > size - job.index[chunk].offset) {
+      fatalsu("model file chunk is outside the file",filename,chunk);
+      return(0);
+    }
+  }
+  
+  /*
+   * Create the model, and decode the chunks that overlap the
+   * requested planes. The rest of the model remains air.
+   */
+  
+  model = phymodel_create(sparse ? phymodellayout_sparse : (enum phymodellayout)header->layout,
+			  header->unit,
+			  header->xSize,
+			  header->ySize,
+			  header->zSize);
+  model->format = phymodelformat_compressed;
+  if (endZ > model->zSize) endZ = model->zSize;
+  if (startZ >= endZ) return(model);
+  firstchunk = startZ / phymodel_chunkdepth;
+  lastchunk = (endZ - 1) / phymodel_chunkdepth;
+  debugf("decoding chunks %u..%u of %u from %s",
+	 firstchunk, lastchunk, header->nChunks, filename);
+  
+  job.model = model;
+  job.filename = filename;
+  job.file = file;
+  job.filelayout = (enum phymodellayout)header->layout;
+  job.firstchunk = firstchunk;
+  if (sparse) {
+    job.nallocatedbricks = (size_t*)calloc(header->nChunks,sizeof(size_t));
+    if (job.nallocatedbricks == 0) {
+      fatalz("cannot allocate memory for chunks",header->nChunks);
+      return(0);
+    }
+  }
+  parallel_for(lastchunk - firstchunk + 1,phymodel_chunk_decodeone,&job);
+  if (sparse) {
+    for (chunk = firstchunk; chunk <= lastchunk; chunk++) {
+      model->nallocatedbricks += job.nallocatedbricks[chunk];
+    }
+    free(job.nallocatedbricks);
+  }
+  
+  return(model);
+}
+
+static void
+phymodel_chunk_encodeone(unsigned int index,
+			 void* data) {
+  
+  struct phymodelchunkjob* job = (struct phymodelchunkjob*)data;
+  struct phymodel* model = job->model;
+  unsigned int chunk = job->firstchunk + index;
+  struct rle_encoder* encoder = &job->encoders[index];
+  size_t first;
+  size_t natoms;
+  
+  rle_encoder_initialize(encoder);
+  if (model->layout == phymodellayout_sparse) {
+    
+    /*
+     * Sparse models are written as bricked, a layer of bricks at a
+     * time
+     */
+    
+    size_t brick = ((size_t)chunk) * model->yBricks * model->xBricks;
+    size_t lastbrick = brick + ((size_t)model->yBricks) * model->xBricks;
+    for (; brick < lastbrick; brick++) {
+      if (model->bricks[brick] == 0) {
+	rle_encoder_addrun(encoder,model->brickvalues[brick],phymodel_brickatoms);
+      } else {
+	rle_encoder_add(encoder,model->bricks[brick],phymodel_brickatoms);
+      }
+    }
+    
+  } else {
+    
+    phymodel_chunk_range(model->layout,
+			 model->xSize,model->ySize,model->zSize,
+			 chunk,
+			 &first,&natoms);
+    rle_encoder_add(encoder,model->atoms + first,natoms);
+    
+  }
+  rle_encoder_finish(encoder);
+}
+
+void
+phymodel_chunked_write(struct phymodel* model,
+		       FILE* f,
+		       const char* filename) {
+  
+  struct phymodelchunkedheader header;
+  struct phymodelchunkentry* index;
+  struct phymodelchunkjob job;
+  unsigned int batch = parallel_nthreads();
+  unsigned int chunk;
+  unsigned int i;
+  uint64_t offset;
+  size_t indexSize;
+  
+  assert(phymodel_isvalid(model));
+  
+  memset(&header,0,sizeof(header));
+  header.magic = PHYMODEL_MAGIC_CHUNKED;
+  header.unit = model->unit;
+  header.xSize = model->xSize;
+  header.ySize = model->ySize;
+  header.zSize = model->zSize;
+  header.version = PHYMODEL_CHUNKED_VERSION;
+  header.layout = (model->layout == phymodellayout_linear ?
+		   phymodellayout_linear :
+		   phymodellayout_bricked);
+  header.chunkDepth = phymodel_chunkdepth;
+  header.nChunks = phymodel_nbricks(model->zSize);
+  header.codec = phymodelcodec_rle;
+
+  memset(&job,0,sizeof(job));
+  indexSize = header.nChunks * sizeof(struct phymodelchunkentry);
+  index = (struct phymodelchunkentry*)calloc(header.nChunks,sizeof(struct phymodelchunkentry));
+  job.encoders = (struct rle_encoder*)calloc(batch,sizeof(struct rle_encoder));
+  if (index == 0 || job.encoders == 0) {
+    fatalz("cannot allocate memory for chunks",header.nChunks);
+    return;
+  }
+  job.model = model;
+  job.filename = filename;
+  
+  /*
+   * The header and the index come first, but the index is only known
+   * after the chunks have been compressed. Chunks are compressed in
+   * parallel, a batch at a time, and written in order.
+   */
+  
+  if (fwrite(&header,sizeof(header),1,f) != 1 ||
+      fwrite(index,indexSize,1,f) != 1) {
+    fatals("failed to write model header to file", filename);
+    return;
+  }
+  offset = sizeof(header) + indexSize;
+  for (chunk = 0; chunk < header.nChunks; chunk += batch) {
+    unsigned int n = header.nChunks - chunk < batch ? header.nChunks - chunk : batch;
+    job.firstchunk = chunk;
+    parallel_for(n,phymodel_chunk_encodeone,&job);
+    for (i = 0; i < n; i++) {
+      struct rle_encoder* encoder = &job.encoders[i];
+      index[chunk + i].offset = offset;
+      index[chunk + i].size = encoder->length;
+      if (encoder->length > 0 &&
+	  fwrite(encoder->buffer,encoder->length,1,f) != 1) {
+	fatals("failed to write model chunk to file", filename);
+	return;
+      }
+      offset += encoder->length;
+      rle_encoder_deinitialize(encoder);
+    }
+  }
+  debugf("compressed model of %zu atoms to %llu bytes",
+	 model->natoms,
+	 (unsigned long long)offset);
+  
+  if (fseeko(f,sizeof(header),SEEK_SET) != 0 ||
+      fwrite(index,indexSize,1,f) != 1) {
+    fatals("failed to write model chunk index to file", filename);
+    return;
+  }
+  
+  free(job.encoders);
+  free(index);
+}
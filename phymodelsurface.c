@@ -0,0 +1,386 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "phymodel.h"
+#include "parallel.h"
+
+/*
+ * Keeping the surface of a model (see struct phymodelsurface).
+ */
+
+#define phymodel_surface_slot(surface,brick)	((size_t)((((uint64_t)(brick)) * 0x9E3779B97F4A7C15ULL) >> 32) & \
+						 ((surface)->size - 1))
+
+struct phymodelsurfacejob {
+  struct phymodel* model;
+  uint64_t** found;                            /* per brick: its surface bits, or 0 if none */
+};
+
+static void
+phymodel_surface_allocate(struct phymodelsurface* surface,
+			  size_t size) {
+  size_t i;
+  surface->bricks = (struct phymodelsurfacebrick*)malloc(size * sizeof(struct phymodelsurfacebrick));
+  if (surface->bricks == 0) {
+    fatalz("cannot allocate surface hash of entries", size);
+    return;
+  }
+  surface->size = size;
+  surface->nbricks = 0;
+  for (i = 0; i < size; i++) {
+    surface->bricks[i].brick = phymodelsurface_empty;
+    surface->bricks[i].bits = 0;
+  }
+}
+
+static struct phymodelsurfacebrick*
+phymodel_surface_find(const struct phymodelsurface* surface,
+		      size_t brick) {
+  size_t slot = phymodel_surface_slot(surface,brick);
+  while (surface->bricks[slot].brick != brick &&
+	 surface->bricks[slot].brick != phymodelsurface_empty) {
+    slot = (slot + 1) & (surface->size - 1);
+  }
+  return(&surface->bricks[slot]);
+}
+
+static void
+phymodel_surface_grow(struct phymodelsurface* surface) {
+  struct phymodelsurfacebrick* old = surface->bricks;
+  size_t oldsize = surface->size;
+  size_t nbricks = surface->nbricks;
+  size_t i;
+  phymodel_surface_allocate(surface,2 * oldsize);
+  for (i = 0; i < oldsize; i++) {
+    if (old[i].brick != phymodelsurface_empty) {
+      *phymodel_surface_find(surface,old[i].brick) = old[i];
+    }
+  }
+  surface->nbricks = nbricks;
+  free(old);
+}
+
+static void
+phymodel_surface_insert(struct phymodelsurface* surface,
+			size_t brick,
+			uint64_t* bits) {
+  struct phymodelsurfacebrick* entry;
+  if (2 * (surface->nbricks + 1) > surface->size) phymodel_surface_grow(surface);
+  entry = phymodel_surface_find(surface,brick);
+  assert(entry->brick == phymodelsurface_empty);
+  entry->brick = brick;
+  entry->bits = bits;
+  surface->nbricks++;
+}
+
+static uint64_t*
+phymodel_surface_newbits(void) {
+  uint64_t* bits = (uint64_t*)calloc(phymodelsurface_brickwords,sizeof(uint64_t));
+  if (bits == 0) {
+    fatalz("cannot allocate surface bits of bytes", phymodelsurface_brickwords * sizeof(uint64_t));
+    return(0);
+  }
+  return(bits);
+}
+
+static int
+phymodel_surface_atomissurface(const struct phymodel* model,
+			       unsigned int x,
+			       unsigned int y,
+			       unsigned int z) {
+  if (phymodel_atommat(model,x,y,z) == material_rock) return(0);
+  if (x > 0 && phymodel_atommat(model,x-1,y,z) == material_rock) return(1);
+  if (x + 1 < model->xSize && phymodel_atommat(model,x+1,y,z) == material_rock) return(1);
+  if (y > 0 && phymodel_atommat(model,x,y-1,z) == material_rock) return(1);
+  if (y + 1 < model->ySize && phymodel_atommat(model,x,y+1,z) == material_rock) return(1);
+  if (z > 0 && phymodel_atommat(model,x,y,z-1) == material_rock) return(1);
+  if (z + 1 < model->zSize && phymodel_atommat(model,x,y,z+1) == material_rock) return(1);
+  return(0);
+}
+
+static int
+phymodel_surface_brickisrock(const struct phymodel* model,
+			     int bx,
+			     int by,
+			     int bz) {
+  size_t brick;
+  if (bx < 0 || by < 0 || bz < 0 ||
+      bx >= (int)model->xBricks || by >= (int)model->yBricks || bz >= (int)model->zBricks) {
+    return(0);
+  }
+  brick = phymodel_brickindex(model,
+			      ((unsigned int)bx) << phymodel_brickshift,
+			      ((unsigned int)by) << phymodel_brickshift,
+			      ((unsigned int)bz) << phymodel_brickshift);
+  return(model->bricks[brick] != 0 || phyatom_mat(&model->brickvalues[brick]) == material_rock);
+}
+
+static int
+phymodel_surface_brickcanhavesurface(const struct phymodel* model,
+				     unsigned int bx,
+				     unsigned int by,
+				     unsigned int bz) {
+  
+  size_t brick;
+  
+  /*
+   * In a sparse model, a uniform brick of rock has no surface atoms,
+   * and neither does a uniform brick of something else unless there's
+   * rock in a brick next to it
+   */
+  
+  if (model->layout != phymodellayout_sparse) return(1);
+  brick = phymodel_brickindex(model,
+			      bx << phymodel_brickshift,
+			      by << phymodel_brickshift,
+			      bz << phymodel_brickshift);
+  if (model->bricks[brick] != 0) return(1);
+  if (phyatom_mat(&model->brickvalues[brick]) == material_rock) return(0);
+  return(phymodel_surface_brickisrock(model,bx-1,by,bz) ||
+	 phymodel_surface_brickisrock(model,bx+1,by,bz) ||
+	 phymodel_surface_brickisrock(model,bx,by-1,bz) ||
+	 phymodel_surface_brickisrock(model,bx,by+1,bz) ||
+	 phymodel_surface_brickisrock(model,bx,by,bz-1) ||
+	 phymodel_surface_brickisrock(model,bx,by,bz+1));
+}
+
+static void
+phymodel_surface_slabjob(unsigned int bz,
+			 void* data) {
+  
+  struct phymodelsurfacejob* job = (struct phymodelsurfacejob*)data;
+  struct phymodel* model = job->model;
+  unsigned int bx;
+  unsigned int by;
+  
+  for (by = 0; by < model->yBricks; by++) {
+    for (bx = 0; bx < model->xBricks; bx++) {
+      unsigned int startX = bx << phymodel_brickshift;
+      unsigned int startY = by << phymodel_brickshift;
+      unsigned int startZ = bz << phymodel_brickshift;
+      unsigned int endX = startX + phymodel_brickedge < model->xSize ? startX + phymodel_brickedge : model->xSize;
+      unsigned int endY = startY + phymodel_brickedge < model->ySize ? startY + phymodel_brickedge : model->ySize;
+      unsigned int endZ = startZ + phymodel_brickedge < model->zSize ? startZ + phymodel_brickedge : model->zSize;
+      uint64_t* bits = 0;
+      unsigned int x;
+      unsigned int y;
+      unsigned int z;
+      if (!phymodel_surface_brickcanhavesurface(model,bx,by,bz)) continue;
+      for (z = startZ; z < endZ; z++) {
+	for (y = startY; y < endY; y++) {
+	  for (x = startX; x < endX; x++) {
+	    if (phymodel_surface_atomissurface(model,x,y,z)) {
+	      unsigned int i = phymodel_inbrickindex(x,y,z);
+	      if (bits == 0) bits = phymodel_surface_newbits();
+	      bits[i >> 6] |= ((uint64_t)1) << (i & 63);
+	    }
+	  }
+	}
+      }
+      if (bits != 0) job->found[phymodel_brickindex(model,startX,startY,startZ)] = bits;
+    }
+  }
+}
+
+void
+phymodel_enablesurface(struct phymodel* model) {
+  
+  struct phymodelsurfacejob job;
+  struct phymodelsurface* surface;
+  size_t brick;
+  
+  assert(phymodel_isvalid(model));
+  if (model->surface != 0) return;
+  
+  surface = (struct phymodelsurface*)malloc(sizeof(struct phymodelsurface));
+  job.model = model;
+  job.found = (uint64_t**)calloc(model->nbricks,sizeof(uint64_t*));
+  if (surface == 0 || job.found == 0) {
+    fatalz("cannot allocate surface of bytes", model->nbricks * sizeof(uint64_t*));
+    return;
+  }
+  
+  /*
+   * Find the surface atoms of each slab of bricks in parallel, and
+   * then put the bricks that have them in the table in brick order
+   */
+  
+  parallel_for(model->zBricks,phymodel_surface_slabjob,&job);
+  phymodel_surface_allocate(surface,phymodelsurface_initialsize);
+  surface->natoms = 0;
+  for (brick = 0; brick < model->nbricks; brick++) {
+    if (job.found[brick] != 0) {
+      unsigned int i;
+      for (i = 0; i < phymodelsurface_brickwords; i++) {
+	surface->natoms += __builtin_popcountll(job.found[brick][i]);
+      }
+      phymodel_surface_insert(surface,brick,job.found[brick]);
+    }
+  }
+  free(job.found);
+  model->surface = surface;
+  debugf("surface of %zu atoms in %zu bricks", surface->natoms, surface->nbricks);
+}
+
+void
+phymodel_disablesurface(struct phymodel* model) {
+  size_t i;
+  assert(phymodel_isvalid(model));
+  if (model->surface == 0) return;
+  for (i = 0; i < model->surface->size; i++) {
+    if (model->surface->bricks[i].bits != 0) free(model->surface->bricks[i].bits);
+  }
+  free(model->surface->bricks);
+  free(model->surface);
+  model->surface = 0;
+}
+
+void
+phymodel_updatesurface(struct phymodel* model,
+		       unsigned int startX,
+		       unsigned int endX,
+		       unsigned int startY,
+		       unsigned int endY,
+		       unsigned int startZ,
+		       unsigned int endZ) {
+  
+  struct phymodelsurface* surface = model->surface;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  
+  /*
+   * A change to rock can add or remove the atom and the atoms on its
+   * six sides
+   */
+  
+  assert(surface != 0);
+  if (startX > 0) startX--;
+  if (startY > 0) startY--;
+  if (startZ > 0) startZ--;
+  if (endX < model->xSize) endX++;
+  if (endY < model->ySize) endY++;
+  if (endZ < model->zSize) endZ++;
+  for (z = startZ; z < endZ; z++) {
+    for (y = startY; y < endY; y++) {
+      for (x = startX; x < endX; x++) {
+	size_t brick = phymodel_brickindex(model,x,y,z);
+	unsigned int i = phymodel_inbrickindex(x,y,z);
+	uint64_t bit = ((uint64_t)1) << (i & 63);
+	struct phymodelsurfacebrick* entry = phymodel_surface_find(surface,brick);
+	int was = (entry->bits != 0 && (entry->bits[i >> 6] & bit) != 0);
+	int is = phymodel_surface_atomissurface(model,x,y,z);
+	if (was == is) continue;
+	if (is) {
+	  if (entry->bits == 0) {
+	    phymodel_surface_insert(surface,brick,phymodel_surface_newbits());
+	    entry = phymodel_surface_find(surface,brick);
+	  }
+	  entry->bits[i >> 6] |= bit;
+	  surface->natoms++;
+	} else {
+	  entry->bits[i >> 6] &= ~bit;
+	  surface->natoms--;
+	}
+      }
+    }
+  }
+}
+
+int
+phymodel_issurface(const struct phymodel* model,
+		   unsigned int x,
+		   unsigned int y,
+		   unsigned int z) {
+  const struct phymodelsurfacebrick* entry;
+  unsigned int i = phymodel_inbrickindex(x,y,z);
+  assert(model->surface != 0);
+  entry = phymodel_surface_find(model->surface,phymodel_brickindex(model,x,y,z));
+  if (entry->bits == 0) return(0);
+  return((entry->bits[i >> 6] >> (i & 63)) & 1);
+}
+
+static int
+phymodel_surface_comparebricks(const void* a,
+			       const void* b) {
+  size_t brickA = (*(const struct phymodelsurfacebrick* const*)a)->brick;
+  size_t brickB = (*(const struct phymodelsurfacebrick* const*)b)->brick;
+  return(brickA < brickB ? -1 : brickA > brickB ? 1 : 0);
+}
+
+void
+phymodel_mapsurface(struct phymodel* model,
+		    phyatom_readfn fn,
+		    void* data) {
+  
+  struct phymodelsurface* surface = model->surface;
+  const struct phymodelsurfacebrick** entries;
+  size_t nentries = 0;
+  size_t i;
+  
+  /*
+   * Go through the surface atoms brick by brick in brick order, so
+   * that the order does not depend on how the surface has changed
+   */
+  
+  assert(surface != 0);
+  entries = (const struct phymodelsurfacebrick**)malloc((surface->nbricks + 1) * sizeof(*entries));
+  if (entries == 0) {
+    fatalz("cannot allocate surface bricks list of entries", surface->nbricks);
+    return;
+  }
+  for (i = 0; i < surface->size; i++) {
+    if (surface->bricks[i].brick != phymodelsurface_empty) entries[nentries++] = &surface->bricks[i];
+  }
+  qsort(entries,nentries,sizeof(*entries),phymodel_surface_comparebricks);
+  
+  for (i = 0; i < nentries; i++) {
+    size_t brick = entries[i]->brick;
+    unsigned int startX = (brick % model->xBricks) << phymodel_brickshift;
+    unsigned int startY = ((brick / model->xBricks) % model->yBricks) << phymodel_brickshift;
+    unsigned int startZ = (brick / (((size_t)model->xBricks) * model->yBricks)) << phymodel_brickshift;
+    unsigned int word;
+    for (word = 0; word < phymodelsurface_brickwords; word++) {
+      uint64_t bits = entries[i]->bits[word];
+      while (bits != 0) {
+	unsigned int index = (word << 6) + __builtin_ctzll(bits);
+	unsigned int x = startX + (index & phymodel_brickmask);
+	unsigned int y = startY + ((index >> phymodel_brickshift) & phymodel_brickmask);
+	unsigned int z = startZ + (index >> (2 * phymodel_brickshift));
+	(*fn)(x,y,z,model,phymodel_getatom_readonly(model,x,y,z),data);
+	bits &= bits - 1;
+      }
+    }
+  }
+  
+  free(entries);
+}
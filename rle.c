@@ -0,0 +1,188 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "rle.h"
+
+static void
+rle_encoder_reserve(struct rle_encoder* encoder,
+		    size_t length);
+static void
+rle_encoder_flushrun(struct rle_encoder* encoder);
+static int
+rle_decoder_nextrun(struct rle_decoder* decoder);
+
+void
+rle_encoder_initialize(struct rle_encoder* encoder) {
+  memset(encoder,0,sizeof(*encoder));
+}
+
+static void
+rle_encoder_reserve(struct rle_encoder* encoder,
+		    size_t length) {
+  
+  size_t newAllocated;
+  unsigned char* newBuffer;
+  
+  if (encoder->length + length <= encoder->allocated) return;
+  newAllocated = encoder->allocated == 0 ? 256 : encoder->allocated;
+  while (newAllocated < encoder->length + length) newAllocated *= 2;
+  newBuffer = (unsigned char*)realloc(encoder->buffer,newAllocated);
+  if (newBuffer == 0) {
+    fatalz("cannot allocate encoding buffer of bytes",newAllocated);
+    return;
+  }
+  encoder->buffer = newBuffer;
+  encoder->allocated = newAllocated;
+}
+
+static void
+rle_encoder_flushrun(struct rle_encoder* encoder) {
+  
+  size_t run = encoder->run;
+  
+  if (run == 0) return;
+  
+  /*
+   * A size_t needs at most 10 bytes of 7 bits, plus one for the value
+   */
+  
+  rle_encoder_reserve(encoder,11);
+  while (run >= 0x80) {
+    encoder->buffer[encoder->length++] = (unsigned char)(run & 0x7F) | 0x80;
+    run >>= 7;
+  }
+  encoder->buffer[encoder->length++] = (unsigned char)run;
+  encoder->buffer[encoder->length++] = encoder->value;
+  encoder->run = 0;
+}
+
+void
+rle_encoder_addrun(struct rle_encoder* encoder,
+		   unsigned char value,
+		   size_t length) {
+  if (length == 0) return;
+  if (encoder->run > 0 && encoder->value != value) {
+    rle_encoder_flushrun(encoder);
+  }
+  encoder->value = value;
+  encoder->run += length;
+}
+
+void
+rle_encoder_add(struct rle_encoder* encoder,
+		const unsigned char* data,
+		size_t length) {
+  
+  size_t i = 0;
+  
+  while (i < length) {
+    size_t j = i + 1;
+    while (j < length && data[j] == data[i]) j++;
+    rle_encoder_addrun(encoder,data[i],j - i);
+    i = j;
+  }
+}
+
+void
+rle_encoder_finish(struct rle_encoder* encoder) {
+  rle_encoder_flushrun(encoder);
+}
+
+void
+rle_encoder_deinitialize(struct rle_encoder* encoder) {
+  if (encoder->buffer != 0) free(encoder->buffer);
+  memset(encoder,0,sizeof(*encoder));
+}
+
+void
+rle_decoder_initialize(struct rle_decoder* decoder,
+		       const unsigned char* input,
+		       size_t inputLength) {
+  memset(decoder,0,sizeof(*decoder));
+  decoder->input = input;
+  decoder->inputLength = inputLength;
+}
+
+static int
+rle_decoder_nextrun(struct rle_decoder* decoder) {
+  
+  size_t run = 0;
+  unsigned int shift = 0;
+  
+  /*
+   * Read the run length, and then the value. Returns 0 if the input
+   * ends or is malformed.
+   */
+  
+  for (;;) {
+    unsigned char byte;
+    if (decoder->position >= decoder->inputLength) return(0);
+    if (shift >= 8 * sizeof(size_t)) return(0);
+    byte = decoder->input[decoder->position++];
+    run |= ((size_t)(byte & 0x7F)) << shift;
+    shift += 7;
+    if ((byte & 0x80) == 0) break;
+  }
+  if (decoder->position >= decoder->inputLength) return(0);
+  if (run == 0) return(0);
+  decoder->value = decoder->input[decoder->position++];
+  decoder->run = run;
+  return(1);
+}
+
+int
+rle_decoder_get(struct rle_decoder* decoder,
+		unsigned char* data,
+		size_t length) {
+  while (length > 0) {
+    size_t n;
+    if (decoder->run == 0 && !rle_decoder_nextrun(decoder)) return(0);
+    n = decoder->run < length ? decoder->run : length;
+    memset(data,decoder->value,n);
+    data += n;
+    length -= n;
+    decoder->run -= n;
+  }
+  return(1);
+}
+
+size_t
+rle_decoder_peekrun(struct rle_decoder* decoder,
+		    unsigned char* value) {
+  if (decoder->run == 0 && !rle_decoder_nextrun(decoder)) return(0);
+  *value = decoder->value;
+  return(decoder->run);
+}
+
+int
+rle_decoder_isfinished(struct rle_decoder* decoder) {
+  return(decoder->run == 0 && decoder->position == decoder->inputLength);
+}
@@ -0,0 +1,88 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef RLE_H
+#define RLE_H
+
+#include <stddef.h>
+
+/*
+ * A simple run-length codec for model data. The encoded form is a
+ * sequence of runs, each a run length as a little-endian base-128
+ * variable-length integer, followed by the byte that is repeated.
+ * Rock models consist mostly of long runs of the same atom, so even
+ * this simple scheme compresses them well, and it is fast to both
+ * encode and decode.
+ *
+ * Both the encoder and the decoder are incremental, so that a model
+ * can be fed to them in pieces, e.g., brick by brick.
+ */
+
+struct rle_encoder {
+  unsigned char* buffer;        /* encoded output, malloc'ed */
+  size_t length;                /* bytes used in buffer */
+  size_t allocated;             /* bytes allocated for buffer */
+  unsigned char value;          /* byte of the current run */
+  size_t run;                   /* length of the current run, 0 if none */
+};
+
+struct rle_decoder {
+  const unsigned char* input;
+  size_t inputLength;
+  size_t position;              /* next byte to read from input */
+  unsigned char value;          /* byte of the current run */
+  size_t run;                   /* remaining length of the current run */
+};
+
+extern void
+rle_encoder_initialize(struct rle_encoder* encoder);
+extern void
+rle_encoder_add(struct rle_encoder* encoder,
+		const unsigned char* data,
+		size_t length);
+extern void
+rle_encoder_addrun(struct rle_encoder* encoder,
+		   unsigned char value,
+		   size_t length);
+extern void
+rle_encoder_finish(struct rle_encoder* encoder);
+extern void
+rle_encoder_deinitialize(struct rle_encoder* encoder);
+extern void
+rle_decoder_initialize(struct rle_decoder* decoder,
+		       const unsigned char* input,
+		       size_t inputLength);
+extern int
+rle_decoder_get(struct rle_decoder* decoder,
+		unsigned char* data,
+		size_t length);
+extern size_t
+rle_decoder_peekrun(struct rle_decoder* decoder,
+		    unsigned char* value);
+extern int
+rle_decoder_isfinished(struct rle_decoder* decoder);
+
+#endif /* RLE_H */
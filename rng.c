@@ -0,0 +1,181 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "util.h"
+#include "rng.h"
+
+#define rng_philox_m0		0xD2511F53U
+#define rng_philox_m1		0xCD9E8D57U
+#define rng_philox_w0		0x9E3779B9U
+#define rng_philox_w1		0xBB67AE85U
+#define rng_philox_rounds	10
+
+static unsigned long long rng_seed = 0;
+
+static uint64_t
+rng_mix(uint64_t x) {
+  
+  /*
+   * The splitmix64 finaliser, to turn seeds and stream numbers into
+   * well distributed keys and ids
+   */
+  
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return(x ^ (x >> 31));
+}
+
+void
+rng_setseed(unsigned long long seed) {
+  rng_seed = seed;
+}
+
+unsigned long long
+rng_getseed(void) {
+  return(rng_seed);
+}
+
+void
+rng_stream(struct rngstream* stream,
+	   enum rngpurpose purpose,
+	   unsigned long long id) {
+  rng_seedstream(stream,rng_seed,purpose,id);
+}
+
+void
+rng_seedstream(struct rngstream* stream,
+	       unsigned long long seed,
+	       enum rngpurpose purpose,
+	       unsigned long long id) {
+  uint64_t key = rng_mix(rng_mix(seed) ^ (uint64_t)purpose);
+  memset(stream,0,sizeof(*stream));
+  stream->key[0] = (uint32_t)key;
+  stream->key[1] = (uint32_t)(key >> 32);
+  stream->counter[2] = (uint32_t)id;
+  stream->counter[3] = (uint32_t)(id >> 32);
+  stream->nused = 4;
+}
+
+void
+rng_substream(struct rngstream* stream,
+	      const struct rngstream* parent,
+	      unsigned long long id) {
+  uint64_t parentid = ((uint64_t)parent->counter[3] << 32) | parent->counter[2];
+  uint64_t childid = rng_mix(parentid ^ rng_mix(id));
+  memset(stream,0,sizeof(*stream));
+  stream->key[0] = parent->key[0];
+  stream->key[1] = parent->key[1];
+  stream->counter[2] = (uint32_t)childid;
+  stream->counter[3] = (uint32_t)(childid >> 32);
+  stream->nused = 4;
+}
+
+void
+rng_philox(const uint32_t counter[4],
+	   const uint32_t key[2],
+	   uint32_t result[4]) {
+  
+  uint32_t c0 = counter[0];
+  uint32_t c1 = counter[1];
+  uint32_t c2 = counter[2];
+  uint32_t c3 = counter[3];
+  uint32_t k0 = key[0];
+  uint32_t k1 = key[1];
+  unsigned int round;
+  
+  for (round = 0; round < rng_philox_rounds; round++) {
+    uint64_t p0 = (uint64_t)rng_philox_m0 * c0;
+    uint64_t p1 = (uint64_t)rng_philox_m1 * c2;
+    c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    c1 = (uint32_t)p1;
+    c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    c3 = (uint32_t)p0;
+    k0 += rng_philox_w0;
+    k1 += rng_philox_w1;
+  }
+  
+  result[0] = c0;
+  result[1] = c1;
+  result[2] = c2;
+  result[3] = c3;
+}
+
+static void
+rng_nextblock(struct rngstream* stream,
+	      uint32_t result[4]) {
+  rng_philox(stream->counter,stream->key,result);
+  if (++stream->counter[0] == 0) stream->counter[1]++;
+}
+
+void
+rng_fill(struct rngstream* stream,
+	 uint32_t* values,
+	 size_t n) {
+  
+  /*
+   * Use up the current block first, then encrypt whole blocks
+   * straight into the result
+   */
+  
+  while (n > 0 && stream->nused < 4) {
+    *values++ = stream->block[stream->nused++];
+    n--;
+  }
+  while (n >= 4) {
+    rng_nextblock(stream,values);
+    values += 4;
+    n -= 4;
+  }
+  while (n > 0) {
+    *values++ = rng_next(stream);
+    n--;
+  }
+}
+
+uint32_t
+rng_next(struct rngstream* stream) {
+  if (stream->nused == 4) {
+    rng_nextblock(stream,stream->block);
+    stream->nused = 0;
+  }
+  return(stream->block[stream->nused++]);
+}
+
+unsigned int
+rng_below(struct rngstream* stream,
+	  unsigned int n) {
+  return((unsigned int)(((uint64_t)rng_next(stream) * n) >> 32));
+}
+
+double
+rng_uniform(struct rngstream* stream) {
+  return(rng_next(stream) * (1.0 / 4294967296.0));
+}
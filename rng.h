@@ -0,0 +1,88 @@
+
+/*
+ * **************************************************************************
+ * ****************************                     *************************
+ * ***************************  D R O P T R A C E R  ************************
+ * ****************************                     *************************
+ * **************************************************************************
+ * *******      *****    *****  **    *************      ***    ****  *******
+ * ****          ***      ***   **      *********        ***     **      ****
+ * *              *        *    **        *****          **      **         *
+ *                         *     O         ***           **       *
+ *                         o               ***           **       *
+ *                                          *             *
+ *                                          o             *
+ *                                                        o
+ *                                          o
+ *
+ *
+ *                          Cave Forms Simulation Software
+ *                                Jari Arkko, 2018
+ *
+ *                      https://github.com/jariarkko/drop-tracer
+ *                              License: BSD 3-Clause
+ *
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Random numbers from the Philox4x32-10 counter-based generator. The
+ * numbers of a stream are the encryptions of consecutive counter
+ * values, so a stream has no hidden state beyond its key and
+ * counter, and any number of independent streams can be derived from
+ * the --seed of the run. Each drop and each crack has its own stream,
+ * so the results do not depend on the order in which they are
+ * processed.
+ */
+
+enum rngpurpose {
+  rngpurpose_crack = 1,                    /* creating cracks in the rock */
+  rngpurpose_drop = 2                      /* placing and moving a drop */
+};
+
+struct rngstream {
+  uint32_t key[2];
+  uint32_t counter[4];                     /* block number in 0-1, stream id in 2-3 */
+  uint32_t block[4];                       /* numbers of the current block */
+  unsigned int nused;                      /* how many of them have been used */
+};
+
+extern void
+rng_setseed(unsigned long long seed);
+extern unsigned long long
+rng_getseed(void);
+extern void
+rng_stream(struct rngstream* stream,
+	   enum rngpurpose purpose,
+	   unsigned long long id);
+extern void
+rng_seedstream(struct rngstream* stream,
+	       unsigned long long seed,
+	       enum rngpurpose purpose,
+	       unsigned long long id);
+extern void
+rng_substream(struct rngstream* stream,
+	      const struct rngstream* parent,
+	      unsigned long long id);
+extern void
+rng_philox(const uint32_t counter[4],
+	   const uint32_t key[2],
+	   uint32_t result[4]);
+extern void
+rng_fill(struct rngstream* stream,
+	 uint32_t* values,
+	 size_t n);
+extern uint32_t
+rng_next(struct rngstream* stream);
+extern unsigned int
+rng_below(struct rngstream* stream,
+	  unsigned int n);
+extern double
+rng_uniform(struct rngstream* stream);
+
+#endif /* RNG_H */
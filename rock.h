@@ -51,6 +51,7 @@ phymodel_initialize_rock(unsigned int freeSpaceAboveRock,
 			 unsigned int fractalCardinality,
 			 enum crackdirection direction,
 			 int cave,
+			 enum phymodellayout layout,
 			 unsigned int unit,
 			 unsigned int xSize,
 			 unsigned int ySize,
@@ -65,6 +66,14 @@ phymodel_set_rock_material(struct phymodel* model,
 			   unsigned int y,
 			   unsigned int z);
 extern void
+phymodel_set_rock_material_box(struct phymodel* model,
+			       unsigned int startX,
+			       unsigned int endX,
+			       unsigned int startY,
+			       unsigned int endY,
+			       unsigned int startZ,
+			       unsigned int endZ);
+extern void
 phymodel_set_rock_crackmaterial(struct phymodel* model,
 				unsigned int x,
 				unsigned int y,
@@ -147,38 +147,80 @@ phymodel_initialize_rock_cavetunnel(struct phymodel* model,
 	 wallthickness);
   debugf("ellipse distance %f (out of %ux%u)", ellipsedistance, model->xSize, model->ySize);
   
-  for (y = 0; y < model->ySize; y++) {
-
-    for (z = startZ; z < model->zSize; z++) {
-
-      double ellipsedistancehere = ellipseddistancesperz[z];
-      unsigned int x;
+  /*
+   * The cave cross-section is the same for every y, so determine the
+   * rock/air mask of one (x,z) plane first.
+   */
+  
+  unsigned char* rockmask = (unsigned char*)malloc((size_t)model->xSize * (model->zSize - startZ));
+  if (rockmask == 0) {
+    fatalu("cannot allocate space for cave cross-section of entries", model->zSize - startZ);
+    return;
+  }
+  
+  for (z = startZ; z < model->zSize; z++) {
+    
+    double ellipsedistancehere = ellipseddistancesperz[z];
+    unsigned char* maskrow = rockmask + (size_t)(z - startZ) * model->xSize;
+    unsigned int x;
+    
+    for (x = 0; x < model->xSize; x++) {
       
-      for (x = 0; x < model->xSize; x++) {
+      if (x < wallthickness ||
+	  x >= model->xSize - wallthickness ||
+	  z >= model->zSize - wallthickness) {
+	
+	maskrow[x] = 1;
+	
+      } else {
+	
+	double distancetoleft = phymodel_distance2d(x,z,horizontalleftcenter,verticalcenter);
+	double distancetorigth = phymodel_distance2d(x,z,horizontalrightcenter,verticalcenter);
+	double totaldistance = distancetoleft + distancetorigth;
+	maskrow[x] = (totaldistance > ellipsedistancehere);
 	
-	if (x < wallthickness ||
-	    x >= model->xSize - wallthickness ||
-	    z >= model->zSize - wallthickness) {
-	  
-	  phymodel_set_rock_material(model,x,y,z);
-	  
-	} else {
-	  
-	  double distancetoleft = phymodel_distance2d(x,z,horizontalleftcenter,verticalcenter);
-	  double distancetorigth = phymodel_distance2d(x,z,horizontalrightcenter,verticalcenter);
-	  double totaldistance = distancetoleft + distancetorigth;
-	  if (totaldistance > ellipsedistancehere) {
-	    phymodel_set_rock_material(model,x,y,z);
-	  }
-	  
+      }
+    }
+  }
+  
+  /*
+   * Then draw the mask one row of bricks at a time, filling each run of
+   * rock across the whole row at once.
+   */
+  
+  for (y = 0; y < model->ySize; y = (y | phymodel_brickmask) + 1) {
+    
+    unsigned int endY = (y | phymodel_brickmask) + 1;
+    if (endY > model->ySize) endY = model->ySize;
+    
+    for (z = startZ; z < model->zSize; z++) {
+      
+      const unsigned char* maskrow = rockmask + (size_t)(z - startZ) * model->xSize;
+      unsigned int x = 0;
+      
+      while (x < model->xSize) {
+	unsigned int runstart;
+	while (x < model->xSize && !maskrow[x]) x++;
+	runstart = x;
+	while (x < model->xSize && maskrow[x]) x++;
+	if (x > runstart) {
+	  phymodel_set_rock_material_box(model,runstart,x,y,endY,z,z + 1);
 	}
       }
     }
+    
+    /*
+     * Walls are solid and the cave interior is air, so most of the
+     * bricks in a completed row of bricks are uniform.
+     */
+    
+    phymodel_compact_region(model,0,y,startZ,model->xSize,endY,model->zSize);
   }
 
   /*
    * Cleanup
    */
   
+  free(rockmask);
   free(ellipseddistancesperz);
 }
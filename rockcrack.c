@@ -29,12 +29,14 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "util.h"
+#include "rng.h"
 #include "phymodel.h"
 #include "image.h"
 #include "rock.h"
 
 static void
 phymodel_initialize_rock_simplecrack(struct phymodel* model,
+				     struct rngstream* rng,
 				     enum crackdirection direction,
 				     unsigned int startZ,
 				     unsigned int zThickness,
@@ -43,6 +45,7 @@ phymodel_initialize_rock_simplecrack(struct phymodel* model,
 				     unsigned int crackGrowthSteps);
 static void
 phymodel_initialize_rock_fractalcrack(struct phymodel* model,
+				      struct rngstream* rng,
 				      enum crackdirection direction,
 				      unsigned int startZ,
 				      unsigned int zThickness,
@@ -69,21 +72,21 @@ phymodel_initialize_rock(unsigned int freeSpaceAboveRock,
 			 unsigned int fractalCardinality,
 			 enum crackdirection direction,
 			 int cave,
+			 enum phymodellayout layout,
 			 unsigned int unit,
 			 unsigned int xSize,
 			 unsigned int ySize,
 			 unsigned int zSize) {
   
-  unsigned int x;
-  unsigned int y;
-  unsigned int z;
-  
   struct phymodel* model =
-    phymodel_create(unit,
+    phymodel_create(layout,
+		    unit,
 		    xSize,
 		    ySize,
 		    zSize);
+  struct rngstream rng;
   if (model == 0) return(0);
+  rng_stream(&rng,rngpurpose_crack,0);
 
   debugf("initializing rock...");
   debugf("phymodel_initialize_rock param1 %u param2 %u param3 %f param4 %u",
@@ -94,13 +97,10 @@ phymodel_initialize_rock(unsigned int freeSpaceAboveRock,
    * Fill the entire model with rock to the designated thickness
    */
   
-  for (z = freeSpaceAboveRock; z < freeSpaceAboveRock + rockThickness && z < model->zSize; z++) {
-    for (y = 0; y < model->ySize; y++) {
-      for (x = 0; x < model->xSize; x++) {
-	phymodel_set_rock_material(model,x,y,z);
-      }
-    }
-  }
+  phymodel_set_rock_material_box(model,
+				 0,model->xSize,
+				 0,model->ySize,
+				 freeSpaceAboveRock,freeSpaceAboveRock + rockThickness);
   
   /*
    * Clean out the crack
@@ -108,7 +108,7 @@ phymodel_initialize_rock(unsigned int freeSpaceAboveRock,
   
   switch (style) {
   case rockinitialization_simplecrack:
-    phymodel_initialize_rock_simplecrack(model,direction,
+    phymodel_initialize_rock_simplecrack(model,&rng,direction,
 					 freeSpaceAboveRock,
 					 rockThickness,
 					 uniform,
@@ -117,6 +117,7 @@ phymodel_initialize_rock(unsigned int freeSpaceAboveRock,
     break;
   case rockinitialization_fractalcrack:
     phymodel_initialize_rock_fractalcrack(model,
+					  &rng,
 					  direction,
 					  freeSpaceAboveRock,
 					  rockThickness,
@@ -153,6 +154,12 @@ phymodel_initialize_rock(unsigned int freeSpaceAboveRock,
     
   }
   
+  /*
+   * Release the bricks that ended up uniform
+   */
+  
+  phymodel_compact(model);
+  
   /*
    * Done
    */
@@ -174,7 +181,8 @@ struct crackstep {
 static unsigned int nonUniformCrackWidthSteps = 5;
 
 static void
-phymodel_initialize_rock_calculatecrackwidth_step(unsigned nSteps,
+phymodel_initialize_rock_calculatecrackwidth_step(struct rngstream* rng,
+						  unsigned nSteps,
 						  unsigned int space,
 						  unsigned int maxwidth,
 						  struct crackstep* steps) {
@@ -183,12 +191,15 @@ phymodel_initialize_rock_calculatecrackwidth_step(unsigned nSteps,
   unsigned int i;
   unsigned int usespace = space > 1 ? space/2 : space;
   unsigned int usemaxwidth = maxwidth > 1 ? maxwidth/2 : maxwidth;
+  uint32_t random[2 * maxNonUniformCrackWidthSteps];
   
   debugf("  calculating crack width with %u steps in a space of %u units, maxwidth %u", nSteps, space, maxwidth);
   
+  assert(nSteps <= maxNonUniformCrackWidthSteps);
+  rng_fill(rng,random,2 * nSteps);
   for (i = 0; i < nSteps; i++) {
-    unsigned int thisSpace = space > 0 ? 1 + (rand() % usespace) : 0;
-    unsigned int thisStep = maxwidth > 0 ? 1 + (rand() % usemaxwidth) : 0;
+    unsigned int thisSpace = space > 0 ? 1 + (unsigned int)(((uint64_t)random[2*i] * usespace) >> 32) : 0;
+    unsigned int thisStep = maxwidth > 0 ? 1 + (unsigned int)(((uint64_t)random[2*i+1] * usemaxwidth) >> 32) : 0;
     if (0) debugf("    %uth step is %u units further from center and step size is %u units",
 		  i, thisSpace, thisStep);
     steps[i].length = thisSpace;
@@ -215,7 +226,8 @@ phymodel_initialize_rock_calculatecrackwidth_stepwidth(unsigned int nSteps,
 }
 
 static struct crackwidthentry*
-phymodel_initialize_rock_calculatecrackwidth(unsigned int length,
+phymodel_initialize_rock_calculatecrackwidth(struct rngstream* rng,
+					     unsigned int length,
 					     unsigned int width,
 					     int uniform,
 					     unsigned int crackWidth,
@@ -259,10 +271,10 @@ phymodel_initialize_rock_calculatecrackwidth(unsigned int length,
 	   length,
 	   nonUniformCrackWidthSteps);
     
-    phymodel_initialize_rock_calculatecrackwidth_step(nonUniformCrackWidthSteps,length/2,halfcrackwidthleft,stepsleftup);
-    phymodel_initialize_rock_calculatecrackwidth_step(nonUniformCrackWidthSteps,length/2,halfcrackwidthleft,stepsleftdown);
-    phymodel_initialize_rock_calculatecrackwidth_step(nonUniformCrackWidthSteps,length/2,halfcrackwidthright,stepsrightup);
-    phymodel_initialize_rock_calculatecrackwidth_step(nonUniformCrackWidthSteps,length/2,halfcrackwidthright,stepsrightdown);
+    phymodel_initialize_rock_calculatecrackwidth_step(rng,nonUniformCrackWidthSteps,length/2,halfcrackwidthleft,stepsleftup);
+    phymodel_initialize_rock_calculatecrackwidth_step(rng,nonUniformCrackWidthSteps,length/2,halfcrackwidthleft,stepsleftdown);
+    phymodel_initialize_rock_calculatecrackwidth_step(rng,nonUniformCrackWidthSteps,length/2,halfcrackwidthright,stepsrightup);
+    phymodel_initialize_rock_calculatecrackwidth_step(rng,nonUniformCrackWidthSteps,length/2,halfcrackwidthright,stepsrightdown);
     
     for (i = 0; i < length; i++) {
       if (i < length/2) {
@@ -301,6 +313,7 @@ phymodel_initialize_rock_calculatecrackwidth(unsigned int length,
 
 static void
 phymodel_initialize_rock_simplecrack(struct phymodel* model,
+				     struct rngstream* rng,
 				     enum crackdirection direction,
 				     unsigned int startZ,
 				     unsigned int zThickness,
@@ -315,7 +328,8 @@ phymodel_initialize_rock_simplecrack(struct phymodel* model,
   unsigned int length = crackdirection_is_y(direction) ? model->ySize : model->xSize;
   unsigned int width = crackdirection_is_y(direction) ? model->xSize : model->ySize;
   struct crackwidthentry* widthtable =
-    phymodel_initialize_rock_calculatecrackwidth(length,
+    phymodel_initialize_rock_calculatecrackwidth(rng,
+						 length,
 						 width,
 						 uniform,
 						 crackWidth,
@@ -379,6 +393,7 @@ phymodel_initialize_rock_simplecrack(struct phymodel* model,
 
 static void
 phymodel_initialize_rock_fractalcrack(struct phymodel* model,
+				      struct rngstream* rng,
 				      enum crackdirection direction,
 				      unsigned int startZ,
 				      unsigned int zThickness,
@@ -404,7 +419,8 @@ phymodel_initialize_rock_fractalcrack(struct phymodel* model,
 	 crackWidth, crackGrowthSteps, fractalShrink, fractalCardinality);
   
   struct crackwidthentry* widthtable =
-    phymodel_initialize_rock_calculatecrackwidth(length,
+    phymodel_initialize_rock_calculatecrackwidth(rng,
+						 length,
 						 width,
 						 uniform,
 						 crackWidth,
@@ -446,11 +462,12 @@ phymodel_initialize_rock_fractalcrack(struct phymodel* model,
       unsigned int i;
       debugf("  generate %u fractal side cracks", fractalCardinality);
       for (i = 0; i < fractalCardinality; i++) {
-	unsigned int atLength = rand() % length;
+	unsigned int atLength = rng_below(rng,length);
 	if (widthtable[atLength].crackwidth == 0) {
 	  i--;
 	  continue;
 	} else {
+	  struct rngstream siderng;
 	  unsigned int center = length/2;
 	  int difffromcenter = center - atLength;
 	  unsigned int awayfromcenter = difffromcenter < 0 ? -difffromcenter : difffromcenter;
@@ -463,7 +480,9 @@ phymodel_initialize_rock_fractalcrack(struct phymodel* model,
 	  unsigned int crackWidthRedux = (unsigned int)(((double)crackWidth) * fractalShrink * awayfromcenterRedux);
 	  debugf("    %uth fractal side crack is at length %u, diff to center %d, away from center %u (redux %f), crackwidth %u->%u",
 		 i, atLength, difffromcenter, awayfromcenter, awayfromcenterRedux, crackWidth, crackWidthRedux);
+	  rng_substream(&siderng,rng,i);
 	  phymodel_initialize_rock_fractalcrack(model,
+						&siderng,
 						crackdirection_x,
 						startZ,
 						zThickness,
@@ -511,11 +530,12 @@ phymodel_initialize_rock_fractalcrack(struct phymodel* model,
       unsigned int i;
       debugf("  generate %u fractal side cracks", fractalCardinality);
       for (i = 0; i < fractalCardinality; i++) {
-	unsigned int atLength = rand() % length;
+	unsigned int atLength = rng_below(rng,length);
 	if (widthtable[atLength].crackwidth == 0) {
 	  i--;
 	  continue;
 	} else {
+	  struct rngstream siderng;
 	  unsigned int center = length/2;
 	  int difffromcenter = center - atLength;
 	  unsigned int awayfromcenter = difffromcenter < 0 ? -difffromcenter : difffromcenter;
@@ -528,7 +548,9 @@ phymodel_initialize_rock_fractalcrack(struct phymodel* model,
 	  unsigned int crackWidthRedux = (unsigned int)(((double)crackWidth) * fractalShrink * awayfromcenterRedux);
 	  debugf("    %uth fractal side crack is at length %u, diff to center %d, away from center %u (redux %f), crackwidth %u->%u",
 		 i, atLength, difffromcenter, awayfromcenter, awayfromcenterRedux, crackWidth, crackWidthRedux);
+	  rng_substream(&siderng,rng,i);
 	  phymodel_initialize_rock_fractalcrack(model,
+						&siderng,
 						crackdirection_y,
 						startZ,
 						zThickness,
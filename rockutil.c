@@ -32,17 +32,33 @@
 #include "phymodel.h"
 #include "rock.h"
 
+static phyatom
+phymodel_rock_atom(void) {
+  phyatom atom = 0;
+  struct rgb rgb;
+  phyatom_set_mat(&atom,material_rock);
+  rgb_set_white(&rgb);
+  phyatom_set_color(&atom,&rgb);
+  return(atom);
+}
+
 void
 phymodel_set_rock_material(struct phymodel* model,
 			   unsigned int x,
 			   unsigned int y,
 			   unsigned int z) {
-  unsigned int atomindex = phymodel_atomindex(model,x,y,z);
-  phyatom* atom = &model->atoms[atomindex];
-  struct rgb rgb;
-  phyatom_set_mat(atom,material_rock);
-  rgb_set_white(&rgb);
-  phyatom_set_color(atom,&rgb);
+  phymodel_setatom(model,x,y,z,phymodel_rock_atom());
+}
+
+void
+phymodel_set_rock_material_box(struct phymodel* model,
+			       unsigned int startX,
+			       unsigned int endX,
+			       unsigned int startY,
+			       unsigned int endY,
+			       unsigned int startZ,
+			       unsigned int endZ) {
+  phymodel_fillbox(model,startX,endX,startY,endY,startZ,endZ,phymodel_rock_atom());
 }
 
 void
@@ -50,9 +66,9 @@ phymodel_set_rock_crackmaterial(struct phymodel* model,
 				unsigned int x,
 				unsigned int y,
 				unsigned int z) {
-  unsigned int atomindex = phymodel_atomindex(model,x,y,z);
-  phyatom* atom = &model->atoms[atomindex];
-  phyatom_set_mat(atom,material_air);
+  phyatom atom = *phymodel_getatom_readonly(model,x,y,z);
+  phyatom_set_mat(&atom,material_air);
+  phymodel_setatom(model,x,y,z,atom);
 }
 
 void
@@ -26,37 +26,101 @@
 
 #include <math.h>
 #include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include "util.h"
+#include "parallel.h"
 #include "phymodel.h"
 #include "drop.h"
 #include "droptable.h"
+#include "eventqueue.h"
+#include "phases.h"
 #include "simul.h"
 #include "image.h"
 
+struct simulatorensemblejob {
+  const struct phymodel* base;
+  unsigned long long seed;
+  unsigned long long simulRounds;
+  unsigned int simulDropFrequency;
+  unsigned int simulDropSize;
+  const char* outputPattern;
+  struct simulatorstate* members;
+};
+
+struct simulatorstatistic {
+  const char* name;
+  size_t offset;                /* of the counter in struct simulatorstate */
+};
+
+static const struct simulatorstatistic simulator_statistics[] = {
+  { "successfully created drops", offsetof(struct simulatorstate,successfullyCreatedDrops) },
+  { "unable to allocate", offsetof(struct simulatorstate,failedDropAllocations) },
+  { "unable to find a hole", offsetof(struct simulatorstate,failedDropHoleFinding) },
+  { "found hole not free", offsetof(struct simulatorstate,failedDropHoleFree) },
+  { "spin-off drop not free", offsetof(struct simulatorstate,failedSpinoffDropSpaceFinding) },
+  { "rounds with events", offsetof(struct simulatorstate,eventRounds) },
+  { "drop movements", offsetof(struct simulatorstate,dropMovements) },
+  { "drops fallen off the model", offsetof(struct simulatorstate,dropFellOffModels) },
+  { "atom creations", offsetof(struct simulatorstate,atomCreations) },
+  { "atom movements", offsetof(struct simulatorstate,atomMovements) },
+  { "spin-off drops created", offsetof(struct simulatorstate,spinOffDrops) },
+  { "drops merged", offsetof(struct simulatorstate,mergedDrops) },
+  { "drops put to sleep", offsetof(struct simulatorstate,dropSleeps) },
+  { "drops woken up", offsetof(struct simulatorstate,dropWakeups) },
+  { "awake drops in rounds", offsetof(struct simulatorstate,awakeDrops) },
+  { "rounds planned in parallel", offsetof(struct simulatorstate,parallelRounds) },
+  { "moves planned in parallel", offsetof(struct simulatorstate,plannedDrops) },
+  { "calcite atoms deposited", offsetof(struct simulatorstate,calciteAtoms) }
+};
+
+static int simulator_sleep = 1;         /* 0 = keep all drops awake */
+
+struct simulatorplanjob {
+  struct phymodel* model;
+  struct simulatordrop** drops;
+  unsigned int ndrops;
+};
+
+static void
+simulator_simulate_moves(struct simulatorstate* state,
+			 struct phymodel* model);
+static void
+simulator_simulate_planjob(unsigned int index,
+			   void* data);
 static void
-simulator_simulate_round(struct simulatorstate* state,
-			 struct phymodel* model,
-			 unsigned int simulDropSize,
-			 unsigned int startingLevel,
-			 int drop);
+simulator_ensemble_memberjob(unsigned int index,
+			     void* data);
+static char*
+simulator_numberedfilename(const char* pattern,
+			   unsigned long long number);
 static void
 simulator_simulate_drop(struct simulatorstate* state,
 			struct phymodel* model,
 			unsigned int simulDropSize,
 			unsigned int startingLevel);
 static void
+simulator_run(struct simulatorstate* state,
+	      struct phymodel* model,
+	      unsigned long long seed,
+	      unsigned long long simulRounds,
+	      unsigned int simulDropFrequency,
+	      unsigned int simulDropSize,
+	      const char* progressImage);
+static void
 simulator_state_initialize(struct simulatorstate* state,
-			   struct phymodel* model);
+			   struct phymodel* model,
+			   unsigned long long seed);
 static void
 simulator_state_deinitialize(struct simulatorstate* state,
 			     struct phymodel* model);
 static void
 simulator_find_randomdropplaceanddirection(struct simulatorstate* state,
 					   struct phymodel* model,
+					   struct rngstream* rng,
 					   struct atomcoordinates* dropplace,
 					   enum direction* direction,
 					   unsigned int startingLevel);
@@ -78,90 +142,388 @@ simulator_move_dropintohole(struct simulatorstate* state,
 static void
 simulator_stats(struct simulatorstate* state,
 		struct phymodel* model);
+static void
+simulator_phasestats(const struct simulatorphasetimes* phases);
+static void
+simulator_writestats(const char* filename,
+		     const struct simulatorstate* members,
+		     unsigned int nmembers,
+		     unsigned long long nanoseconds,
+		     const struct simulatorphasetimes* phases);
 static unsigned int
 simulator_find_startinglevel(struct phymodel* model);
 static void
 simulator_snapshot(struct phymodel* model,
-                   unsigned int roundno,
+                   unsigned long long roundno,
                    const char* progressImage);
 
+void
+simulator_setsleep(int sleep) {
+  simulator_sleep = sleep;
+}
+
 void
 simulator_simulate(struct phymodel* model,
-		   unsigned int simulRounds,
+		   unsigned long long simulRounds,
 		   unsigned int simulDropFrequency,
 		   unsigned int simulDropSize,
-		   const char* progressImage) {
-
+		   const char* progressImage,
+		   const char* statsFile) {
+  
   struct simulatorstate state;
-  unsigned int round;
+  struct simulatorphasetimes before;
+  struct simulatorphasetimes phases;
+  
+  simulator_phase_collect(&before);
+  simulator_run(&state,
+		model,
+		rng_getseed(),
+		simulRounds,
+		simulDropFrequency,
+		simulDropSize,
+		progressImage);
+  simulator_phase_since(&phases,&before);
+  simulator_stats(&state,model);
+  simulator_phasestats(&phases);
+  if (statsFile != 0) {
+    simulator_writestats(statsFile,&state,1,state.nanoseconds,&phases);
+  }
+  simulator_state_deinitialize(&state,model);
+}
+
+void
+simulator_ensemble(const struct phymodel* base,
+		   unsigned int nmembers,
+		   unsigned long long seed,
+		   unsigned long long simulRounds,
+		   unsigned int simulDropFrequency,
+		   unsigned int simulDropSize,
+		   const char* outputPattern,
+		   const char* statsFile) {
+  
+  struct simulatorensemblejob job;
+  struct simulatorphasetimes before;
+  struct simulatorphasetimes phases;
+  uint64_t start;
+  uint64_t nanoseconds;
+  unsigned int i;
+  unsigned int j;
+  
+  assert(nmembers > 0);
+  job.base = base;
+  job.seed = seed;
+  job.simulRounds = simulRounds;
+  job.simulDropFrequency = simulDropFrequency;
+  job.simulDropSize = simulDropSize;
+  job.outputPattern = outputPattern;
+  job.members = (struct simulatorstate*)malloc(nmembers * sizeof(struct simulatorstate));
+  if (job.members == 0) {
+    fatalu("cannot allocate simulator states for ensemble members", nmembers);
+    return;
+  }
+  
+  /*
+   * Run the members in parallel, each in one thread
+   */
+  
+  debugf("simulating an ensemble of %u members with seeds %llu..%llu",
+	 nmembers, seed, seed + nmembers - 1);
+  simulator_phase_collect(&before);
+  start = simulator_phase_now();
+  parallel_for(nmembers,simulator_ensemble_memberjob,&job);
+  nanoseconds = simulator_phase_now() - start;
+  simulator_phase_since(&phases,&before);
+  
+  /*
+   * Report the statistics over all members
+   */
+  
+  printf("ensemble of %u members, seeds %llu..%llu, %llu rounds each\n",
+	 nmembers, seed, seed + nmembers - 1, simulRounds);
+  printf("%-30s %14s %14s %14s\n", "", "min", "mean", "max");
+  for (j = 0; j < sizeof(simulator_statistics) / sizeof(simulator_statistics[0]); j++) {
+    unsigned long long min = ~0ULL;
+    unsigned long long max = 0;
+    double sum = 0.0;
+    for (i = 0; i < nmembers; i++) {
+      unsigned long long value =
+	*(const unsigned long long*)((const char*)&job.members[i] + simulator_statistics[j].offset);
+      if (value < min) min = value;
+      if (value > max) max = value;
+      sum += value;
+    }
+    printf("%-30s %14llu %14.1f %14llu\n",
+	   simulator_statistics[j].name, min, sum / nmembers, max);
+  }
+  
+  simulator_phasestats(&phases);
+  if (statsFile != 0) {
+    simulator_writestats(statsFile,job.members,nmembers,nanoseconds,&phases);
+  }
+  for (i = 0; i < nmembers; i++) {
+    debugf("ensemble member %u with seed %llu:", i, seed + i);
+    simulator_stats(&job.members[i],0);
+    simulator_state_deinitialize(&job.members[i],0);
+  }
+  free(job.members);
+}
 
-  simulator_state_initialize(&state,model);
-  debugf("simulating %u rounds...", simulRounds);
-  debugf("simulator state size %u, one drop size %u, max %u drops, max %u atoms per drop...",
-	 sizeof(state),
+static void
+simulator_ensemble_memberjob(unsigned int index,
+			     void* data) {
+  
+  struct simulatorensemblejob* job = (struct simulatorensemblejob*)data;
+  struct phymodel* model = phymodel_overlay(job->base);
+  char* filename = simulator_numberedfilename(job->outputPattern,index);
+  
+  simulator_run(&job->members[index],
+		model,
+		job->seed + index,
+		job->simulRounds,
+		job->simulDropFrequency,
+		job->simulDropSize,
+		0);
+  debugf("ensemble member %u has %zu of its own bricks, writing %s",
+	 index, model->nallocatedbricks, filename);
+  phymodel_write(model,filename);
+  phymodel_destroy(model);
+  free(filename);
+}
+
+static void
+simulator_run(struct simulatorstate* state,
+	      struct phymodel* model,
+	      unsigned long long seed,
+	      unsigned long long simulRounds,
+	      unsigned int simulDropFrequency,
+	      unsigned int simulDropSize,
+	      const char* progressImage) {
+
+  struct simulatoreventqueue queue;
+  struct simulatorevent event;
+  unsigned long long nextmoves = 0;
+  unsigned long long lastround = 0;
+  uint64_t runstart = simulator_phase_now();
+  uint64_t start;
+
+  /*
+   * The state is left initialised for the caller to read the
+   * statistics from
+   */
+  
+  simulator_state_initialize(state,model,seed);
+  simulator_eventqueue_initialize(&queue);
+  debugf("simulating %llu rounds...", simulRounds);
+  debugf("simulator state size %u, one drop size %u, %u drops per block...",
+	 sizeof(*state),
 	 sizeof(struct simulatordrop),
-	 simulatordroptable_maxdrops,
-	 simulatorstate_maxatomsperdrop);
+	 simulatordroptable_blockdrops);
+
+  /*
+   * The atoms of drops are stored with packed coordinates
+   */
+  
+  if (model->xSize > atomcoordinates_packmax ||
+      model->ySize > atomcoordinates_packmax ||
+      model->zSize > atomcoordinates_packmax) {
+    fatalu("cannot simulate models larger than atoms in any direction", atomcoordinates_packmax);
+  }
 
   unsigned int startingLevel = simulator_find_startinglevel(model);
+  simulator_entryindex_initialize(&state->entries,model,startingLevel);
+  
+  /*
+   * Drops that cannot move sleep until the model changes next to them
+   */
+  
+  phymodel_enableepochs(model);
+  
+  /*
+   * Falling drops find where they land from the solid columns, and
+   * whether they are held by rock on their side from the rock-beside
+   * masks. Like the bit-planes, these are not kept for sparse models,
+   * which may be too large for one bit per atom.
+   */
+  
+  if (model->layout != phymodellayout_sparse) {
+    phymodel_enablesolidcolumns(model);
+    phymodel_enablerockbeside(model);
+  }
   
   if (progressImage) {
+    start = simulator_phase_now();
     simulator_snapshot(model,0,progressImage);
+    simulator_phase_add(simulatorphase_snapshot,start);
+  }
+  
+  /*
+   * Rather than stepping through every round, jump from one event to
+   * the next. Drops are created every simulDropFrequency rounds, and
+   * the drops are moved only in rounds after which there are awake
+   * drops or changes that may wake sleeping ones; the other rounds
+   * would not do anything. Progress images are still written after
+   * every round.
+   */
+  
+  simulator_eventqueue_schedule(&queue,0,simulatorevent_createdrop);
+  if (progressImage) {
+    simulator_eventqueue_schedule(&queue,0,simulatorevent_snapshot);
   }
   
-  for (round = 0; round < simulRounds; round++) {
-    int drop = ((round % simulDropFrequency) == 0);
-    debugf("simulation round %u (drop %u)", round, drop);
-    simulator_simulate_round(&state,model,simulDropSize,startingLevel,drop);
-    if (progressImage) {
-      simulator_snapshot(model,round+1,progressImage);
+  while (simulator_eventqueue_next(&queue,&event)) {
+    
+    assert(event.round < simulRounds);
+    switch (event.type) {
+      
+    case simulatorevent_movedrops:
+      debugf("simulation round %llu moves drops", event.round);
+      start = simulator_phase_now();
+      simulator_simulate_moves(state,model);
+      simulator_phase_add(simulatorphase_movedrops,start);
+      break;
+      
+    case simulatorevent_createdrop:
+      debugf("simulation round %llu creates a drop", event.round);
+      start = simulator_phase_now();
+      simulator_simulate_drop(state,
+			      model,
+			      simulDropSize,
+			      startingLevel);
+      simulator_phase_add(simulatorphase_createdrop,start);
+      if (simulRounds - event.round > simulDropFrequency) {
+	simulator_eventqueue_schedule(&queue,event.round + simulDropFrequency,simulatorevent_createdrop);
+      }
+      break;
+      
+    case simulatorevent_snapshot:
+      start = simulator_phase_now();
+      simulator_snapshot(model,event.round+1,progressImage);
+      simulator_phase_add(simulatorphase_snapshot,start);
+      if (event.round + 1 < simulRounds) {
+	simulator_eventqueue_schedule(&queue,event.round + 1,simulatorevent_snapshot);
+      }
+      break;
+      
+    default:
+      fatal("invalid simulator event type");
+      break;
+      
+    }
+    
+    if (state->eventRounds == 0 || event.round != lastround) {
+      lastround = event.round;
+      state->eventRounds++;
     }
+    
+    /*
+     * The next round moves the drops if there is anything to move
+     * or wake
+     */
+    
+    if ((state->drops.nactive > 0 || model->ndirtybricks > 0) &&
+	event.round + 1 < simulRounds &&
+	nextmoves != event.round + 1) {
+      nextmoves = event.round + 1;
+      simulator_eventqueue_schedule(&queue,nextmoves,simulatorevent_movedrops);
+    }
+    
   }
-
+  
+  state->rounds = simulRounds;
+  state->nanoseconds = simulator_phase_now() - runstart;
   debugf("simulation complete");
-  simulator_stats(&state,model);
-  simulator_state_deinitialize(&state,model);
+  simulator_eventqueue_deinitialize(&queue);
+  phymodel_disableepochs(model);
+  phymodel_disablesolidcolumns(model);
+  phymodel_disablerockbeside(model);
 }
 
 static void
-simulator_simulate_round(struct simulatorstate* state,
-			 struct phymodel* model,
-			 unsigned int simulDropSize,
-			 unsigned int startingLevel,
-			 int drop) {
+simulator_simulate_moves(struct simulatorstate* state,
+			 struct phymodel* model) {
 
   /*
-   * First, move all current drops if they can be moved.
+   * First, wake the sleeping drops next to which the model changed in
+   * the previous round, and start tracking the changes of this round.
    */
   
-  unsigned int i;
+  unsigned int i = 0;
+  
+  state->dropWakeups += simulator_droptable_wakechanged(&state->drops,model);
+  phymodel_nextepoch(model);
+  state->awakeDrops += state->drops.nactive;
   
-  for (i = 0; i < state->drops.ndrops; i++) {
-    struct simulatordrop* drop = &state->drops.drops[i];
-    if (drop->active) {
-      simulator_drop_movedrop(model,state,drop);
-      if (!drop->active) {
-	state->dropFellOffModels++;
-      } else {
-	state->dropMovements++;
-	state->atomMovements += drop->natoms;
-      }
-    }
-  }
-
   /*
-   * Then, create a new drop if we're told to
+   * Plan the moves of many drops in parallel; the plans only read the
+   * model. A drop next to which an earlier drop changes the model is
+   * planned again when it is its turn to move.
    */
   
-  if (drop) {
-    simulator_simulate_drop(state,
-			    model,
-			    simulDropSize,
-			    startingLevel);
+  if (state->drops.nactive >= simulator_parallelmindrops && parallel_nthreads() > 1) {
+    struct simulatorplanjob job;
+    job.model = model;
+    job.drops = state->drops.active;
+    job.ndrops = state->drops.nactive;
+    parallel_for((job.ndrops + simulator_plandrops - 1) / simulator_plandrops,
+		 simulator_simulate_planjob,
+		 &job);
+    state->parallelRounds++;
+    state->plannedDrops += job.ndrops;
   }
   
-  state->rounds++;
+  /*
+   * Then, move all awake drops if they can be moved. A drop that
+   * cannot move, or whose move changes nothing, goes to sleep; it
+   * would do the same in later rounds until the atoms next to it
+   * change.
+   */
   
+  while (i < state->drops.nactive) {
+    
+    struct simulatordrop* drop = state->drops.active[i];
+    
+    if (drop->movedepoch == model->epoch) {
+      i++;
+      continue;
+    }
+    drop->movedepoch = model->epoch;
+    state->drops.firstunlisted = state->drops.nactive;
+    if (!simulator_drop_movedrop(model,state,drop)) {
+      if (simulator_sleep) {
+	simulator_droptable_sleep(&state->drops,model,drop,simulator_drop_reach(drop));
+	state->dropSleeps++;
+      }
+    } else if (!drop->active) {
+      state->dropFellOffModels++;
+    } else {
+      state->dropMovements++;
+      state->atomMovements += drop->natoms;
+    }
+    
+    /*
+     * A drop that is deleted or put to sleep is replaced by the last
+     * awake drop, which may not yet have moved in this round. When
+     * that happens behind this drop, as when this drop merges into
+     * one that has already moved, go back to the replaced place; the
+     * drops that have moved are skipped.
+     */
+    
+    if (state->drops.firstunlisted < i) i = state->drops.firstunlisted;
+  }
+
+}
+
+static void
+simulator_simulate_planjob(unsigned int index,
+			   void* data) {
+  struct simulatorplanjob* job = (struct simulatorplanjob*)data;
+  unsigned int start = index * simulator_plandrops;
+  unsigned int end = start + simulator_plandrops;
+  unsigned int i;
+  if (end > job->ndrops) end = job->ndrops;
+  for (i = start; i < end; i++) {
+    simulator_drop_planmove(job->model,job->drops[i]);
+  }
 }
 
 static void
@@ -180,7 +542,7 @@ simulator_simulate_drop(struct simulatorstate* state,
     drop->calcite = 1.0;
     rgb_set_white(&drop->calcitecolor);
     debugf("placing a new drop from level %u", startingLevel);
-    simulator_find_randomdropplaceanddirection(state,model,&dropplace,&direction,startingLevel);
+    simulator_find_randomdropplaceanddirection(state,model,&drop->rng,&dropplace,&direction,startingLevel);
     deepdebugf("found initial drop location (%u,%u,%u)", dropplace.x, dropplace.y, dropplace.z);
     if (!simulator_move_dropuntilholeandchangedirection(state,model,&dropplace,direction)) {
       state->failedDropHoleFinding++;
@@ -201,27 +563,33 @@ simulator_simulate_drop(struct simulatorstate* state,
 
 static void
 simulator_state_initialize(struct simulatorstate* state,
-			   struct phymodel* model) {
+			   struct phymodel* model,
+			   unsigned long long seed) {
   memset(state,0,sizeof(*state));
   simulator_droptable_initialize(&state->drops);
+  simulator_calcite_initialize(&state->calcite);
+  state->drops.seed = seed;
 }
 
 static void
 simulator_state_deinitialize(struct simulatorstate* state,
 			     struct phymodel* model) {
-  simulator_droptable_initialize(&state->drops);
+  simulator_droptable_deinitialize(&state->drops);
+  simulator_entryindex_deinitialize(&state->entries);
+  simulator_calcite_deinitialize(&state->calcite);
   memset(state,0xFF,sizeof(*state));
 }
 
 static void
 simulator_find_randomdropplaceanddirection(struct simulatorstate* state,
 					   struct phymodel* model,
+					   struct rngstream* rng,
 					   struct atomcoordinates* dropplace,
 					   enum direction* direction,
 					   unsigned int startingLevel) {
-  *direction = rand() % (int)(direction_howmany);
-  dropplace->x = rand() % model->xSize;
-  dropplace->y = rand() % model->ySize;
+  *direction = (enum direction)rng_below(rng,direction_howmany);
+  dropplace->x = rng_below(rng,model->xSize);
+  dropplace->y = rng_below(rng,model->ySize);
   dropplace->z = startingLevel;
 }
 
@@ -261,6 +629,15 @@ simulator_move_dropuntilhole(struct simulatorstate* state,
 			     struct atomcoordinates* place,
 			     enum direction direction) {
 
+  /*
+   * At the starting level, the entry index knows the nearest free
+   * atom without scanning
+   */
+  
+  if (place->z == state->entries.level) {
+    return(simulator_entryindex_findhole(&state->entries,model,place,direction));
+  }
+  
   switch (direction) {
 
   case direction_x_towards0:
@@ -348,6 +725,7 @@ simulator_move_dropintohole(struct simulatorstate* state,
     if (simulator_drop_putdrop(model,place,drop)) {
       
       state->atomCreations += drop->natoms;
+      simulator_drop_mergetouching(model,state,drop);
       return(1);
       
     } else {
@@ -372,10 +750,110 @@ simulator_stats(struct simulatorstate* state,
   debugf("    found hole not free:         %8llu", state->failedDropHoleFree);
   debugf("    spin-off drop not free:      %8llu", state->failedSpinoffDropSpaceFinding);
   debugf("    rounds:                      %8llu", state->rounds);
+  debugf("    rounds with events:          %8llu", state->eventRounds);
   debugf("    drop movements:              %8llu", state->dropMovements);
   debugf("    atom creations:              %8llu", state->atomCreations);
   debugf("    atom movements:              %8llu", state->atomMovements);
   debugf("    spin-off drops created:      %8llu", state->spinOffDrops);
+  debugf("    drops merged:                %8llu", state->mergedDrops);
+  debugf("    drops put to sleep:          %8llu", state->dropSleeps);
+  debugf("    drops woken up:              %8llu", state->dropWakeups);
+  debugf("    awake drops in rounds:       %8llu", state->awakeDrops);
+  debugf("    rounds planned in parallel:  %8llu", state->parallelRounds);
+  debugf("    moves planned in parallel:   %8llu", state->plannedDrops);
+  debugf("    calcite atoms deposited:     %8llu", state->calciteAtoms);
+  debugf("    bricks receiving calcite:    %8zu", state->calcite.nbricks);
+  debugf("    entry segments indexed:      %8llu", state->entries.rebuilds);
+  debugf("    drops awake at the end:      %8u", state->drops.nactive);
+  debugf("    drops asleep at the end:     %8u", state->drops.nsleeping);
+  debugf("    seconds:                     %12.3f", state->nanoseconds / 1e9);
+}
+
+static void
+simulator_phasestats(const struct simulatorphasetimes* phases) {
+  unsigned int i;
+  debugf("  phase                         calls     seconds");
+  for (i = 0; i < simulatorphase_howmany; i++) {
+    debugf("    %-24s %10llu %11.3f",
+	   simulator_phase_name((enum simulatorphase)i),
+	   (unsigned long long)phases->calls[i],
+	   phases->nanoseconds[i] / 1e9);
+  }
+}
+
+static void
+simulator_writestats(const char* filename,
+		     const struct simulatorstate* members,
+		     unsigned int nmembers,
+		     unsigned long long nanoseconds,
+		     const struct simulatorphasetimes* phases) {
+  
+  const unsigned int nstatistics = sizeof(simulator_statistics) / sizeof(simulator_statistics[0]);
+  double seconds = nanoseconds / 1e9;
+  unsigned long long rounds = 0;
+  unsigned int i;
+  unsigned int j;
+  FILE* f;
+  
+  assert(nmembers > 0);
+  f = fopen(filename,"w");
+  if (f == 0) {
+    fatals("cannot open statistics file",filename);
+    return;
+  }
+  for (i = 0; i < nmembers; i++) rounds += members[i].rounds;
+  
+  /*
+   * The counters, as such for one simulation and over the members
+   * of an ensemble
+   */
+  
+  fprintf(f,"{\n");
+  fprintf(f,"  \"simulations\": %u,\n", nmembers);
+  fprintf(f,"  \"rounds\": %llu,\n", rounds);
+  fprintf(f,"  \"seconds\": %.6f,\n", seconds);
+  fprintf(f,"  \"rounds per second\": %.1f,\n", seconds > 0.0 ? rounds / seconds : 0.0);
+  fprintf(f,"  \"counters\": {\n");
+  for (j = 0; j < nstatistics; j++) {
+    const char* separator = (j + 1 < nstatistics) ? "," : "";
+    if (nmembers == 1) {
+      unsigned long long value =
+	*(const unsigned long long*)((const char*)&members[0] + simulator_statistics[j].offset);
+      fprintf(f,"    \"%s\": %llu%s\n", simulator_statistics[j].name, value, separator);
+    } else {
+      unsigned long long min = ~0ULL;
+      unsigned long long max = 0;
+      double sum = 0.0;
+      for (i = 0; i < nmembers; i++) {
+	unsigned long long value =
+	  *(const unsigned long long*)((const char*)&members[i] + simulator_statistics[j].offset);
+	if (value < min) min = value;
+	if (value > max) max = value;
+	sum += value;
+      }
+      fprintf(f,"    \"%s\": { \"min\": %llu, \"mean\": %.1f, \"max\": %llu }%s\n",
+	      simulator_statistics[j].name, min, sum / nmembers, max, separator);
+    }
+  }
+  fprintf(f,"  },\n");
+  
+  /*
+   * The phases, over all threads
+   */
+  
+  fprintf(f,"  \"phases\": {\n");
+  for (i = 0; i < simulatorphase_howmany; i++) {
+    fprintf(f,"    \"%s\": { \"calls\": %llu, \"seconds\": %.6f }%s\n",
+	    simulator_phase_name((enum simulatorphase)i),
+	    (unsigned long long)phases->calls[i],
+	    phases->nanoseconds[i] / 1e9,
+	    (i + 1 < simulatorphase_howmany) ? "," : "");
+  }
+  fprintf(f,"  }\n");
+  fprintf(f,"}\n");
+  if (fclose(f) != 0) {
+    fatals("cannot write statistics file",filename);
+  }
 }
 
 static unsigned int
@@ -383,40 +861,51 @@ simulator_find_startinglevel(struct phymodel* model) {
   const unsigned int xplace = 0;
   const unsigned int yplace = 0;
   unsigned int z = 0;
-  phyatom* atom = phymodel_getatom(model,xplace,yplace,z);
   while (z < model->zSize) {
+    const phyatom* atom = phymodel_getatom_readonly(model,xplace,yplace,z);
     if (phyatom_mat(atom) == material_rock) {
       debugf("simulator_find_startinglevel: %u", z);
       return(z);
     } else {
       z++;
-      atom = phymodel_getatom(model,xplace,yplace,z);
     }
   }
   fatal("cannot find rock starting level from the top");
   return(0);
 }
 
+static char*
+simulator_numberedfilename(const char* pattern,
+			   unsigned long long number) {
+  
+  /*
+   * Replace the percent sign in the pattern with the number
+   */
+  
+  assert(pattern != 0);
+  assert(index(pattern,'%') != 0);
+  const size_t numlen = 20;
+  size_t len = strlen(pattern) + numlen;
+  char* filename = (char*)malloc(len);
+  if (filename == 0) {
+    fatals("cannot allocate memory for file name",pattern);
+    return(0);
+  }
+  memset(filename,0,len);
+  const char* percentLocation = index(pattern,'%');
+  assert(percentLocation != 0);
+  unsigned int beforePercent = percentLocation - pattern;
+  memcpy(filename,pattern,beforePercent);
+  snprintf(filename+beforePercent,len-beforePercent-1,"%llu%s",number,percentLocation+1);
+  return(filename);
+}
+
 static void
 simulator_snapshot(struct phymodel* model,
-                   unsigned int roundno,
+                   unsigned long long roundno,
                    const char* progressImage) {
 
-  assert(progressImage != 0);
-  assert(index(progressImage,'%') != 0);
-  const size_t numlen = 20;
-  size_t len = strlen(progressImage) + numlen;
-  char* tempfile = (char*)malloc(len);
-  if (tempfile == 0) {
-    fatals("cannot allocate memory for file name",progressImage);
-    return;
-  }
-  memset(tempfile,0,len);
-  const char* percentLocation = index(progressImage,'%');
-  assert(percentLocation != 0);
-  unsigned int beforePercent = percentLocation - progressImage;
-  memcpy(tempfile,progressImage,beforePercent);
-  snprintf(tempfile+beforePercent,len-beforePercent-1,"%u%s",roundno,percentLocation+1);
+  char* tempfile = simulator_numberedfilename(progressImage,roundno);
   image_modely2image(model,
 		     model->ySize / 2,
 		     tempfile);
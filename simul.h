@@ -29,6 +29,21 @@
 
 #include "drop.h"
 #include "droptable.h"
+#include "entryindex.h"
+#include "calcite.h"
+
+/*
+ * The moves of the awake drops are planned in parallel, in pieces of
+ * simulator_plandrops drops, when there are at least
+ * simulator_parallelmindrops of them. Planning a move takes tens of
+ * microseconds, mostly for finding where a falling drop lands, and
+ * handing out the pieces about a microsecond, so already two drops
+ * are worth planning in parallel. The moves themselves are made one
+ * drop at a time, in the same order as without threads.
+ */
+
+#define simulator_plandrops		1
+#define simulator_parallelmindrops	2
 
 struct simulatorstate {
   unsigned long long successfullyCreatedDrops;
@@ -37,19 +52,43 @@ struct simulatorstate {
   unsigned long long failedDropHoleFree;
   unsigned long long failedSpinoffDropSpaceFinding;
   unsigned long long rounds;
+  unsigned long long eventRounds;
   unsigned long long dropMovements;
   unsigned long long dropFellOffModels;
   unsigned long long atomCreations;
   unsigned long long atomMovements;
   unsigned long long spinOffDrops;
+  unsigned long long mergedDrops;
+  unsigned long long dropSleeps;
+  unsigned long long dropWakeups;
+  unsigned long long awakeDrops;         /* summed over the rounds */
+  unsigned long long parallelRounds;
+  unsigned long long plannedDrops;
+  unsigned long long calciteAtoms;
+  unsigned long long nanoseconds;       /* of running the simulation */
   struct simulatordroptable drops;
+  struct simulatorentryindex entries;
+  struct simulatorcalcitefield calcite;
 };
 
+extern void
+simulator_setsleep(int sleep);
 extern void
 simulator_simulate(struct phymodel* model,
-		   unsigned int simulRounds,
+		   unsigned long long simulRounds,
+		   unsigned int simulDropFrequency,
+		   unsigned int simulDropSize,
+		   const char* progressImage,
+		   const char* statsFile);
+
+extern void
+simulator_ensemble(const struct phymodel* base,
+		   unsigned int nmembers,
+		   unsigned long long seed,
+		   unsigned long long simulRounds,
 		   unsigned int simulDropFrequency,
 		   unsigned int simulDropSize,
-		   const char* progressImage);
+		   const char* outputPattern,
+		   const char* statsFile);
 
 #endif /* SIMUL_H */
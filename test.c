@@ -30,22 +30,91 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "util.h"
+#include "parallel.h"
 #include "phymodel.h"
+#include "rle.h"
+#include "droptable.h"
 #include "image.h"
 #include "coords.h"
+#include "eventqueue.h"
+#include "entryindex.h"
+#include "calcite.h"
+#include "phases.h"
+#include "rng.h"
 
 static void atomtests(void);
 static void phymodeltests(void);
 static void circlemaptests(void);
+static void layouttests(void);
+static void sparsetests(void);
+static void compressiontests(void);
+static void writetests(void);
+static void bitplanetests(void);
+static void solidcolumntests(void);
+static void rockbesidetests(void);
+static void surfacetests(void);
+static void surfacetestsaux(struct phymodel* model);
+static void surfacetestsatom(unsigned int x,
+			     unsigned int y,
+			     unsigned int z,
+			     struct phymodel* model,
+			     const phyatom* atom,
+			     void* data);
+static int rockbesidescan(struct phymodel* model,
+			  unsigned int x,
+			  unsigned int y,
+			  unsigned int z);
+static void segmenttests(void);
+static void paralleltests(void);
+static void paralleltestspiece(unsigned int index,
+			       void* data);
+static void droptabletests(void);
+static void dropplantests(void);
+static void eventqueuetests(void);
+static void calcitetests(void);
+static void phasetests(void);
+static void phasetestsaux(unsigned int index,
+			  void* data);
+static void entryindextests(void);
+static int entryindexscan(struct phymodel* model,
+			  struct atomcoordinates* place,
+			  enum direction direction);
+static void rngtests(void);
+static void largefiletests(void);
 
 int
 main(int argc,
      char** argv) {
-  if (argc > 1) debug = 1;
+  int largefile = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i],"--large-file") == 0) largefile = 1;
+    else debug = 1;
+  }
   atomtests();
   phymodeltests();
   circlemaptests();
+  layouttests();
+  sparsetests();
+  compressiontests();
+  writetests();
+  bitplanetests();
+  solidcolumntests();
+  rockbesidetests();
+  surfacetests();
+  segmenttests();
+  paralleltests();
+  droptabletests();
+  dropplantests();
+  eventqueuetests();
+  calcitetests();
+  phasetests();
+  entryindextests();
+  rngtests();
+  if (largefile) largefiletests();
   exit(0);
 }
 
@@ -128,7 +197,7 @@ phymodeltests(void) {
 }
 
 static unsigned int ntab;
-static struct atomcoordinates tab[100];
+static struct atomcoordinates tab[1000];
 
 static void
 circlemaptestsaux(unsigned int x,
@@ -164,8 +233,8 @@ circlemapteststabstring() {
 static void
 circlemaptests(void) {
   
-  struct phymodel* m1 = phymodel_create(1,3,3,3);
-  struct phymodel* m2 = phymodel_create(1,10,10,10);
+  struct phymodel* m1 = phymodel_create(phymodellayout_linear,1,3,3,3);
+  struct phymodel* m2 = phymodel_create(phymodellayout_linear,1,10,10,10);
   const char* string;
 
   /*
@@ -210,4 +279,1341 @@ circlemaptests(void) {
   string = circlemapteststabstring();
   debugf("tab = %s", string);
   assert(strcmp(string,"(0,0,0),(0,0,1),(0,0,2),(0,1,0),(0,1,1),(0,1,2),(0,2,0),(0,2,1),(0,2,2),(1,0,0),(1,0,1),(1,0,2),(1,1,0),(1,1,2),(1,2,0),(1,2,1),(1,2,2),(2,0,0),(2,0,1),(2,0,2),(2,1,0),(2,1,1),(2,1,2),(2,2,0),(2,2,1),(2,2,2)") == 0);
+  
+  /*
+   * Shells, which are the same as the atoms at each distance in a
+   * large enough model, and together cover the whole cube
+   */
+  
+  {
+    const struct phymodelshell* shell;
+    unsigned int distance;
+    size_t total = 0;
+    size_t i;
+    for (distance = 0; distance <= 4; distance++) {
+      shell = phymodel_shell(distance);
+      assert(shell == phymodel_shell(distance));
+      assert(shell->distance == distance);
+      ntab = 0;
+      phymodel_mapatoms_atdistance3d(m2,5,5,5,distance,circlemaptestsaux,(void*)0);
+      assert(ntab == shell->noffsets);
+      for (i = 0; i < shell->noffsets; i++) {
+	assert(tab[i].x == 5 + shell->offsets[i].x);
+	assert(tab[i].y == 5 + shell->offsets[i].y);
+	assert(tab[i].z == 5 + shell->offsets[i].z);
+      }
+      total += shell->noffsets;
+    }
+    assert(phymodel_shell(0)->noffsets == 1);
+    assert(phymodel_shell(1)->noffsets == 26);
+    for (distance = 5; distance <= 20; distance++) {
+      total += phymodel_shell(distance)->noffsets;
+    }
+    assert(total > 19*19*19*4 && total < 41*41*41);
+  }
+}
+
+static void
+layouttests(void) {
+  
+  struct phymodel* m1 = phymodel_create(phymodellayout_bricked,1,20,17,35);
+  struct phymodel* m2;
+  unsigned char* seen;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+
+  /*
+   * The bricked model is padded to full bricks, and every atom has
+   * its own place in it
+   */
+  
+  assert(m1->xBricks == 2);
+  assert(m1->yBricks == 2);
+  assert(m1->zBricks == 3);
+  assert(m1->natoms == 2*2*3*phymodel_brickatoms);
+  assert(phymodel_atomindex(m1,0,0,0) == 0);
+  assert(phymodel_atomindex(m1,1,0,0) == 1);
+  assert(phymodel_atomindex(m1,0,1,0) == phymodel_brickedge);
+  assert(phymodel_atomindex(m1,0,0,1) == phymodel_brickedge * phymodel_brickedge);
+  assert(phymodel_atomindex(m1,phymodel_brickedge,0,0) == phymodel_brickatoms);
+  seen = (unsigned char*)malloc(m1->natoms);
+  assert(seen != 0);
+  memset(seen,0,m1->natoms);
+  for (z = 0; z < m1->zSize; z++) {
+    for (y = 0; y < m1->ySize; y++) {
+      for (x = 0; x < m1->xSize; x++) {
+	size_t index = phymodel_atomindex(m1,x,y,z);
+	assert(index < m1->natoms);
+	assert(seen[index] == 0);
+	seen[index] = 1;
+	if ((x + 2*y + 3*z) % 7 == 0) {
+	  phyatom_set_mat(phymodel_getatom(m1,x,y,z),material_rock);
+	}
+      }
+    }
+  }
+  free(seen);
+
+  /*
+   * Converting to the linear layout keeps the atoms
+   */
+  
+  m2 = phymodel_relayout(m1,phymodellayout_linear);
+  assert(m2->layout == phymodellayout_linear);
+  assert(m2->natoms == 20*17*35);
+  for (z = 0; z < m1->zSize; z++) {
+    for (y = 0; y < m1->ySize; y++) {
+      for (x = 0; x < m1->xSize; x++) {
+	assert(phymodel_atommat(m2,x,y,z) == ((x + 2*y + 3*z) % 7 == 0 ? material_rock : material_air));
+	assert(*phymodel_getatom(m1,x,y,z) == *phymodel_getatom(m2,x,y,z));
+      }
+    }
+  }
+  phymodel_destroy(m1);
+  phymodel_destroy(m2);
+
+  /*
+   * Walking atoms at a distance gives the same results in both layouts
+   */
+
+  m1 = phymodel_create(phymodellayout_bricked,1,10,10,10);
+  ntab = 0;
+  phymodel_mapatoms_atdistance3d(m1,1,1,1,1,circlemaptestsaux,(void*)0);
+  assert(strcmp(circlemapteststabstring(),"(0,0,0),(0,0,1),(0,0,2),(0,1,0),(0,1,1),(0,1,2),(0,2,0),(0,2,1),(0,2,2),(1,0,0),(1,0,1),(1,0,2),(1,1,0),(1,1,2),(1,2,0),(1,2,1),(1,2,2),(2,0,0),(2,0,1),(2,0,2),(2,1,0),(2,1,1),(2,1,2),(2,2,0),(2,2,1),(2,2,2)") == 0);
+  phymodel_destroy(m1);
+}
+
+static void
+sparsetests(void) {
+
+  struct phymodel* m1;
+  struct phymodel* m2;
+  struct phymodel* o1;
+  struct phymodel* o2;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  phyatom rock = 0;
+  const char* filename = "test.sparse.mod";
+  
+  phyatom_set_mat(&rock,material_rock);
+
+  /*
+   * A fresh sparse model has no bricks, and reading or writing the
+   * value it already has does not allocate any
+   */
+  
+  m1 = phymodel_create(phymodellayout_sparse,1,40,33,20);
+  assert(m1->layout == phymodellayout_sparse);
+  assert(m1->nbricks == 3*3*2);
+  assert(m1->nallocatedbricks == 0);
+  assert(phymodel_atommat(m1,39,32,19) == material_air);
+  phymodel_setatom(m1,5,5,5,0);
+  assert(m1->nallocatedbricks == 0);
+  phymodel_setatom(m1,5,5,5,rock);
+  assert(m1->nallocatedbricks == 1);
+  assert(phymodel_atommat(m1,5,5,5) == material_rock);
+  assert(phymodel_atommat(m1,5,5,6) == material_air);
+
+  /*
+   * Filling a brick with rock and compacting releases it again
+   */
+  
+  for (z = 16; z < 20; z++) {
+    for (y = 16; y < 32; y++) {
+      for (x = 32; x < 40; x++) {
+	phymodel_setatom(m1,x,y,z,rock);
+      }
+    }
+  }
+  assert(m1->nallocatedbricks == 2);
+  phymodel_compact(m1);
+  assert(m1->nallocatedbricks == 1);
+  assert(phymodel_atommat(m1,39,31,19) == material_rock);
+  assert(phymodel_atommat(m1,39,32,19) == material_air);
+  phymodel_compact_region(m1,0,0,0,16,16,16);
+  assert(m1->nallocatedbricks == 1);
+  phymodel_setatom(m1,5,5,5,0);
+  phymodel_compact_region(m1,0,0,0,1,1,1);
+  assert(m1->nallocatedbricks == 0);
+  
+  /*
+   * Sparse models are written as bricked files
+   */
+  
+  phymodel_setatom(m1,1,2,3,rock);
+  phymodel_write(m1,filename);
+  m2 = phymodel_read(filename,phymodelaccess_readonly);
+  assert(m2->layout == phymodellayout_bricked);
+  for (z = 0; z < m1->zSize; z++) {
+    for (y = 0; y < m1->ySize; y++) {
+      for (x = 0; x < m1->xSize; x++) {
+	assert(*phymodel_getatom_readonly(m1,x,y,z) == *phymodel_getatom_readonly(m2,x,y,z));
+      }
+    }
+  }
+  phymodel_destroy(m1);
+  
+  /*
+   * Converting back to sparse only keeps the mixed bricks
+   */
+  
+  m1 = phymodel_relayout(m2,phymodellayout_sparse);
+  assert(m1->nallocatedbricks == 1);
+  assert(phymodel_atommat(m1,1,2,3) == material_rock);
+  assert(phymodel_atommat(m1,35,20,17) == material_rock);
+  assert(phymodel_atommat(m1,35,20,15) == material_air);
+  
+  /*
+   * Overlays share the bricks of the base, and copy a brick when
+   * it is first written to
+   */
+  
+  o1 = phymodel_overlay(m1);
+  o2 = phymodel_overlay(m2);
+  assert(o1->nallocatedbricks == 0);
+  assert(phymodel_atommat(o1,1,2,3) == material_rock);
+  assert(phymodel_atommat(o1,35,20,17) == material_rock);
+  phymodel_setatom(o1,1,2,4,rock);
+  phymodel_setatom(o1,1,2,3,0);
+  phymodel_setatom(o1,35,20,15,rock);
+  assert(o1->nallocatedbricks == 2);
+  assert(phymodel_atommat(o1,1,2,4) == material_rock);
+  assert(phymodel_atommat(o1,1,2,3) == material_air);
+  assert(phymodel_atommat(m1,1,2,4) == material_air);
+  assert(phymodel_atommat(m1,1,2,3) == material_rock);
+  assert(phymodel_atommat(m1,35,20,15) == material_air);
+  phymodel_setatom(o2,39,32,19,rock);
+  assert(o2->nallocatedbricks == 1);
+  assert(phymodel_atommat(o2,39,32,19) == material_rock);
+  assert(phymodel_atommat(m2,39,32,19) == material_air);
+  assert(phymodel_atommat(o2,1,2,3) == material_rock);
+  phymodel_destroy(o1);
+  phymodel_destroy(o2);
+  assert(phymodel_atommat(m1,1,2,3) == material_rock);
+  assert(phymodel_atommat(m2,1,2,3) == material_rock);
+  phymodel_destroy(m1);
+  phymodel_destroy(m2);
+  unlink(filename);
+}
+
+static void
+compressiontests(void) {
+
+  struct rle_encoder encoder;
+  struct rle_decoder decoder;
+  unsigned char input[1000];
+  unsigned char output[1000];
+  unsigned char value;
+  struct phymodel* m1;
+  struct phymodel* m2;
+  struct phymodel* m3;
+  phyatom rock = 0;
+  enum phymodellayout layout;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  unsigned int i;
+  const char* filename = "test.chunked.mod";
+  
+  /*
+   * Run-length codec round trip, with a run longer than 127 that
+   * needs a multi-byte length
+   */
+  
+  for (i = 0; i < sizeof(input); i++) input[i] = (i < 300 ? 7 : (i / 5) % 3);
+  rle_encoder_initialize(&encoder);
+  rle_encoder_add(&encoder,input,500);
+  rle_encoder_addrun(&encoder,input[499],0);
+  rle_encoder_add(&encoder,input + 500,500);
+  rle_encoder_finish(&encoder);
+  assert(encoder.length < sizeof(input));
+  assert(encoder.buffer[0] == (300 & 0x7F) + 0x80);
+  assert(encoder.buffer[1] == 300 >> 7);
+  assert(encoder.buffer[2] == 7);
+  rle_decoder_initialize(&decoder,encoder.buffer,encoder.length);
+  assert(rle_decoder_peekrun(&decoder,&value) == 300);
+  assert(value == 7);
+  assert(rle_decoder_get(&decoder,output,sizeof(output)));
+  assert(rle_decoder_isfinished(&decoder));
+  assert(memcmp(input,output,sizeof(input)) == 0);
+  rle_decoder_initialize(&decoder,encoder.buffer,encoder.length - 1);
+  assert(!rle_decoder_get(&decoder,output,sizeof(output)));
+  rle_encoder_deinitialize(&encoder);
+  
+  /*
+   * Compressed model files read back the same in all layouts, also
+   * into sparse models, and partially
+   */
+  
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+    m1 = phymodel_create(layout,1,20,17,35);
+    for (z = 0; z < m1->zSize; z++) {
+      for (y = 0; y < m1->ySize; y++) {
+	for (x = 0; x < m1->xSize; x++) {
+	  if (z >= 20 || (x + 2*y + 3*z) % 7 == 0) phymodel_setatom(m1,x,y,z,rock);
+	}
+      }
+    }
+    m1->format = phymodelformat_compressed;
+    phymodel_write(m1,filename);
+    m2 = phymodel_read(filename,phymodelaccess_readonly);
+    m3 = phymodel_read_sparse(filename);
+    assert(m2->format == phymodelformat_compressed);
+    assert(m2->layout == (layout == phymodellayout_linear ? phymodellayout_linear : phymodellayout_bricked));
+    assert(m3->layout == phymodellayout_sparse);
+    assert(m3->nallocatedbricks == 2*2*2);
+    for (z = 0; z < m1->zSize; z++) {
+      for (y = 0; y < m1->ySize; y++) {
+	for (x = 0; x < m1->xSize; x++) {
+	  assert(*phymodel_getatom_readonly(m1,x,y,z) == *phymodel_getatom_readonly(m2,x,y,z));
+	  assert(*phymodel_getatom_readonly(m1,x,y,z) == *phymodel_getatom_readonly(m3,x,y,z));
+	}
+      }
+    }
+    phymodel_destroy(m2);
+    phymodel_destroy(m3);
+    m2 = phymodel_read_region(filename,phymodelaccess_readonly,17,18);
+    assert(phymodel_atommat(m2,0,0,0) == material_air);
+    assert(phymodel_atommat(m2,0,0,21) == material_rock);
+    assert(phymodel_atommat(m2,0,0,33) == material_air);
+    phymodel_destroy(m1);
+    phymodel_destroy(m2);
+  }
+  unlink(filename);
+}
+
+static void
+writetests(void) {
+  
+  const char* filename = "test.write.mod";
+  const char* symlinkname = "test.write.symlink.mod";
+  const char* hardlinkname = "test.write.hardlink.mod";
+  struct phymodel* model;
+  struct phymodel* readback;
+  struct stat st;
+  phyatom rock = 0;
+  unsigned int i;
+  
+  /*
+   * Writing through a symbolic link or a hard link writes the file
+   * they lead to and keeps the links, also when the model is mapped
+   * from the same file through the symbolic link
+   */
+  
+  phyatom_set_mat(&rock,material_rock);
+  unlink(symlinkname);
+  unlink(hardlinkname);
+  model = phymodel_create(phymodellayout_bricked,1,20,20,20);
+  phymodel_write(model,filename);
+  phymodel_destroy(model);
+  assert(symlink(filename,symlinkname) == 0);
+  for (i = 0; i < 3; i++) {
+    model = (i == 2 ?
+	     phymodel_read(filename,phymodelaccess_private) :
+	     phymodel_create(phymodellayout_bricked,1,20,20,20));
+    phymodel_setatom(model,i,1,2,rock);
+    if (i == 1) {
+      assert(link(filename,hardlinkname) == 0);
+      phymodel_write(model,hardlinkname);
+    } else {
+      phymodel_write(model,symlinkname);
+    }
+    phymodel_destroy(model);
+    assert(lstat(symlinkname,&st) == 0 && S_ISLNK(st.st_mode));
+    readback = phymodel_read(filename,phymodelaccess_readonly);
+    assert(phymodel_atommat(readback,i,1,2) == material_rock);
+    assert(phymodel_atommat(readback,0,1,2) == (i == 0 ? material_rock : material_air));
+    assert(phymodel_atommat(readback,1,1,2) == (i == 0 ? material_air : material_rock));
+    phymodel_destroy(readback);
+    if (i == 1) {
+      readback = phymodel_read(hardlinkname,phymodelaccess_readonly);
+      assert(phymodel_atommat(readback,1,1,2) == material_rock);
+      phymodel_destroy(readback);
+      assert(stat(filename,&st) == 0 && st.st_nlink == 2);
+      unlink(hardlinkname);
+    }
+  }
+  unlink(symlinkname);
+  unlink(filename);
+}
+
+static void
+bitplanetests(void) {
+
+  struct phymodel* model;
+  enum phymodellayout layout;
+  unsigned int x;
+
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+
+    /*
+     * Rock at x = 3 and from x = 70 on, on a row of 150 atoms that
+     * spans three words
+     */
+    
+    model = phymodel_create(layout,1,150,3,3);
+    for (x = 70; x < model->xSize; x++) phymodel_setatommat(model,x,1,1,material_rock);
+    phymodel_setatommat(model,3,1,1,material_rock);
+    phymodel_enablebitplanes(model);
+    assert(model->bitplanerowwords == 3);
+    assert(phymodel_atomisfree(model,2,1,1));
+    assert(!phymodel_atomisfree(model,3,1,1));
+    assert(phymodel_freerun_forward(model,3,1,1,1000) == 66);
+    assert(phymodel_freerun_forward(model,3,1,1,10) == 10);
+    assert(phymodel_freerun_forward(model,3,1,2,1000) == 146);
+    assert(phymodel_freerun_backward(model,69,1,1,1000) == 65);
+    assert(phymodel_freerun_backward(model,3,1,1,1000) == 3);
+    assert(phymodel_freerun_backward(model,149,1,2,100) == 100);
+    assert(phymodel_rangeisfree(model,4,70,1,1));
+    assert(!phymodel_rangeisfree(model,4,71,1,1));
+    assert(phymodel_rangeisfree(model,0,150,1,0));
+
+    /*
+     * Changes are reflected in the bit-planes, and give the same
+     * answers as without them
+     */
+    
+    phymodel_setatommat(model,100,1,1,material_water);
+    phymodel_setatommat(model,70,1,1,material_air);
+    assert(phymodel_bitplaneword(model,material_water,100,1,1) & phymodel_bitplanebit(100));
+    assert(!phymodel_atomisfree(model,100,1,1));
+    assert(phymodel_freerun_forward(model,3,1,1,1000) == 67);
+    phymodel_disablebitplanes(model);
+    assert(phymodel_freerun_forward(model,3,1,1,1000) == 67);
+    assert(phymodel_freerun_backward(model,70,1,1,1000) == 66);
+    assert(!phymodel_rangeisfree(model,4,72,1,1));
+    phymodel_destroy(model);
+  }
+}
+
+static void
+solidcolumntests(void) {
+
+  struct phymodel* model;
+  enum phymodellayout layout;
+  phyatom rock = 0;
+  unsigned int z;
+  int pass;
+
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+
+    /*
+     * Rock at z = 3 and from z = 70 on, in a column of 150 atoms that
+     * spans three words
+     */
+    
+    model = phymodel_create(layout,1,20,3,150);
+    for (z = 70; z < model->zSize; z++) phymodel_setatommat(model,1,1,z,material_rock);
+    phymodel_setatommat(model,1,1,3,material_rock);
+    phymodel_enablesolidcolumns(model);
+    assert(model->solidcolumnwords == 3);
+    
+    /*
+     * The answers are the same with the columns, before and after
+     * their bricks have been built and changed, and without them
+     */
+    
+    assert(phymodel_nextsolid(model,1,1,0,1000) == 3);
+    assert(phymodel_nextsolid(model,1,1,3,1000) == 3);
+    assert(phymodel_nextsolid(model,1,1,4,150) == 70);
+    assert(phymodel_nextsolid(model,1,1,4,50) == 50);
+    assert(phymodel_nextsolid(model,1,2,0,150) == 150);
+    phymodel_setatommat(model,18,0,40,material_rock);
+    phymodel_setatommat(model,2,1,80,material_water);
+    phymodel_fillbox(model,0,20,0,3,120,130,rock);
+    phymodel_setatommat(model,1,2,125,material_air);
+    for (pass = 0; pass < 2; pass++) {
+      assert(phymodel_nextsolid(model,18,0,0,150) == 40);
+      assert(phymodel_nextsolid(model,2,1,0,150) == 80);
+      assert(phymodel_nextsolid(model,1,2,0,150) == 120);
+      assert(phymodel_nextsolid(model,1,2,125,150) == 126);
+      assert(phymodel_nextsolid(model,1,2,130,150) == 150);
+      if (pass == 0) phymodel_disablesolidcolumns(model);
+    }
+    phymodel_destroy(model);
+  }
+}
+
+static int
+rockbesidescan(struct phymodel* model,
+	       unsigned int x,
+	       unsigned int y,
+	       unsigned int z) {
+  int dx;
+  int dy;
+  for (dy = -1; dy <= 1; dy++) {
+    for (dx = -1; dx <= 1; dx++) {
+      int ax = (int)x + dx;
+      int ay = (int)y + dy;
+      if (dx == 0 && dy == 0) continue;
+      if (ax < 0 || ay < 0 || ax >= (int)model->xSize || ay >= (int)model->ySize) continue;
+      if (phymodel_atommat(model,ax,ay,z) == material_rock) return(1);
+    }
+  }
+  return(0);
+}
+
+static void
+rockbesidetests(void) {
+
+  struct phymodel* model;
+  enum phymodellayout layout;
+  phyatom rock = 0;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  int pass;
+
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+
+    /*
+     * Scattered rock and water in a model of several bricks in each
+     * direction, with the last bricks cut short
+     */
+    
+    model = phymodel_create(layout,1,40,35,20);
+    for (z = 0; z < model->zSize; z++) {
+      for (y = 0; y < model->ySize; y++) {
+	for (x = 0; x < model->xSize; x++) {
+	  unsigned int h = (x * 7 + y * 13 + z * 5) % 23;
+	  if (h == 0) phymodel_setatommat(model,x,y,z,material_rock);
+	  else if (h == 1) phymodel_setatommat(model,x,y,z,material_water);
+	}
+      }
+    }
+    phymodel_enablerockbeside(model);
+    
+    /*
+     * The masks agree with looking at the atoms around, also after
+     * rock has been added and removed at brick edges, and after the
+     * masks have been dropped
+     */
+    
+    for (pass = 0; pass < 3; pass++) {
+      for (z = 0; z < model->zSize; z++) {
+	for (y = 0; y < model->ySize; y++) {
+	  for (x = 0; x < model->xSize; x++) {
+	    assert(phymodel_hasrockbeside(model,x,y,z) == rockbesidescan(model,x,y,z));
+	  }
+	}
+      }
+      if (pass == 0) {
+	phymodel_setatommat(model,15,15,3,material_rock);
+	phymodel_setatommat(model,16,31,3,material_rock);
+	phymodel_setatommat(model,0,0,0,material_air);
+	phymodel_setatommat(model,39,34,19,material_rock);
+	phymodel_setatommat(model,20,20,7,material_water);
+	phymodel_fillbox(model,30,34,0,16,10,12,rock);
+	phymodel_fillbox(model,0,40,16,17,12,13,0);
+      } else if (pass == 1) {
+	phymodel_disablerockbeside(model);
+      }
+    }
+    phymodel_destroy(model);
+  }
+}
+
+static void
+surfacetestsatom(unsigned int x,
+		 unsigned int y,
+		 unsigned int z,
+		 struct phymodel* model,
+		 const phyatom* atom,
+		 void* data) {
+  size_t* count = (size_t*)data;
+  assert(phymodel_issurface(model,x,y,z));
+  assert(phyatom_mat(atom) != material_rock);
+  (*count)++;
+}
+
+static void
+surfacetestsaux(struct phymodel* model) {
+  
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  size_t natoms = 0;
+  size_t nmapped = 0;
+  
+  /*
+   * The surface is the atoms that are not rock but have rock on one
+   * of their six sides, and each of them is mapped once
+   */
+  
+  for (z = 0; z < model->zSize; z++) {
+    for (y = 0; y < model->ySize; y++) {
+      for (x = 0; x < model->xSize; x++) {
+	int surface =
+	  phymodel_atommat(model,x,y,z) != material_rock &&
+	  ((x > 0 && phymodel_atommat(model,x-1,y,z) == material_rock) ||
+	   (x + 1 < model->xSize && phymodel_atommat(model,x+1,y,z) == material_rock) ||
+	   (y > 0 && phymodel_atommat(model,x,y-1,z) == material_rock) ||
+	   (y + 1 < model->ySize && phymodel_atommat(model,x,y+1,z) == material_rock) ||
+	   (z > 0 && phymodel_atommat(model,x,y,z-1) == material_rock) ||
+	   (z + 1 < model->zSize && phymodel_atommat(model,x,y,z+1) == material_rock));
+	assert(phymodel_issurface(model,x,y,z) == surface);
+	if (surface) natoms++;
+      }
+    }
+  }
+  assert(model->surface->natoms == natoms);
+  phymodel_mapsurface(model,surfacetestsatom,&nmapped);
+  assert(nmapped == natoms);
+}
+
+static void
+surfacetests(void) {
+
+  struct phymodel* model;
+  enum phymodellayout layout;
+  phyatom rock = 0;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+
+    /*
+     * A block of rock, which leaves uniform bricks in the sparse
+     * layout, with scattered rock and water above it
+     */
+    
+    model = phymodel_create(layout,1,40,35,50);
+    phymodel_fillbox(model,0,40,0,35,32,50,rock);
+    for (z = 0; z < 32; z++) {
+      for (y = 0; y < model->ySize; y++) {
+	for (x = 0; x < model->xSize; x++) {
+	  unsigned int h = (x * 7 + y * 13 + z * 5) % 29;
+	  if (h == 0) phymodel_setatommat(model,x,y,z,material_rock);
+	  else if (h == 1) phymodel_setatommat(model,x,y,z,material_water);
+	}
+      }
+    }
+    phymodel_enablesurface(model);
+    surfacetestsaux(model);
+    
+    /*
+     * The surface follows rock being added and removed, also at brick
+     * edges and in bricks that had no surface
+     */
+    
+    phymodel_setatommat(model,15,15,3,material_rock);
+    phymodel_setatommat(model,16,31,16,material_rock);
+    phymodel_setatommat(model,39,34,0,material_rock);
+    phymodel_setatommat(model,20,20,40,material_air);
+    phymodel_setatommat(model,21,20,40,material_water);
+    phymodel_setatommat(model,5,5,5,material_water);
+    phymodel_fillbox(model,30,34,0,16,10,12,rock);
+    phymodel_fillbox(model,0,40,16,17,12,13,0);
+    phymodel_fillbox(model,2,6,2,6,45,48,0);
+    surfacetestsaux(model);
+    phymodel_destroy(model);
+  }
+}
+
+static void
+segmenttestsaux(unsigned int x,
+		unsigned int y,
+		unsigned int z,
+		unsigned int length,
+		const phyatom* atoms,
+		ptrdiff_t stride,
+		void* data) {
+  struct phymodel* model = (struct phymodel*)data;
+  unsigned int i;
+  for (i = 0; i < length; i++) {
+    assert(atoms[i * stride] == *phymodel_getatom_readonly(model,x,y,z + i));
+    ntab++;
+  }
+}
+
+static void
+segmenttests(void) {
+
+  struct phymodel* model;
+  enum phymodellayout layout;
+  const phyatom* atoms;
+  unsigned int length;
+  ptrdiff_t stride;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  phyatom rock = 0;
+  
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+    
+    /*
+     * Fill a box that covers whole bricks in the middle, and partial
+     * ones at the edges
+     */
+    
+    model = phymodel_create(layout,1,40,33,50);
+    phymodel_fillbox(model,3,40,0,33,16,48,rock);
+    for (z = 0; z < model->zSize; z++) {
+      for (y = 0; y < model->ySize; y++) {
+	for (x = 0; x < model->xSize; x++) {
+	  assert(phymodel_atommat(model,x,y,z) ==
+		 (x >= 3 && z >= 16 && z < 48 ? material_rock : material_air));
+	}
+      }
+    }
+    if (layout == phymodellayout_sparse) {
+      assert(model->nallocatedbricks == 3*2);
+    }
+    
+    /*
+     * Segments
+     */
+    
+    atoms = phymodel_segment(model,phymodelaxis_x,2,5,20,&length,&stride);
+    assert(stride == 1);
+    assert(length == (layout == phymodellayout_linear ? 38 : 14));
+    assert(phyatom_mat(atoms) == material_air);
+    assert(phyatom_mat(atoms + stride) == material_rock);
+    atoms = phymodel_segment(model,phymodelaxis_y,20,17,20,&length,&stride);
+    assert(length == (layout == phymodellayout_linear ? 16 : 15));
+    assert(stride == (layout == phymodellayout_linear ? 40 :
+		      layout == phymodellayout_bricked ? 16 : 0));
+    atoms = phymodel_segment(model,phymodelaxis_z,20,17,40,&length,&stride);
+    assert(length == (layout == phymodellayout_linear ? 10 : 8));
+    assert(phyatom_mat(atoms + 7 * stride) == material_rock);
+    ntab = 0;
+    phymodel_mapsegments(model,phymodelaxis_y,17,phymodelaxis_z,segmenttestsaux,model);
+    assert(ntab == 40*50);
+    phymodel_destroy(model);
+  }
+}
+
+static void
+paralleltestsaux(unsigned int x,
+		 unsigned int y,
+		 unsigned int z,
+		 struct phymodel* model,
+		 phyatom* atom,
+		 void* data) {
+  if ((x + y + z) % 7 == 0) phyatom_set_mat(atom,material_water);
+}
+
+static void
+paralleltestspiece(unsigned int index,
+		   void* data) {
+  unsigned char* done = (unsigned char*)data;
+  done[index]++;
+}
+
+static void
+paralleltests(void) {
+
+  struct phymodel* serial;
+  struct phymodel* model;
+  enum phymodellayout layout;
+  unsigned int x;
+  unsigned int y;
+  unsigned int z;
+  phyatom rock = 0;
+  
+  /*
+   * Filling a box large enough to be split across threads gives the
+   * same model as filling it on one thread
+   */
+  
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+    serial = phymodel_create(layout,1,200,130,190);
+    model = phymodel_create(layout,1,200,130,190);
+    assert(phymodel_natoms(190,130,180) >= phymodel_parallelminatoms);
+    phymodel_enablebitplanes(model);
+    parallel_setnthreads(1);
+    phymodel_fillbox(serial,5,195,0,130,7,187,rock);
+    phymodel_mapatoms(serial,paralleltestsaux,0);
+    parallel_setnthreads(4);
+    phymodel_fillbox(model,5,195,0,130,7,187,rock);
+    phymodel_mapatoms_parallel(model,paralleltestsaux,0);
+    for (z = 0; z < model->zSize; z++) {
+      for (y = 0; y < model->ySize; y++) {
+	for (x = 0; x < model->xSize; x++) {
+	  assert(*phymodel_getatom_readonly(model,x,y,z) == *phymodel_getatom_readonly(serial,x,y,z));
+	  if (phymodel_atommat(model,x,y,z) == material_rock) {
+	    assert((phymodel_bitplaneword(model,material_rock,x,y,z) & phymodel_bitplanebit(x)) != 0);
+	  }
+	}
+      }
+    }
+    if (layout == phymodellayout_sparse) {
+      assert(model->nallocatedbricks == serial->nallocatedbricks);
+    }
+    phymodel_destroy(serial);
+    phymodel_destroy(model);
+  }
+  
+  /*
+   * The threads are reused from one job to the next, with any number
+   * of them, and every piece is run once
+   */
+  
+  {
+    unsigned char done[300];
+    unsigned int round;
+    unsigned int i;
+    for (round = 0; round < 200; round++) {
+      unsigned int n = 1 + (round * 37) % 300;
+      parallel_setnthreads(1 + round % 6);
+      memset(done,0,sizeof(done));
+      parallel_for(n,paralleltestspiece,done);
+      for (i = 0; i < n; i++) assert(done[i] == 1);
+      for (; i < 300; i++) assert(done[i] == 0);
+    }
+  }
+  parallel_setnthreads(0);
+}
+
+static void
+dropplantests(void) {
+
+  static const struct atomcoordinates places[] = {
+    { 10, 10, 5 },                          /* in the air, falls on the rock */
+    { 20, 20, 19 },                         /* on the rock */
+    { 5, 30, 18 },                          /* next to a pillar, cannot move */
+    { 32, 32, 30 },                         /* in a pocket in the rock */
+    { 38, 38, 38 },                         /* at the corner of the model */
+    { 1, 20, 10 }                           /* on the limit of the model */
+  };
+  const unsigned int nplaces = sizeof(places) / sizeof(places[0]);
+  struct simulatordropplan plans[sizeof(places) / sizeof(places[0])];
+  enum phymodellayout layout;
+  phyatom rock = 0;
+  unsigned int i;
+
+  phyatom_set_mat(&rock,material_rock);
+  for (layout = phymodellayout_linear; layout <= phymodellayout_sparse; layout++) {
+    
+    struct phymodel* model = phymodel_create(layout,1,40,40,40);
+    struct simulatordroptable table;
+    
+    /*
+     * Rock from z = 20 down, with a pillar and a pocket, and drops of
+     * more than one batch of atoms. The plans are the same in every
+     * layout, whichever way the atoms under the drops are read.
+     */
+    
+    phymodel_fillbox(model,0,40,0,40,20,40,rock);
+    phymodel_fillbox(model,4,5,28,33,10,20,rock);
+    phymodel_fillbox(model,28,40,28,40,28,40,0);
+    phymodel_fillbox(model,28,36,28,36,36,40,rock);
+    phymodel_enableepochs(model);
+    simulator_droptable_initialize(&table);
+    for (i = 0; i < nplaces; i++) {
+      struct atomcoordinates place = places[i];
+      struct simulatordrop* drop = simulator_droptable_getdrop(&table);
+      unsigned int j;
+      int space = 0;
+      int limit = 0;
+      drop->size = 150;
+      (void)simulator_drop_putdrop(model,&place,drop);
+      assert(drop->natoms > 64);
+      simulator_drop_planmove(model,drop);
+      for (j = 0; j < drop->natoms; j++) {
+	struct atomcoordinates atom;
+	atomcoordinates_unpack(drop->atoms[j],&atom);
+	if (atom.x == 0 || atom.x == 39 || atom.y == 0 || atom.y == 39 || atom.z == 0 || atom.z == 39) {
+	  limit = 1;
+	  space = 1;
+	} else if (phymodel_atommat(model,atom.x,atom.y,atom.z + 1) == material_air) {
+	  space = 1;
+	}
+      }
+      assert(drop->plan.canmove == space);
+      assert(drop->plan.offmodel == (space && limit));
+      if (layout == phymodellayout_linear) {
+	plans[i] = drop->plan;
+      } else {
+	assert(plans[i].canmove == drop->plan.canmove);
+	assert(plans[i].offmodel == drop->plan.offmodel);
+	assert(plans[i].shouldfall == drop->plan.shouldfall);
+	assert(plans[i].lowestpoint == drop->plan.lowestpoint);
+	assert(simulator_coords_equal(&plans[i].lowestatom,&drop->plan.lowestatom));
+	assert(plans[i].end == drop->plan.end);
+	assert(simulator_coords_equal(&plans[i].region.lowercorner,&drop->plan.region.lowercorner));
+	assert(simulator_coords_equal(&plans[i].region.uppercorner,&drop->plan.region.uppercorner));
+      }
+    }
+    assert(plans[0].canmove && plans[0].shouldfall && plans[0].end == 19);
+    assert(!plans[2].canmove);
+    assert(plans[4].offmodel);
+    assert(plans[5].offmodel);
+    simulator_droptable_deinitialize(&table);
+    phymodel_destroy(model);
+  }
+}
+
+static void
+calcitetests(void) {
+
+  struct simulatorcalcitefield field;
+  struct phymodel* model = phymodel_create(phymodellayout_linear,1,200,200,40);
+  struct atomcoordinates atom;
+  unsigned int i;
+
+  simulator_calcite_initialize(&field);
+  atom.x = 17;
+  atom.y = 5;
+  atom.z = 30;
+  assert(simulator_calcite_amount(&field,model,&atom) == 0.0);
+  
+  /*
+   * Fractions add up to a whole atom, which is then taken, leaving
+   * the rest for the next one
+   */
+  
+  assert(!simulator_calcite_add(&field,model,&atom,0.25));
+  assert(!simulator_calcite_add(&field,model,&atom,0.5));
+  assert(simulator_calcite_amount(&field,model,&atom) == 0.75);
+  assert(simulator_calcite_add(&field,model,&atom,0.5));
+  simulator_calcite_take(&field,model,&atom);
+  assert(simulator_calcite_amount(&field,model,&atom) == 0.25);
+  
+  /*
+   * Amounts saturate below two atoms, and the neighbours in the same
+   * brick are kept apart
+   */
+  
+  for (i = 0; i < 5; i++) assert(simulator_calcite_add(&field,model,&atom,1.0));
+  assert(simulator_calcite_amount(&field,model,&atom) < 2.0);
+  assert(simulator_calcite_amount(&field,model,&atom) > 1.99);
+  atom.x++;
+  assert(simulator_calcite_amount(&field,model,&atom) == 0.0);
+  assert(field.nbricks == 1);
+  
+  /*
+   * Enough bricks to grow the table a few times
+   */
+  
+  for (i = 0; i < 200; i++) {
+    atom.x = i;
+    atom.y = (i * 37) % 200;
+    atom.z = i % 40;
+    simulator_calcite_add(&field,model,&atom,0.125);
+  }
+  for (i = 0; i < 200; i++) {
+    atom.x = i;
+    atom.y = (i * 37) % 200;
+    atom.z = i % 40;
+    assert(simulator_calcite_amount(&field,model,&atom) >= 0.125);
+  }
+  assert(field.nbricks > simulatorcalcitefield_initialsize / 2);
+  
+  simulator_calcite_deinitialize(&field);
+  phymodel_destroy(model);
+}
+
+static void
+phasetestsaux(unsigned int index,
+	      void* data) {
+  uint64_t start = simulator_phase_now();
+  simulator_phase_add(simulatorphase_planmove,start);
+}
+
+static void
+phasetests(void) {
+
+  struct simulatorphasetimes before;
+  struct simulatorphasetimes times;
+  uint64_t start;
+  unsigned int i;
+  
+  /*
+   * The times of the calling thread and of the helper threads are
+   * both counted, also when the helpers are reused
+   */
+  
+  simulator_phase_collect(&before);
+  start = simulator_phase_now();
+  simulator_phase_add(simulatorphase_putdrop,start);
+  parallel_setnthreads(4);
+  parallel_for(60,phasetestsaux,0);
+  parallel_for(40,phasetestsaux,0);
+  parallel_setnthreads(0);
+  simulator_phase_since(&times,&before);
+  assert(times.calls[simulatorphase_putdrop] == 1);
+  assert(times.calls[simulatorphase_planmove] == 100);
+  for (i = 0; i < simulatorphase_howmany; i++) {
+    assert(simulator_phase_name((enum simulatorphase)i) != 0);
+    if (i != simulatorphase_putdrop && i != simulatorphase_planmove) {
+      assert(times.calls[i] == 0);
+      assert(times.nanoseconds[i] == 0);
+    }
+  }
+}
+
+static void
+droptabletests(void) {
+
+  struct simulatordroptable table;
+  struct simulatordrop* drops[600];
+  struct simulatordrop* drop;
+  unsigned int i;
+  
+  /*
+   * The table grows past its first block, and deleted drops are
+   * reused without moving the others
+   */
+  
+  simulator_droptable_initialize(&table);
+  for (i = 0; i < 600; i++) {
+    drops[i] = simulator_droptable_getdrop(&table);
+    assert(drops[i] != 0);
+    assert(drops[i]->active);
+    assert(drops[i]->index == i);
+  }
+  assert(table.nactive == 600);
+  assert(table.ndrops == 3 * simulatordroptable_blockdrops);
+  for (i = 0; i < 600; i += 2) {
+    simulator_droptable_deletedrop(&table,drops[i]);
+    assert(!drops[i]->active);
+  }
+  assert(table.nactive == 300);
+  for (i = 0; i < table.nactive; i++) {
+    assert(table.active[i]->active);
+    assert(table.active[i]->activeindex == i);
+    assert(table.active[i]->index % 2 == 1);
+  }
+  drop = simulator_droptable_getdrop(&table);
+  assert(drop == drops[598]);
+  assert(drop->natoms == 0);
+  assert(table.nactive == 301);
+  assert(table.ndrops == 3 * simulatordroptable_blockdrops);
+  
+  /*
+   * The table remembers the lowest place awake drops were removed
+   * from, and reused drops have not moved
+   */
+  
+  table.firstunlisted = table.nactive;
+  simulator_droptable_deletedrop(&table,table.active[100]);
+  drop = table.active[7];
+  drop->movedepoch = 5;
+  simulator_droptable_deletedrop(&table,drop);
+  assert(table.firstunlisted == 7);
+  assert(table.nactive == 299);
+  assert(simulator_droptable_getdrop(&table) == drop);
+  assert(drop->movedepoch == 0);
+  simulator_droptable_deinitialize(&table);
+  
+  /*
+   * Atom lists and packed coordinates
+   */
+  
+  {
+    struct simulatordropatoms pool;
+    struct atomcoordinates coords;
+    atompackedcoordinates* atoms1;
+    atompackedcoordinates* atoms2;
+    unsigned int capacity1;
+    unsigned int capacity2;
+    
+    coords.x = atomcoordinates_packmax - 1;
+    coords.y = 5;
+    coords.z = 1234567;
+    simulator_dropatoms_initialize(&pool);
+    atoms1 = simulator_dropatoms_allocate(&pool,30,&capacity1);
+    assert(capacity1 == 32);
+    atoms1[29] = atomcoordinates_pack(&coords);
+    memset(&coords,0,sizeof(coords));
+    atomcoordinates_unpack(atoms1[29],&coords);
+    assert(coords.x == atomcoordinates_packmax - 1);
+    assert(coords.y == 5);
+    assert(coords.z == 1234567);
+    atoms2 = simulator_dropatoms_allocate(&pool,100000,&capacity2);
+    assert(capacity2 >= 100000);
+    atoms2[99999] = atoms1[29];
+    simulator_dropatoms_free(&pool,atoms1,capacity1);
+    assert(simulator_dropatoms_allocate(&pool,17,&capacity1) == atoms1);
+    simulator_dropatoms_free(&pool,atoms2,capacity2);
+    simulator_dropatoms_deinitialize(&pool);
+  }  
+  /*
+   * Atom owners, with removals in the middle of probe sequences
+   */
+  
+  {
+    struct simulatordrophash hash;
+    struct simulatordrop* owner1 = (struct simulatordrop*)&hash;
+    struct simulatordrop* owner2 = (struct simulatordrop*)&table;
+    struct atomcoordinates coords;
+    
+    simulator_drophash_initialize(&hash);
+    for (i = 0; i < 5000; i++) {
+      coords.x = i % 17;
+      coords.y = i / 17;
+      coords.z = i % 3;
+      simulator_drophash_set(&hash,atomcoordinates_pack(&coords),(i % 2) ? owner1 : owner2);
+    }
+    assert(hash.nentries == 5000);
+    for (i = 0; i < 5000; i += 3) {
+      coords.x = i % 17;
+      coords.y = i / 17;
+      coords.z = i % 3;
+      simulator_drophash_remove(&hash,atomcoordinates_pack(&coords));
+    }
+    for (i = 0; i < 5000; i++) {
+      coords.x = i % 17;
+      coords.y = i / 17;
+      coords.z = i % 3;
+      assert(simulator_drophash_get(&hash,atomcoordinates_pack(&coords)) ==
+	     ((i % 3 == 0) ? 0 : (i % 2) ? owner1 : owner2));
+    }
+    simulator_drophash_deinitialize(&hash);
+  }
+  
+  /*
+   * Sleeping drops wake up when the model changes next to them, but
+   * not when it changes elsewhere
+   */
+  
+  {
+    struct phymodel* model = phymodel_create(phymodellayout_bricked,1,40,40,40);
+    atompackedcoordinates atoms[2];
+    struct simulatordrop* sleeper;
+    struct atomcoordinates coords;
+    
+    simulator_droptable_initialize(&table);
+    phymodel_enableepochs(model);
+    sleeper = simulator_droptable_getdrop(&table);
+    drop = simulator_droptable_getdrop(&table);
+    coords.x = 15;
+    coords.y = 20;
+    coords.z = 20;
+    atoms[0] = atomcoordinates_pack(&coords);
+    coords.x = 17;
+    atoms[1] = atomcoordinates_pack(&coords);
+    sleeper->atoms = atoms;
+    sleeper->natoms = 2;
+    simulator_droptable_sleep(&table,model,sleeper,1);
+    assert(sleeper->sleeping);
+    assert(table.nactive == 1 && table.active[0] == drop);
+    assert(table.nsleeping == 1 && table.sleeping[0] == sleeper);
+    phymodel_nextepoch(model);
+    phymodel_setatommat(model,35,35,35,material_rock);
+    phymodel_setatommat(model,33,20,20,material_rock);
+    assert(phymodel_boxchanged(model,32,33,0,40,0,40));
+    assert(phymodel_boxchanged(model,0,100,0,100,34,100));
+    assert(!phymodel_boxchanged(model,0,32,0,32,0,32));
+    assert(!phymodel_boxchanged(model,0,40,0,40,40,50));
+    assert(simulator_droptable_wakechanged(&table,model) == 0);
+    phymodel_nextepoch(model);
+    phymodel_setatommat(model,15,20,21,material_rock);
+    assert(simulator_droptable_wakechanged(&table,model) == 1);
+    assert(!sleeper->sleeping);
+    assert(table.nactive == 2 && table.active[1] == sleeper);
+    assert(table.nsleeping == 0);
+    simulator_droptable_sleep(&table,model,sleeper,1);
+    sleeper->atoms = 0;
+    sleeper->natoms = 0;
+    simulator_droptable_deletedrop(&table,sleeper);
+    assert(table.nsleeping == 0);
+    phymodel_nextepoch(model);
+    phymodel_setatommat(model,15,20,19,material_rock);
+    assert(simulator_droptable_wakechanged(&table,model) == 0);
+    simulator_droptable_deinitialize(&table);
+    phymodel_destroy(model);
+  }
+}
+
+static void
+eventqueuetests(void) {
+  
+  struct simulatoreventqueue queue;
+  struct simulatorevent event;
+  unsigned long long round;
+  unsigned int i;
+  
+  /*
+   * Events come out in the order of their rounds, even beyond 32
+   * bits, and within a round in the order of their types
+   */
+  
+  simulator_eventqueue_initialize(&queue);
+  for (i = 0; i < 100; i++) {
+    simulator_eventqueue_schedule(&queue,(i * 37) % 100 + 5000000000ULL,simulatorevent_snapshot);
+  }
+  simulator_eventqueue_schedule(&queue,5000000007ULL,simulatorevent_createdrop);
+  simulator_eventqueue_schedule(&queue,5000000007ULL,simulatorevent_movedrops);
+  simulator_eventqueue_schedule(&queue,3,simulatorevent_createdrop);
+  assert(simulator_eventqueue_next(&queue,&event));
+  assert(event.round == 3);
+  round = 0;
+  for (i = 0; i < 102; i++) {
+    assert(simulator_eventqueue_next(&queue,&event));
+    assert(event.round >= round);
+    round = event.round;
+    if (i == 7) assert(event.round == 5000000007ULL && event.type == simulatorevent_movedrops);
+    if (i == 8) assert(event.round == 5000000007ULL && event.type == simulatorevent_createdrop);
+    if (i == 9) assert(event.round == 5000000007ULL && event.type == simulatorevent_snapshot);
+  }
+  assert(!simulator_eventqueue_next(&queue,&event));
+  simulator_eventqueue_deinitialize(&queue);
+}
+
+static void
+entryindextests(void) {
+  
+  struct phymodel* model = phymodel_create(phymodellayout_bricked,1,1100,40,20);
+  struct simulatorentryindex index;
+  struct rngstream rng;
+  const unsigned int level = 10;
+  phyatom rock = 0;
+  unsigned int round;
+  unsigned int i;
+  
+  /*
+   * Searches through the index find the same holes as scanning the
+   * starting level atom by atom, also when the model changes and
+   * across more than 64 bricks
+   */
+  
+  phyatom_set_mat(&rock,material_rock);
+  rng_seedstream(&rng,1,rngpurpose_drop,0);
+  phymodel_fillbox(model,0,1100,0,40,5,20,rock);
+  for (i = 0; i < 30; i++) {
+    phymodel_setatommat(model,rng_below(&rng,1100),rng_below(&rng,40),level,material_air);
+  }
+  phymodel_setatommat(model,3,4,6,material_air);
+  phymodel_enableepochs(model);
+  simulator_entryindex_initialize(&index,model,level);
+  for (round = 0; round < 4; round++) {
+    for (i = 0; i < 2000; i++) {
+      struct atomcoordinates place1;
+      struct atomcoordinates place2;
+      enum direction direction = (enum direction)rng_below(&rng,direction_howmany);
+      place1.x = (i < 40) ? ((i & 1) ? 1099 : 0) : rng_below(&rng,1100);
+      place1.y = rng_below(&rng,40);
+      place1.z = level;
+      place2 = place1;
+      assert(simulator_entryindex_findhole(&index,model,&place1,direction) ==
+	     entryindexscan(model,&place2,direction));
+      assert(place1.x == place2.x && place1.y == place2.y && place1.z == place2.z);
+    }
+    for (i = 0; i < 20; i++) {
+      phymodel_setatommat(model,rng_below(&rng,1100),rng_below(&rng,40),level,
+			  rng_below(&rng,2) ? material_air : material_rock);
+    }
+    phymodel_setatommat(model,3,4,level - 1 - round,material_air);
+    if (round & 1) phymodel_nextepoch(model);
+  }
+  simulator_entryindex_deinitialize(&index);
+  phymodel_destroy(model);
+}
+
+static int
+entryindexscan(struct phymodel* model,
+	       struct atomcoordinates* place,
+	       enum direction direction) {
+  for (;;) {
+    if (phymodel_atomisfree(model,place->x,place->y,place->z)) return(1);
+    switch (direction) {
+    case direction_x_towards0: if (place->x == 0) return(0); place->x--; break;
+    case direction_x_towardsn: if (place->x == model->xSize - 1) return(0); place->x++; break;
+    case direction_y_towards0: if (place->y == 0) return(0); place->y--; break;
+    case direction_z_towards0: if (place->z == 0) return(0); place->z--; break;
+    default: if (place->y == model->ySize - 1) return(0); place->y++; break;
+    }
+  }
+}
+
+static void
+rngtests(void) {
+  
+  const uint32_t zerocounter[4] = { 0, 0, 0, 0 };
+  const uint32_t zerokey[2] = { 0, 0 };
+  struct rngstream stream1;
+  struct rngstream stream2;
+  struct rngstream child;
+  uint32_t block[4];
+  uint32_t values[11];
+  unsigned int i;
+  
+  /*
+   * The Philox4x32-10 known answer for a zero counter and key
+   */
+  
+  rng_philox(zerocounter,zerokey,block);
+  assert(block[0] == 0x6627e8d5 && block[1] == 0xe169c58d);
+  assert(block[2] == 0xbc57ac4c && block[3] == 0x9b00dbd8);
+  
+  /*
+   * Streams are reproducible from the seed, filling gives the same
+   * numbers as taking them one by one, and other streams differ
+   */
+  
+  rng_setseed(42);
+  rng_stream(&stream1,rngpurpose_drop,7);
+  rng_stream(&stream2,rngpurpose_drop,7);
+  assert(rng_next(&stream1) == rng_next(&stream2));
+  rng_fill(&stream1,values,11);
+  for (i = 0; i < 11; i++) assert(values[i] == rng_next(&stream2));
+  rng_stream(&stream2,rngpurpose_drop,8);
+  rng_stream(&stream1,rngpurpose_drop,7);
+  assert(rng_next(&stream1) != rng_next(&stream2));
+  rng_substream(&child,&stream1,0);
+  assert(rng_next(&child) != rng_next(&stream1));
+  for (i = 0; i < 1000; i++) {
+    double u = rng_uniform(&stream1);
+    assert(u >= 0.0 && u < 1.0);
+    assert(rng_below(&stream1,3) < 3);
+  }
+}
+
+static void
+largefiletests(void) {
+
+  /*
+   * A model of 2048x1024x2049 atoms is just over 4 GiB, so
+   * addressing the last planes of it requires 64-bit indexes and
+   * large-file I/O. The model is backed by a sparse file, so only the
+   * touched pages take space.
+   */
+  
+  const char* filename = "test.large.mod";
+  const unsigned int xSize = 2048;
+  const unsigned int ySize = 1024;
+  const unsigned int zSize = 2049;
+  struct phymodel* model = phymodel_create_file(filename,phymodellayout_linear,1000,xSize,ySize,zSize);
+  struct rgb red;
+  
+  assert(phymodel_natoms(xSize,ySize,zSize) > 0xFFFFFFFFULL);
+  assert(phymodel_atomindex(model,xSize-1,ySize-1,zSize-1) > 0xFFFFFFFFULL);
+  assert(phymodel_atommat(model,0,0,0) == material_air);
+  assert(phymodel_atommat(model,xSize-1,ySize-1,zSize-1) == material_air);
+  rgb_set_red(&red);
+  phyatom_set_mat(phymodel_getatom(model,1,2,3),material_rock);
+  phyatom_set_mat(phymodel_getatom(model,xSize-1,ySize-1,zSize-1),material_water);
+  phyatom_set_mat(phymodel_getatom(model,5,6,zSize-2),material_rock);
+  phyatom_set_color(phymodel_getatom(model,5,6,zSize-2),&red);
+  phymodel_write(model,filename);
+  phymodel_destroy(model);
+
+  /*
+   * Read it back and check that the atoms beyond 4 GiB survived
+   */
+  
+  model = phymodel_read(filename,phymodelaccess_readonly);
+  assert(model->xSize == xSize);
+  assert(model->ySize == ySize);
+  assert(model->zSize == zSize);
+  assert(phymodel_atommat(model,0,0,0) == material_air);
+  assert(phymodel_atommat(model,1,2,3) == material_rock);
+  assert(phymodel_atommat(model,xSize-1,ySize-1,zSize-1) == material_water);
+  assert(phymodel_atommat(model,xSize-2,ySize-1,zSize-1) == material_air);
+  assert(phymodel_atommat(model,5,6,zSize-2) == material_rock);
+  assert(phyatom_color_rgb_r(phymodel_getatom(model,5,6,zSize-2)) == 0x03);
+  assert(phyatom_color_rgb_g(phymodel_getatom(model,5,6,zSize-2)) == 0x00);
+  phymodel_destroy(model);
+  unlink(filename);
 }
@@ -28,7 +28,9 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "util.h"
+#include "rng.h"
 
 int debug = 0;
 int deepdebug = 0;
@@ -70,6 +72,37 @@ fatalsu(const char* message,
   exit(1);
 }
 
+void
+fatalz(const char* message,
+       size_t x) {
+  fprintf(stderr,"drop-tracer: error: %s: %zu -- exit\n",
+	  message,
+	  x);
+  exit(1);
+}
+
+void
+fatalsz(const char* message,
+	const char* string,
+	size_t x) {
+  fprintf(stderr,"drop-tracer: error: %s: %s: %zu -- exit\n",
+	  message,
+	  string,
+	  x);
+  exit(1);
+}
+
+void
+fatalzz(const char* message,
+	size_t x1,
+	size_t x2) {
+  fprintf(stderr,"drop-tracer: error: %s: %zu: %zu -- exit\n",
+	  message,
+	  x1,
+	  x2);
+  exit(1);
+}
+
 void
 fatalxx(const char* message,
 	unsigned int x1,
@@ -106,54 +139,36 @@ fatalsxx(const char* message,
 }
 
 void
-debugf(const char* format, ...) {
+debugprintf(int level,
+	    const char* format,
+	    ...) {
   
-  assert(format != 0);
- 
-  if (debug) {
-    
-    va_list args;
-    printf("debug: ");
-    va_start (args, format);
-    vprintf(format, args);
-    va_end (args);
-    printf("\n");
-    
-  }
-}
-
-void
-deepdebugf(const char* format, ...) {
+  static const char* prefixes[] = { "debug: ", "debug: ", "debug:   ", "debug:     " };
+  va_list args;
   
   assert(format != 0);
- 
-  if (deepdebug) {
-    
-    va_list args;
-    printf("debug:   ");
-    va_start (args, format);
-    vprintf(format, args);
-    va_end (args);
-    printf("\n");
-    
-  }
+  assert(level >= 1 && level <= 3);
+  printf("%s", prefixes[level]);
+  va_start (args, format);
+  vprintf(format, args);
+  va_end (args);
+  printf("\n");
 }
 
-void
-deepdeepdebugf(const char* format, ...) {
+int
+samefile(const char* filename1,
+	 const char* filename2) {
   
-  assert(format != 0);
- 
-  if (deepdeepdebug) {
-    
-    va_list args;
-    printf("debug:     ");
-    va_start (args, format);
-    vprintf(format, args);
-    va_end (args);
-    printf("\n");
-    
-  }
+  /*
+   * Two names are for the same file if they lead to the same inode,
+   * whatever the paths look like
+   */
+  
+  struct stat stat1;
+  struct stat stat2;
+  if (stat(filename1,&stat1) != 0) return(0);
+  if (stat(filename2,&stat2) != 0) return(0);
+  return(stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino);
 }
 
 unsigned int
@@ -179,7 +194,8 @@ stringendswith(const char *string,
 }
 
 unsigned int
-randompickwithinrange(unsigned int value,
+randompickwithinrange(struct rngstream* rng,
+		      unsigned int value,
                       unsigned int maxsmaller,
                       unsigned int maxlarger,
                       unsigned int maxvalue) {
@@ -196,7 +212,7 @@ randompickwithinrange(unsigned int value,
   unsigned int range = maxsmaller + maxlarger;
 
   // Then use random to pick a value in that range
-  unsigned int finalvalue = start + (rand() % range);
+  unsigned int finalvalue = start + rng_below(rng,range);
 
   // Done. Return the new value.
   return(finalvalue);
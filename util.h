@@ -26,6 +26,10 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+
+struct rngstream;
+
 extern int debug;
 extern int deepdebug;
 extern int deepdeepdebug;
@@ -37,6 +41,14 @@ extern void fatalu(const char* message,
 extern void fatalsu(const char* message,
 		    const char* string,
 		    unsigned int x);
+extern void fatalz(const char* message,
+		   size_t x);
+extern void fatalsz(const char* message,
+		    const char* string,
+		    size_t x);
+extern void fatalzz(const char* message,
+		    size_t x1,
+		    size_t x2);
 extern void fataluu(const char* message,
 		    unsigned int x1,
 		    unsigned int x2);
@@ -47,20 +59,42 @@ extern void fatalsxx(const char* message,
 		     const char* string,
 		     unsigned int x1,
 		     unsigned int x2);
-extern void debugf(const char* format,
-		   ...);
-extern void deepdebugf(const char* format,
-                       ...);
-extern void deepdeepdebugf(const char* format,
-                           ...);
+extern void debugprintf(int level,
+			const char* format,
+			...);
+
+/*
+ * Debug output has three levels, switched on at run time with
+ * --debug, --deepdebug and --deepdeepdebug. The levels above
+ * DEBUG_LEVEL are not compiled in at all; for the others, whether the
+ * level is on is checked inline, so that the arguments are evaluated
+ * and the output function called only when it is. Build with, for
+ * instance, "make DEBUGLEVEL=1" to leave out the deeper levels.
+ */
+
+#ifndef DEBUG_LEVEL
+#define DEBUG_LEVEL		3
+#endif
+
+#define debuglevel(level,on,...)	do {						\
+					  if ((level) <= DEBUG_LEVEL && (on))	\
+					    debugprintf((level),__VA_ARGS__);	\
+					} while (0)
+#define debugf(...)			debuglevel(1,debug,__VA_ARGS__)
+#define deepdebugf(...)			debuglevel(2,deepdebug,__VA_ARGS__)
+#define deepdeepdebugf(...)		debuglevel(3,deepdeepdebug,__VA_ARGS__)
 extern unsigned int
 subsorzero(unsigned int a,
 	   unsigned int b);
 extern int
 stringendswith(const char *string,
 	       const char *suffix);
+extern int
+samefile(const char* filename1,
+	 const char* filename2);
 extern unsigned int
-randompickwithinrange(unsigned int value,
+randompickwithinrange(struct rngstream* rng,
+		      unsigned int value,
                       unsigned int maxsmaller,
                       unsigned int maxlarger,
                       unsigned int maxvalue);